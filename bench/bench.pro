@@ -0,0 +1,16 @@
+######################################################################
+# Pseudo terminal FDC+ simulator and throughput benchmark (Unix)
+######################################################################
+
+TEMPLATE = app
+TARGET = fdc-bench
+INCLUDEPATH += .
+CONFIG += console
+CONFIG -= app_bundle
+QT = core
+QT += serialport
+
+include(../libfdc/libfdc.pri)
+
+# Input
+SOURCES += fdc-bench.cpp
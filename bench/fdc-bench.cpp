@@ -0,0 +1,631 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Benchmark
+*      Simulates an FDC+ on the master side of a pseudo terminal and drives
+*      the protocol worker, which serves on the slave side, with STAT, READ
+*      and WRIT traffic. Reports transactions/s, bytes/s and response
+*      latency. A pty has no line rate, so the run is unthrottled unless
+*      --baud paces it to a real serial port. --replay runs a captured
+*      transaction trace instead of a synthetic workload, and --trace
+*      captures the run.
+*
+***********************************************************************************/
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QFile>
+#include <QRandomGenerator>
+#include <QTextStream>
+#include <QVector>
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "fdc-worker.h"
+#include "fdc-trace.h"
+
+#define BENCH_TRACKS		77			// 8" image, 77 tracks of 137 byte sectors
+#define BENCH_TRACKLEN		(137*32)
+#define BENCH_TIMEOUT		1000			// response timeout (ms)
+#define BENCH_STAT_EVERY	10			// STAT after this many READ/WRIT, like the FDC's polling
+#define BENCH_BURST		8			// tracks per write burst
+
+#define WORKLOAD_SEQ		0			// sequential track sweeps
+#define WORKLOAD_RANDOM		1			// random seeks
+#define WORKLOAD_WRITE		2			// write bursts followed by read back
+#define WORKLOAD_MIX		3			// 70% READ, 30% WRIT at random
+
+static QTextStream out(stdout);
+
+//
+// Simulated FDC+ on the pty master
+//
+class FDCSimulator
+{
+public:
+	FDCSimulator(int fd, quint32 baud);
+
+	bool stat(quint16 driveNum) { return stat(0x0100 | driveNum, 0); }
+	bool read(quint16 driveNum, quint16 track) { return read((driveNum << 12) | track, BENCH_TRACKLEN); }
+	bool write(quint16 driveNum, quint16 track) { return write((driveNum << 12) | track, BENCH_TRACKLEN); }
+	bool replay(const ttracerecord_t &rec);
+
+	FDCLatencyHistogram latency[STATUS_COMMANDS];
+	quint64 txBytes;
+	quint64 rxBytes;
+	quint32 errors;
+
+private:
+	int fd;
+	quint32 baudRate;
+	QElapsedTimer clock;
+	qint64 lineFree;				// when the paced line is next idle (ns)
+	tcommand_t cmd;
+	quint8 trkBuf[TRKBUF_SIZE + CRC_LEN];
+
+	bool stat(quint16 param1, quint16 param2);
+	bool read(quint16 param1, quint16 trackLen);
+	bool write(quint16 param1, quint16 trackLen);
+	void command(const char *name, quint16 param1, quint16 param2);
+	bool send(const quint8 *data, int len);
+	bool receive(quint8 *data, int len);
+	bool response(const char *name);
+	void pace(int len);
+};
+
+FDCSimulator::FDCSimulator(int masterFd, quint32 baud)
+{
+	fd = masterFd;
+	baudRate = baud;
+	txBytes = 0;
+	rxBytes = 0;
+	errors = 0;
+	lineFree = 0;
+	clock.start();
+}
+
+void FDCSimulator::command(const char *name, quint16 param1, quint16 param2)
+{
+	memcpy(cmd.command, name, 4);
+	cmd.param1 = param1;
+	cmd.param2 = param2;
+	cmd.checksum = calcChecksum(cmd.asBytes, CMD_LEN);
+}
+
+//
+// At a real baud rate each direction carries one byte per 10 bit times.
+// Transfers are serialized, so one line clock covers both directions.
+//
+void FDCSimulator::pace(int len)
+{
+	if (!baudRate) {
+		return;
+	}
+
+	qint64 now = clock.nsecsElapsed();
+
+	lineFree = qMax(lineFree, now) + (qint64) len * 10 * 1000000000LL / baudRate;
+
+	if (lineFree > now) {
+		QThread::usleep((lineFree - now) / 1000);
+	}
+}
+
+bool FDCSimulator::send(const quint8 *data, int len)
+{
+	pace(len);
+
+	while (len > 0) {
+		ssize_t n = ::write(fd, data, len);
+
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return false;
+		}
+
+		data += n;
+		len -= n;
+		txBytes += n;
+	}
+
+	return true;
+}
+
+bool FDCSimulator::receive(quint8 *data, int len)
+{
+	struct pollfd pfd;
+	int total = len;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (len > 0) {
+		if (poll(&pfd, 1, BENCH_TIMEOUT) <= 0) {
+			errors++;
+			tcflush(fd, TCIFLUSH);
+			return false;
+		}
+
+		ssize_t n = ::read(fd, data, len);
+
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			errors++;
+			return false;
+		}
+
+		data += n;
+		len -= n;
+		rxBytes += n;
+	}
+
+	pace(total);
+
+	return true;
+}
+
+bool FDCSimulator::response(const char *name)
+{
+	tcommand_t rsp;
+
+	if (!receive(rsp.asBytes, CMDBUF_SIZE)) {
+		return false;
+	}
+
+	if (memcmp(rsp.command, name, 4) || rsp.checksum != calcChecksum(rsp.asBytes, CMD_LEN) || rsp.rcode != STAT_OK) {
+		errors++;
+		return false;
+	}
+
+	return true;
+}
+
+bool FDCSimulator::stat(quint16 param1, quint16 param2)
+{
+	command("STAT", param1, param2);
+
+	qint64 start = clock.nsecsElapsed();
+
+	if (!send(cmd.asBytes, CMDBUF_SIZE) || !response("STAT")) {
+		return false;
+	}
+
+	latency[FDC_CMD_STAT].record(clock.nsecsElapsed() - start);
+
+	return true;
+}
+
+bool FDCSimulator::read(quint16 param1, quint16 trackLen)
+{
+	quint16 checksum;
+
+	command("READ", param1, trackLen);
+
+	qint64 start = clock.nsecsElapsed();
+
+	if (!send(cmd.asBytes, CMDBUF_SIZE) || !receive(trkBuf, trackLen + CRC_LEN)) {
+		return false;
+	}
+
+	latency[FDC_CMD_READ].record(clock.nsecsElapsed() - start);
+
+	checksum = calcChecksum(trkBuf, trackLen);
+
+	if (trkBuf[trackLen] != (checksum & 0xff) || trkBuf[trackLen + 1] != (checksum >> 8)) {
+		errors++;
+		return false;
+	}
+
+	return true;
+}
+
+bool FDCSimulator::write(quint16 param1, quint16 trackLen)
+{
+	quint16 checksum;
+
+	command("WRIT", param1, trackLen);
+
+	if (!send(cmd.asBytes, CMDBUF_SIZE) || !response("WRIT")) {
+		return false;
+	}
+
+	memset(trkBuf, (param1 >> 8) ^ param1, trackLen);
+	checksum = calcChecksum(trkBuf, trackLen);
+	trkBuf[trackLen] = checksum & 0xff;
+	trkBuf[trackLen + 1] = checksum >> 8;
+
+	if (!send(trkBuf, trackLen + CRC_LEN)) {
+		return false;
+	}
+
+	// Same measure as the server: last data byte to WSTA
+	qint64 start = clock.nsecsElapsed();
+
+	if (!response("WSTA")) {
+		return false;
+	}
+
+	latency[FDC_CMD_WRIT].record(clock.nsecsElapsed() - start);
+
+	return true;
+}
+
+//
+// Repeat a traced transaction with its original parameters. Track data
+// is not traced, so WRIT sends a fill pattern.
+//
+bool FDCSimulator::replay(const ttracerecord_t &rec)
+{
+	switch (rec.opcode) {
+		case OP_STAT:
+			return stat(rec.param1, rec.param2);
+
+		case OP_READ:
+			return read(rec.param1, rec.param2);
+
+		case OP_WRIT:
+			return write(rec.param1, rec.param2);
+	}
+
+	return false;
+}
+
+static int workloadNumber(const QString &name)
+{
+	if (name == "random") {
+		return WORKLOAD_RANDOM;
+	}
+	if (name == "write") {
+		return WORKLOAD_WRITE;
+	}
+	if (name == "mix") {
+		return WORKLOAD_MIX;
+	}
+
+	return WORKLOAD_SEQ;
+}
+
+static bool createImage(const QString &fname, int tracks = BENCH_TRACKS, int trackLen = BENCH_TRACKLEN)
+{
+	QFile file(fname);
+	QByteArray track(trackLen, 0);
+
+	if (!file.open(QIODevice::WriteOnly)) {
+		return false;
+	}
+
+	for (int t = 0; t < tracks; t++) {
+		track.fill(t);
+		if (file.write(track) != trackLen) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//
+// Image geometry for replay, from the highest track and the track length
+// each drive was accessed with. Images are sized so the server guesses
+// the same drive type as the traced one.
+//
+typedef struct TREPLAYDRIVE {
+	int maxTrack;					// -1 if the drive is not used
+	int trackLen;
+} treplaydrive_t;
+
+static bool loadTrace(const QString &fname, QVector<ttracerecord_t> *records, treplaydrive_t *drive)
+{
+	FDCTraceReader reader;
+	ttracerecord_t rec;
+
+	if (!reader.open(fname)) {
+		qWarning().noquote() << reader.errorString();
+		return false;
+	}
+
+	for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+		drive[driveNum].maxTrack = -1;
+		drive[driveNum].trackLen = BENCH_TRACKLEN;
+	}
+
+	while (reader.next(&rec)) {
+		// Ignored commands would only time out
+		if (rec.flags & (TRACE_NO_RESPONSE | TRACE_TIMEOUT)) {
+			continue;
+		}
+
+		if ((rec.opcode == OP_READ || rec.opcode == OP_WRIT) && rec.param2 && rec.param2 <= TRKBUF_SIZE) {
+			treplaydrive_t *d = &drive[rec.param1 >> 12];
+
+			d->maxTrack = qMax(d->maxTrack, rec.param1 & 0x0fff);
+			d->trackLen = rec.param2;
+		}
+
+		records->append(rec);
+	}
+
+	if (reader.dropped()) {
+		qWarning().noquote() << QString("%1: %2 transactions were dropped during capture").arg(fname).arg(reader.dropped());
+	}
+
+	return true;
+}
+
+static int replayTracks(int maxTrack)
+{
+	if (maxTrack < 35) {
+		return 35;
+	}
+	if (maxTrack < 77) {
+		return 77;
+	}
+
+	return 2048;
+}
+
+static void report(const char *name, const FDCLatencyHistogram &hist)
+{
+	if (!hist.count()) {
+		return;
+	}
+
+	out << QString("  %1 %2 %3 %4 %5 %6")
+		.arg(name)
+		.arg(hist.count(), 10)
+		.arg(hist.percentile(0.50) / 1000.0, 10, 'f', 3)
+		.arg(hist.percentile(0.95) / 1000.0, 10, 'f', 3)
+		.arg(hist.percentile(0.99) / 1000.0, 10, 'f', 3)
+		.arg(hist.peak() / 1000.0, 10, 'f', 3) << "\n";
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("fdc-bench");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("FDC+ Serial Drive Server benchmark over a pseudo terminal");
+	parser.addHelpOption();
+
+	QCommandLineOption workloadOption(QStringList() << "w" << "workload", "seq, random, write or mix (default seq).", "name", "seq");
+	QCommandLineOption opsOption(QStringList() << "n" << "ops", "READ/WRIT transactions to run (default 5000).", "count", "5000");
+	QCommandLineOption drivesOption(QStringList() << "d" << "drives", "Drives to spread the load over (default 4).", "count", "4");
+	QCommandLineOption baudOption(QStringList() << "b" << "baud", "Pace to <rate> baud, 0 for unthrottled (default 0).", "rate", "0");
+	QCommandLineOption noCacheOption("no-cache", "Disable the track cache.");
+	QCommandLineOption writeBehindOption("write-behind", "Enable write-behind.");
+	QCommandLineOption noReadAheadOption("no-read-ahead", "Disable track read ahead.");
+	QCommandLineOption mappedOption("mapped", "Use memory mapped images.");
+	QCommandLineOption replayOption("replay", "Replay the transactions in trace <file>.", "file");
+	QCommandLineOption realtimeOption("realtime", "Replay with the traced gaps between transactions.");
+	QCommandLineOption traceOption("trace", "Capture the server's transactions to <file>.", "file");
+
+	parser.addOption(workloadOption);
+	parser.addOption(opsOption);
+	parser.addOption(drivesOption);
+	parser.addOption(baudOption);
+	parser.addOption(noCacheOption);
+	parser.addOption(writeBehindOption);
+	parser.addOption(noReadAheadOption);
+	parser.addOption(mappedOption);
+	parser.addOption(replayOption);
+	parser.addOption(realtimeOption);
+	parser.addOption(traceOption);
+	parser.process(app);
+
+	int workload = workloadNumber(parser.value(workloadOption));
+	int ops = parser.value(opsOption).toInt();
+	int drives = qBound(1, parser.value(drivesOption).toInt(), MAX_DRIVE);
+	quint32 baud = parser.value(baudOption).toUInt();
+	bool replay = parser.isSet(replayOption);
+	QVector<ttracerecord_t> records;
+	treplaydrive_t drive[MAX_DRIVE];
+
+	if (replay) {
+		if (!loadTrace(parser.value(replayOption), &records, drive)) {
+			return 1;
+		}
+		ops = records.size();
+	}
+	else {
+		for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+			drive[driveNum].maxTrack = (driveNum < drives) ? BENCH_TRACKS - 1 : -1;
+			drive[driveNum].trackLen = BENCH_TRACKLEN;
+		}
+	}
+
+	// Pseudo terminal, the worker opens the slave like a serial port
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		qWarning("Could not create a pseudo terminal");
+		return 1;
+	}
+
+	struct termios tio;
+
+	tcgetattr(master, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(master, TCSANOW, &tio);
+
+	QString slave = QString::fromLocal8Bit(ptsname(master));
+
+	// Scratch images
+	QTemporaryDir dir;
+
+	if (!dir.isValid()) {
+		qWarning("Could not create a temporary directory");
+		return 1;
+	}
+
+	// Worker on its own thread, as in the GUI
+	QThread workerThread;
+	FDCWorker *worker = new FDCWorker;
+	bool opened = false;
+
+	worker->moveToThread(&workerThread);
+	QObject::connect(&workerThread, &QThread::finished, worker, &QObject::deleteLater);
+	QObject::connect(worker, &FDCWorker::errorMessage, [](const QString &text) { qWarning().noquote() << text; });
+	workerThread.start(QThread::HighestPriority);
+
+	auto stop = [&]() {
+		QMetaObject::invokeMethod(worker, "shutdown", Qt::BlockingQueuedConnection);
+		workerThread.quit();
+		workerThread.wait();
+		close(master);
+	};
+
+	QMetaObject::invokeMethod(worker, "setTrackCache", Qt::BlockingQueuedConnection, Q_ARG(bool, !parser.isSet(noCacheOption)));
+	QMetaObject::invokeMethod(worker, "setWriteBehind", Qt::BlockingQueuedConnection, Q_ARG(bool, parser.isSet(writeBehindOption)));
+	QMetaObject::invokeMethod(worker, "setReadAhead", Qt::BlockingQueuedConnection, Q_ARG(bool, !parser.isSet(noReadAheadOption)));
+	QMetaObject::invokeMethod(worker, "setImageBackend", Qt::BlockingQueuedConnection,
+		Q_ARG(int, (parser.isSet(mappedOption)) ? IMAGE_MAPPED : IMAGE_FILE), Q_ARG(int, FLUSH_UNMOUNT));
+
+	for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+		QString fname = dir.filePath(QString("drive%1.dsk").arg(driveNum));
+		int tracks = (replay) ? replayTracks(drive[driveNum].maxTrack) : BENCH_TRACKS;
+		int maxTrack = -1;
+
+		if (drive[driveNum].maxTrack < 0) {
+			continue;
+		}
+
+		if (createImage(fname, tracks, drive[driveNum].trackLen)) {
+			QMetaObject::invokeMethod(worker, "mountDrive", Qt::BlockingQueuedConnection,
+				Q_RETURN_ARG(int, maxTrack), Q_ARG(int, driveNum), Q_ARG(QString, fname));
+		}
+
+		if (maxTrack != tracks - 1) {
+			qWarning().noquote() << QString("Could not mount %1").arg(fname);
+			stop();
+			return 1;
+		}
+	}
+
+	QMetaObject::invokeMethod(worker, "openSerialPort", Qt::BlockingQueuedConnection,
+		Q_RETURN_ARG(bool, opened), Q_ARG(QString, slave), Q_ARG(int, 230400));
+
+	if (!opened) {
+		qWarning().noquote() << QString("Could not open %1").arg(slave);
+		stop();
+		return 1;
+	}
+
+	if (parser.isSet(traceOption)) {
+		bool traced = false;
+
+		QMetaObject::invokeMethod(worker, "startTrace", Qt::BlockingQueuedConnection,
+			Q_RETURN_ARG(bool, traced), Q_ARG(QString, parser.value(traceOption)));
+
+		if (!traced) {
+			stop();
+			return 1;
+		}
+	}
+
+	// Run
+	FDCSimulator fdc(master, baud);
+	QRandomGenerator *rng = QRandomGenerator::global();
+	QElapsedTimer elapsed;
+	quint16 driveNum = 0;
+	quint16 track = 0;
+	int done = 0;
+	int lastStat = 0;
+
+	fdc.stat(0);
+	elapsed.start();
+
+	// Traced transactions in order, optionally at their original times
+	for (done = 0; replay && done < ops; done++) {
+		const ttracerecord_t &rec = records.at(done);
+
+		if (parser.isSet(realtimeOption)) {
+			qint64 wait = (qint64) (rec.time - records.at(0).time) - elapsed.nsecsElapsed();
+
+			if (wait > 0) {
+				QThread::usleep(wait / 1000);
+			}
+		}
+
+		fdc.replay(rec);
+	}
+
+	while (done < ops) {
+		switch (workload) {
+			case WORKLOAD_SEQ:
+				fdc.read(driveNum, track);
+				if (++track == BENCH_TRACKS) {
+					track = 0;
+					driveNum = (driveNum + 1) % drives;
+				}
+				done++;
+				break;
+
+			case WORKLOAD_RANDOM:
+				fdc.read(rng->bounded(drives), rng->bounded(BENCH_TRACKS));
+				done++;
+				break;
+
+			case WORKLOAD_WRITE:
+				driveNum = rng->bounded(drives);
+				track = rng->bounded(BENCH_TRACKS - BENCH_BURST);
+				for (int i = 0; i < BENCH_BURST && done < ops; i++, done++) {
+					fdc.write(driveNum, track + i);
+				}
+				for (int i = 0; i < BENCH_BURST && done < ops; i++, done++) {
+					fdc.read(driveNum, track + i);
+				}
+				break;
+
+			case WORKLOAD_MIX:
+				if (rng->bounded(10) < 7) {
+					fdc.read(rng->bounded(drives), rng->bounded(BENCH_TRACKS));
+				}
+				else {
+					fdc.write(rng->bounded(drives), rng->bounded(BENCH_TRACKS));
+				}
+				done++;
+				break;
+		}
+
+		if (done - lastStat >= BENCH_STAT_EVERY) {
+			fdc.stat(driveNum);
+			lastStat = done;
+		}
+	}
+
+	double secs = elapsed.nsecsElapsed() / 1e9;
+	quint64 transactions = fdc.latency[FDC_CMD_STAT].count() + fdc.latency[FDC_CMD_READ].count() + fdc.latency[FDC_CMD_WRIT].count();
+
+	int mounted = std::count_if(drive, drive + MAX_DRIVE, [](const treplaydrive_t &d) { return d.maxTrack >= 0; });
+
+	out << QString("%1, %2 drives, %3\n")
+		.arg((replay) ? QString("replay of %1").arg(parser.value(replayOption)) : QString("workload %1").arg(parser.value(workloadOption)))
+		.arg(mounted)
+		.arg((baud) ? QString("paced to %1 baud").arg(baud) : QString("unthrottled"));
+	out << QString("  %1 transactions in %2 s, %3 transactions/s\n").arg(transactions).arg(secs, 0, 'f', 3).arg(transactions / secs, 0, 'f', 1);
+	out << QString("  FDC to server %1 bytes/s, server to FDC %2 bytes/s\n").arg(fdc.txBytes / secs, 0, 'f', 0).arg(fdc.rxBytes / secs, 0, 'f', 0);
+	out << QString("  %1 errors\n").arg(fdc.errors);
+	out << QString("  cmd       count   p50 (ms)   p95 (ms)   p99 (ms)   max (ms)\n");
+	report("STAT", fdc.latency[FDC_CMD_STAT]);
+	report("READ", fdc.latency[FDC_CMD_READ]);
+	report("WRIT", fdc.latency[FDC_CMD_WRIT]);
+	out.flush();
+
+	stop();
+
+	return (fdc.errors) ? 1 : 0;
+}
@@ -0,0 +1,285 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Microbenchmarks
+*      QBENCHMARK timings of the per-command work in libfdc: checksums,
+*      command dispatch through the worker and dashboard row formatting.
+*      Also checks the SIMD checksum kernels against the scalar sum. Run
+*      with -tickcounter or -callgrind for steadier numbers on small boards.
+*
+***********************************************************************************/
+
+#include <QtTest>
+#include <QTemporaryFile>
+#include <string.h>
+
+#include "fdc-protocol.h"
+#include "fdc-geometry.h"
+#include "fdc-worker.h"
+#include "fdc-dashboard.h"
+
+class FDCMicroBench : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void initTestCase();
+	void cleanupTestCase();
+	void checksum_data();
+	void checksum();
+	void kernelExact();
+	void kernel_data();
+	void kernel();
+	void dispatch_data();
+	void dispatch();
+	void dashboard_data();
+	void dashboard();
+
+private:
+	quint8 track[TRKBUF_SIZE];
+	QTemporaryFile image;
+	FDCWorker *worker;
+
+	static QByteArray frame(quint32 opcode, quint16 param1, quint16 param2, bool valid = true);
+};
+
+//
+// A worker on the null port with an overlay of a minidisk image on
+// drive 0, so WRIT goes to memory and nothing waits on a disk. Read
+// ahead is off, it would only add work on another thread.
+//
+void FDCMicroBench::initTestCase()
+{
+	for (int i = 0; i < TRKBUF_SIZE; i++) {
+		track[i] = i * 7;
+	}
+
+	QVERIFY(image.open());
+	QVERIFY(image.write(QByteArray(MINIDISK_TRACKS * MINIDISK_TRACKLEN, (char) 0xe5)) == MINIDISK_TRACKS * MINIDISK_TRACKLEN);
+	QVERIFY(image.flush());
+
+	worker = new FDCWorker;
+	worker->setReadAhead(false);
+
+	QVERIFY(worker->openSerialPort(NULL_PORT, 403200));
+	QVERIFY(worker->mountOverlay(0, image.fileName()) == MINIDISK_TRACKS - 1);
+}
+
+void FDCMicroBench::cleanupTestCase()
+{
+	worker->shutdown();
+	delete worker;
+}
+
+void FDCMicroBench::checksum_data()
+{
+	QTest::addColumn<int>("length");
+
+	QTest::newRow("command") << CMD_LEN;
+	QTest::newRow("sector") << 137;
+	QTest::newRow("track") << TRKBUF_SIZE;
+}
+
+void FDCMicroBench::checksum()
+{
+	QFETCH(int, length);
+	volatile quint16 sum;
+
+	QBENCHMARK {
+		sum = calcChecksum(track, length);
+	}
+
+	Q_UNUSED(sum);
+}
+
+#define FILL_RAMP		0			// kernelExact() data patterns
+#define FILL_RANDOM		1
+#define FILL_ONES		2
+#define FILL_PATTERNS		3
+
+#define FILL_SEED		2463534242u		// fixed, so a failure can be reproduced
+
+#define COPY_GUARD		64			// bytes past the copy that must stay untouched
+
+//
+// Every available kernel against the scalar sum, for all lengths up to
+// a full track and at every alignment within a vector, over a ramp,
+// seeded random bytes and all 0xff. The copy kernels must also leave an
+// exact copy and not write past it; the guard bytes are the inverse of
+// the first source byte past the copy, so an overrun always shows.
+// Run once before trusting numbers on a new CPU.
+//
+void FDCMicroBench::kernelExact()
+{
+	static quint8 buf[TRKBUF_SIZE + 32 + COPY_GUARD];
+	static quint8 dst[TRKBUF_SIZE + COPY_GUARD];
+	quint32 seed = FILL_SEED;
+	quint8 guard;
+
+	for (int fill = 0; fill < FILL_PATTERNS; fill++) {
+		for (int i = 0; i < (int) sizeof(buf); i++) {
+			switch (fill) {
+				case FILL_RAMP:
+					buf[i] = i * 131 + 7;
+					break;
+
+				case FILL_RANDOM:
+					// xorshift32
+					seed ^= seed << 13;
+					seed ^= seed >> 17;
+					seed ^= seed << 5;
+					buf[i] = seed >> 24;
+					break;
+
+				default:
+					buf[i] = 0xff;
+					break;
+			}
+		}
+
+		for (int k = 0; k < CHECKSUM_KERNELS; k++) {
+			if (!checksumKernelAvailable(k)) {
+				continue;
+			}
+
+			for (int offset = 0; offset < 32; offset++) {
+				quint16 sum = 0;
+
+				for (int len = 0; len <= TRKBUF_SIZE; len++) {
+					if (len) {
+						sum += buf[offset + len - 1];
+					}
+
+					if (kernelChecksum(k, buf + offset, len) != sum) {
+						QFAIL(qPrintable(QString("%1 kernel, offset %2, length %3").arg(checksumKernelName(k)).arg(offset).arg(len)));
+					}
+
+					guard = ~buf[offset + len];
+					memset(dst, guard, len + COPY_GUARD);
+
+					if (kernelCopyChecksum(k, dst, buf + offset, len) != sum) {
+						QFAIL(qPrintable(QString("%1 copy kernel sum, offset %2, length %3").arg(checksumKernelName(k)).arg(offset).arg(len)));
+					}
+
+					if (memcmp(dst, buf + offset, len)) {
+						QFAIL(qPrintable(QString("%1 copy kernel data, offset %2, length %3").arg(checksumKernelName(k)).arg(offset).arg(len)));
+					}
+
+					for (int i = len; i < len + COPY_GUARD; i++) {
+						if (dst[i] != guard) {
+							QFAIL(qPrintable(QString("%1 copy kernel wrote past %3 bytes, offset %2").arg(checksumKernelName(k)).arg(offset).arg(len)));
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void FDCMicroBench::kernel_data()
+{
+	QTest::addColumn<int>("kernel");
+
+	for (int k = 0; k < CHECKSUM_KERNELS; k++) {
+		if (checksumKernelAvailable(k)) {
+			QTest::newRow(checksumKernelName(k)) << k;
+		}
+	}
+}
+
+void FDCMicroBench::kernel()
+{
+	QFETCH(int, kernel);
+	volatile quint16 sum;
+
+	QBENCHMARK {
+		sum = kernelChecksum(kernel, track, TRKBUF_SIZE);
+	}
+
+	Q_UNUSED(sum);
+}
+
+//
+// Command frame as the FDC+ sends it, with a good checksum unless valid
+// is false
+//
+QByteArray FDCMicroBench::frame(quint32 opcode, quint16 param1, quint16 param2, bool valid)
+{
+	tcommand_t cmd;
+
+	setOpcode(&cmd, opcode);
+	qToLittleEndian<quint16>(param1, cmd.asBytes + 4);
+	qToLittleEndian<quint16>(param2, cmd.asBytes + 6);
+	qToLittleEndian<quint16>(calcChecksum(cmd.asBytes, CMD_LEN) + ((valid) ? 0 : 1), cmd.asBytes + CMD_LEN);
+
+	return QByteArray((const char *) cmd.asBytes, CMDBUF_SIZE);
+}
+
+void FDCMicroBench::dispatch_data()
+{
+	QTest::addColumn<QByteArray>("input");
+
+	QByteArray writ = frame(OP_WRIT, 5, MINIDISK_TRACKLEN);
+	quint8 crc[CRC_LEN];
+
+	// WRIT is timed with its track data and CRC, through to WSTA
+	qToLittleEndian<quint16>(calcChecksum(track, MINIDISK_TRACKLEN), crc);
+	writ.append((const char *) track, MINIDISK_TRACKLEN);
+	writ.append((const char *) crc, CRC_LEN);
+
+	QTest::newRow("STAT") << frame(OP_STAT, 0x0100, 5);
+	QTest::newRow("READ") << frame(OP_READ, 5, MINIDISK_TRACKLEN);
+	QTest::newRow("WRIT") << writ;
+	QTest::newRow("unknown") << frame(FDC_OPCODE('X', 'X', 'X', 'X'), 0, 0);
+	QTest::newRow("bad checksum") << frame(OP_READ, 5, MINIDISK_TRACKLEN, false);
+}
+
+//
+// Everything a command costs the worker from its last byte arriving to
+// the response being handed to the link: framing, checksum, opcode
+// dispatch, the handler and the status updates
+//
+void FDCMicroBench::dispatch()
+{
+	QFETCH(QByteArray, input);
+
+	QBENCHMARK {
+		worker->receive((const quint8 *) input.constData(), input.size());
+	}
+}
+
+void FDCMicroBench::dashboard_data()
+{
+	QTest::addColumn<int>("fields");
+
+	QTest::newRow("command") << 0;
+	QTest::newRow("cache") << 1;
+}
+
+//
+// The dialog's per-tick dashboard work for one changed READ row or the
+// cache counters
+//
+void FDCMicroBench::dashboard()
+{
+	QFETCH(int, fields);
+	FDCDashboard dash;
+	FDCStatus status;
+
+	status.command(FDC_CMD_READ, 123456, 1, 0x0005, MINIDISK_TRACKLEN);
+	status.cache(98765, 4321);
+
+	if (fields == 0) {
+		QBENCHMARK {
+			dash.command(&status, FDC_CMD_READ);
+		}
+	}
+	else {
+		QBENCHMARK {
+			dash.cache(&status);
+		}
+	}
+}
+
+QTEST_GUILESS_MAIN(FDCMicroBench)
+
+#include "fdc-microbench.moc"
@@ -0,0 +1,15 @@
+######################################################################
+# QTest microbenchmarks of the per-command CPU cost
+######################################################################
+
+TEMPLATE = app
+TARGET = fdc-microbench
+INCLUDEPATH += .
+CONFIG += console
+CONFIG -= app_bundle
+QT = core testlib
+
+include(../../libfdc/libfdc.pri)
+
+# Input
+SOURCES += fdc-microbench.cpp
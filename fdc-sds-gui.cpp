@@ -24,6 +24,9 @@
 *  is borderline. 230.4K is available on most all serial ports, is within 2% of
 *  the FDC baud rate, but runs at 80%-90% of real disk speed.
 *
+*  With the rate set to Auto, the server listens at each rate in that order
+*  and keeps the fastest one the FDC's STAT polling comes through clean at.
+*
 *  FDC TO SERVER COMMANDS
 *    Commands from the FDC to the server are fixed length, ten byte messages. The 
 *    first four bytes are a command in ASCII, the remaining six bytes are grouped
@@ -130,6 +133,7 @@ FDCDialog::FDCDialog(QWidget *parent)
 	// Layouts
 	QVBoxLayout *mainLayout = new QVBoxLayout;
 	QHBoxLayout *commLayout = new QHBoxLayout;
+	QGridLayout *driveGrid = new QGridLayout;
 	QGroupBox *driveGroup[MAX_DRIVE];
 	QVBoxLayout *driveLayout[MAX_DRIVE];
 	QHBoxLayout *row1Layout[MAX_DRIVE];
@@ -167,6 +171,12 @@ FDCDialog::FDCDialog(QWidget *parent)
 		unloadButton[driveNum] = new QPushButton(tr("Unload"), this);
 		unloadButton[driveNum]->setEnabled(false);
 
+		// Only shown for overlay mounts
+		snapshotButton[driveNum] = new QPushButton(tr("Snapshot"), this);
+		snapshotButton[driveNum]->setVisible(false);
+		rollbackButton[driveNum] = new QPushButton(tr("Rollback"), this);
+		rollbackButton[driveNum]->setVisible(false);
+
 		enabledLayout[driveNum] = new QHBoxLayout;
 		enabledLayout[driveNum]->setAlignment(Qt::AlignRight);  
 		label = new QLabel(tr("Enabled"));
@@ -185,11 +195,15 @@ FDCDialog::FDCDialog(QWidget *parent)
 
 		row3Layout[driveNum]->addWidget(loadButton[driveNum]);
 		row3Layout[driveNum]->addWidget(unloadButton[driveNum]);
+		row3Layout[driveNum]->addWidget(snapshotButton[driveNum]);
+		row3Layout[driveNum]->addWidget(rollbackButton[driveNum]);
 		row3Layout[driveNum]->addLayout(enabledLayout[driveNum]);
 		row3Layout[driveNum]->addLayout(headloadLayout[driveNum]);
 
 		connect(loadButton[driveNum], &QPushButton::clicked, [this, driveNum] { loadButtonSlot(driveNum); });
 		connect(unloadButton[driveNum], &QPushButton::clicked, [this, driveNum] { unloadButtonSlot(driveNum); });
+		connect(snapshotButton[driveNum], &QPushButton::clicked, [this, driveNum] { snapshotButtonSlot(driveNum); });
+		connect(rollbackButton[driveNum], &QPushButton::clicked, [this, driveNum] { rollbackButtonSlot(driveNum); });
 
 		driveLayout[driveNum] = new QVBoxLayout;
 		driveLayout[driveNum]->addLayout(row1Layout[driveNum]);
@@ -199,12 +213,11 @@ FDCDialog::FDCDialog(QWidget *parent)
 		driveGroup[driveNum] = new QGroupBox;
 		driveGroup[driveNum]->setLayout(driveLayout[driveNum]);
 
+		maxTrack[driveNum] = 0;
 		curTrack[driveNum] = 0;
 		enableStatus[driveNum] = false;
 		headStatus[driveNum] = false;
-
-		openMode[driveNum] = QIODevice::ReadWrite;
-		driveFile[driveNum] = new QFile;
+		overlayDrive[driveNum] = false;
 	}
 
 	// Information
@@ -214,12 +227,12 @@ FDCDialog::FDCDialog(QWidget *parent)
 	label->setAlignment(Qt::AlignRight);  
 	infoLayout->addWidget(label);
 
-	// Communications Ports
+	// Communications Ports, listed by the port scanner once it has run
 	serialPortBox = new QComboBox;
-	serialPorts = QSerialPortInfo::availablePorts();
-	for (const QSerialPortInfo &info : serialPorts) {
-		serialPortBox->addItem(info.portName());
-	}
+	// Editable so a serial device server can be entered as tcp://host:port
+	serialPortBox->setEditable(true);
+	serialPortBox->setInsertPolicy(QComboBox::InsertAtBottom);
+	serialPortBox->lineEdit()->setPlaceholderText(tr("port or tcp://host:port"));
 	serialPortBox->setCurrentIndex(-1);
 	connect(serialPortBox, QOverload<int>::of(&QComboBox::currentIndexChanged), [this](int index){ serialPortSlot(index); });
 
@@ -229,16 +242,64 @@ FDCDialog::FDCDialog(QWidget *parent)
 	baudRateBox->addItem("230.4K", 230400);
 	baudRateBox->addItem("403.2K", 403200);
 	baudRateBox->addItem("460.8K", 460800);
+	baudRateBox->addItem(tr("Auto"), BAUD_AUTO);
 	connect(baudRateBox, QOverload<int>::of(&QComboBox::currentIndexChanged), [this](int index){ baudRateSlot(index); });
 
 	commLayout->addWidget(baudRateBox);
 
+	cacheBox = new QCheckBox(tr("Track Cache"));
+	cacheBox->setChecked(true);
+	connect(cacheBox, &QCheckBox::toggled, [this](bool checked){ cacheBoxSlot(checked); });
+
+	commLayout->addWidget(cacheBox);
+
+	writeBehindBox = new QCheckBox(tr("Write Behind"));
+	writeBehindBox->setChecked(false);
+	connect(writeBehindBox, &QCheckBox::toggled, [this](bool checked){ writeBehindBoxSlot(checked); });
+
+	commLayout->addWidget(writeBehindBox);
+
+	readAheadBox = new QCheckBox(tr("Read Ahead"));
+	readAheadBox->setChecked(true);
+	connect(readAheadBox, &QCheckBox::toggled, [this](bool checked){ readAheadBoxSlot(checked); });
+
+	commLayout->addWidget(readAheadBox);
+
+	lowLatencyBox = new QCheckBox(tr("Low Latency"));
+	lowLatencyBox->setToolTip(tr("Tune the serial port for short round trips"));
+	lowLatencyBox->setChecked(false);
+	connect(lowLatencyBox, &QCheckBox::toggled, [this](bool checked){ lowLatencyBoxSlot(checked); });
+
+	commLayout->addWidget(lowLatencyBox);
+
+	overlayBox = new QCheckBox(tr("Overlay"));
+	overlayBox->setToolTip(tr("Load images read-only with writes kept in memory"));
+	overlayBox->setChecked(false);
+
+	commLayout->addWidget(overlayBox);
+
+	imageBox = new QComboBox;
+	imageBox->addItem(tr("File I/O"), IMAGE_FILE);
+	imageBox->addItem(tr("Mapped, flush on unload"), IMAGE_MAPPED | (FLUSH_UNMOUNT << 8));
+	imageBox->addItem(tr("Mapped, async flush"), IMAGE_MAPPED | (FLUSH_ASYNC << 8));
+	imageBox->addItem(tr("Mapped, sync flush"), IMAGE_MAPPED | (FLUSH_SYNC << 8));
+	connect(imageBox, QOverload<int>::of(&QComboBox::currentIndexChanged), [this](int index){ imageBoxSlot(index); });
+
+	commLayout->addWidget(imageBox);
+
+	statsButton = new QPushButton(tr("Statistics"), this);
+	connect(statsButton, &QPushButton::clicked, [this] { statsButtonSlot(); });
+
+	commLayout->addWidget(statsButton);
+
 	mainLayout->addLayout(commLayout);
 
 	for (driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
-		mainLayout->addWidget(driveGroup[driveNum]);
+		driveGrid->addWidget(driveGroup[driveNum], driveNum / DRIVE_COLUMNS, driveNum % DRIVE_COLUMNS);
 	}
 
+	mainLayout->addLayout(driveGrid);
+
 	// Dashboard
 	QFont monoFont("Courier New", 10);
 
@@ -248,10 +309,7 @@ FDCDialog::FDCDialog(QWidget *parent)
 		dashboardLayout->addWidget(dashboardLabel[row]);
 	}
 
-	dashboardLabel[DASHBOARD_STAT]->setText(QString("STAT").leftJustified(80));
-	dashboardLabel[DASHBOARD_READ]->setText(QString("READ").leftJustified(80));
-	dashboardLabel[DASHBOARD_WRIT]->setText(QString("WRIT").leftJustified(80));
-	dashboardLabel[DASHBOARD_ERR]->setText(QString("ERROR").leftJustified(80));
+	refreshDash();
 
 	mainLayout->addLayout(dashboardLayout);
 
@@ -260,10 +318,48 @@ FDCDialog::FDCDialog(QWidget *parent)
 
 	setLayout(mainLayout);
 
-	// Serial Port Object
-	serialPort = new QSerialPort;
+	// Protocol worker thread
+	workerThread = new QThread(this);
+	worker = new FDCWorker;
+	status = worker->status();
+	worker->moveToThread(workerThread);
+	connect(workerThread, &QThread::finished, worker, &QObject::deleteLater);
+	connect(worker, &FDCWorker::serialPortError, this, &FDCDialog::serialPortErrorSlot);
+	connect(worker, &FDCWorker::errorMessage, this, &FDCDialog::displayError);
+	connect(worker, &FDCWorker::linkStatus, this, &FDCDialog::displayLink);
+	connect(worker, &FDCWorker::lowLatencyProfile, this, [this](const QString &text) {
+		lowLatencyBox->setToolTip(text);
+		statsWindow->setProfile(text);
+	});
+	connect(worker, &FDCWorker::baudRateLocked, this, [this](int rate) {
+		baudRateBox->setToolTip(tr("Locked at %1 baud").arg(rate));
+		statsWindow->setBaudRate(rate);
+	});
+	workerThread->start(QThread::HighestPriority);
+
+	// Port scanner thread, polled for hot-plugged ports
+	scanThread = new QThread(this);
+	portScanner = new FDCPortScanner;
+	portScanner->moveToThread(scanThread);
+	connect(scanThread, &QThread::finished, portScanner, &QObject::deleteLater);
+	connect(portScanner, &FDCPortScanner::portsFound, this, &FDCDialog::portsFoundSlot);
+	scanThread->start();
+
+	scanTimer = new QTimer(this);
+	connect(scanTimer, &QTimer::timeout, portScanner, &FDCPortScanner::scan);
+	scanTimer->start(PORT_SCAN_INTERVAL);
+
+	QMetaObject::invokeMethod(portScanner, "scan", Qt::QueuedConnection);
+
 	baudRate = baudRateBox->currentData().toInt();
-	readActive = false;
+
+	// Statistics window, shown on request
+	statsWindow = new FDCStatsWindow(status);
+	statsWindow->setBaudRate(baudRate);
+
+	// Metrics export, only listening if asked to on the command line
+	metrics = new FDCMetrics(this);
+	metrics->addSession(serialPortBox->currentText(), status);
 
 	// Start timer
 	timer = new QTimer(this);
@@ -273,12 +369,9 @@ FDCDialog::FDCDialog(QWidget *parent)
 
 	// Counters
 	tickCount = 0;
-	statCount = 0;
-	readCount = 0;
-	writCount = 0;
 	errCount = 0;
-	rbyteCount = 0;
-	wbyteCount = 0;
+	errTimeout = 0;
+	restoring = false;
 
 	savePath = QCoreApplication::applicationDirPath();
 
@@ -296,12 +389,20 @@ FDCDialog::FDCDialog(QWidget *parent)
 	dbgWindow->setGeometry(0, 0, 600, 400);
 	dbgWindow->setWindowTitle(tr("FDC+ Serial Drive Server Debug Output"));
 	dbgWindow->show();
+
+	connect(worker, &FDCWorker::debugMessage, dbgWindow, &QTextEdit::append);
+	connect(worker, &FDCWorker::debugDump, dbgWindow, [this](const QByteArray &data) {
+		dbgWindow->hexDump((const quint8 *) data.constData(), data.size());
+	});
 #endif
+
+	// Last session, once the dialog is up
+	QTimer::singleShot(0, this, [this]() { restoreSession(); });
 }
 
 void FDCDialog::serialPortSlot(int index)
 {
-	serialPort->setPortName(serialPortBox->itemText(index));
+	Q_UNUSED(index);
 
 	updateSerialPort();
 }
@@ -309,53 +410,123 @@ void FDCDialog::serialPortSlot(int index)
 void FDCDialog::baudRateSlot(int index)
 {
 	baudRate = baudRateBox->itemData(index).toInt();
+	baudRateBox->setToolTip(QString());
+	statsWindow->setBaudRate(baudRate);
 
 	updateSerialPort();
 }
 
-void FDCDialog::loadButtonSlot(int drive)
+void FDCDialog::cacheBoxSlot(bool checked)
+{
+	QMetaObject::invokeMethod(worker, "setTrackCache", Qt::QueuedConnection, Q_ARG(bool, checked));
+}
+
+void FDCDialog::writeBehindBoxSlot(bool checked)
+{
+	QMetaObject::invokeMethod(worker, "setWriteBehind", Qt::QueuedConnection, Q_ARG(bool, checked));
+}
+
+void FDCDialog::readAheadBoxSlot(bool checked)
+{
+	QMetaObject::invokeMethod(worker, "setReadAhead", Qt::QueuedConnection, Q_ARG(bool, checked));
+}
+
+//
+// The profile is applied when the port is opened, so reopen it
+//
+void FDCDialog::lowLatencyBoxSlot(bool checked)
 {
-	QString fname = QFileDialog::getOpenFileName(this, tr("Open Disk Image"), savePath, tr("Disk Image Files (*.dsk);;All Files (*.*)"));
+	QMetaObject::invokeMethod(worker, "setLowLatency", Qt::QueuedConnection, Q_ARG(bool, checked));
 
-	if (fname.length()) {
-		driveFile[drive]->setFileName(fname);
+	if (!checked) {
+		statsWindow->setProfile(tr("Default"));
+	}
 
-		if (driveFile[drive]->open(openMode[drive])) {
-			QFileInfo finfo(fname);
+	updateSerialPort();
+}
 
-			savePath = finfo.filePath();
+void FDCDialog::imageBoxSlot(int index)
+{
+	int backend = imageBox->itemData(index).toInt();
 
-			fileName[drive]->setText(finfo.fileName());
-			fileName[drive]->setEnabled(true);
+	QMetaObject::invokeMethod(worker, "setImageBackend", Qt::QueuedConnection,
+		Q_ARG(int, backend & 0xff), Q_ARG(int, backend >> 8));
+}
 
-      			qint64 filesize = driveFile[drive]->size();
-			if (filesize < 200000) {
-				maxTrack[drive] = 34;
-			}
-			else if (filesize < 500000) {
-				maxTrack[drive] = 76;
-			}
-			else {
-				maxTrack[drive] = 2047;
-			}
-			trackProgress[drive]->setMaximum(maxTrack[drive]);
-			trackProgress[drive]->setValue(maxTrack[drive]);
-			trackProgress[drive]->setTextVisible(true);
+void FDCDialog::statsButtonSlot()
+{
+	statsWindow->show();
+	statsWindow->raise();
+}
 
-			loadButton[drive]->setEnabled(false);
-			unloadButton[drive]->setEnabled(true);
-			unloadButton[drive]->setFocus(Qt::OtherFocusReason);
-		}
-		else {
-			QMessageBox::critical(this, "Mount Error", QString("Could not open disk mage '%1'").arg(fname));
-		}
+void FDCDialog::loadButtonSlot(int drive)
+{
+	QString fname = QFileDialog::getOpenFileName(this, tr("Open Disk Image"), savePath, tr("Disk Image Files (*.dsk *.fdz);;All Files (*.*)"));
+
+	if (fname.length() && !mountImage(drive, fname, overlayBox->isChecked())) {
+		QMessageBox::critical(this, "Mount Error", QString("Could not open disk mage '%1'").arg(fname));
 	}
 }
 
+//
+// Mount an image and bring the drive's widgets in line. The first tracks
+// are then warmed into the cache in the background.
+//
+bool FDCDialog::mountImage(int drive, const QString &fname, bool overlay)
+{
+	int mountTrack = -1;
+
+	if (overlay) {
+		QMetaObject::invokeMethod(worker, "mountOverlay", Qt::BlockingQueuedConnection,
+			Q_RETURN_ARG(int, mountTrack), Q_ARG(int, drive), Q_ARG(QString, fname));
+	}
+	else {
+		QMetaObject::invokeMethod(worker, "mountDrive", Qt::BlockingQueuedConnection,
+			Q_RETURN_ARG(int, mountTrack), Q_ARG(int, drive), Q_ARG(QString, fname));
+	}
+
+	if (mountTrack < 0) {
+		return false;
+	}
+
+	QFileInfo finfo(fname);
+
+	savePath = finfo.filePath();
+	imagePath[drive] = finfo.absoluteFilePath();
+	overlayDrive[drive] = overlay;
+
+	fileName[drive]->setText(finfo.fileName());
+	fileName[drive]->setEnabled(true);
+
+	maxTrack[drive] = mountTrack;
+	trackProgress[drive]->setMaximum(maxTrack[drive]);
+	trackProgress[drive]->setValue(maxTrack[drive]);
+	curTrack[drive] = maxTrack[drive];
+	trackProgress[drive]->setTextVisible(true);
+
+	loadButton[drive]->setEnabled(false);
+	unloadButton[drive]->setEnabled(true);
+	unloadButton[drive]->setFocus(Qt::OtherFocusReason);
+	snapshotButton[drive]->setVisible(overlay);
+	rollbackButton[drive]->setVisible(overlay);
+
+	QMetaObject::invokeMethod(worker, "warmDrive", Qt::QueuedConnection, Q_ARG(int, drive));
+
+	saveSession();
+
+	return true;
+}
+
 void FDCDialog::unloadButtonSlot(int drive)
 {
-	if (driveFile[drive]->isOpen()) {
-		driveFile[drive]->close();
+	bool unmounted = false;
+
+	QMetaObject::invokeMethod(worker, "unmountDrive", Qt::BlockingQueuedConnection,
+		Q_RETURN_ARG(bool, unmounted), Q_ARG(int, drive));
+
+	if (unmounted) {
+		imagePath[drive].clear();
+		overlayDrive[drive] = false;
 
 		fileName[drive]->setText(QString(""));
 		fileName[drive]->setEnabled(false);
@@ -364,448 +535,570 @@ void FDCDialog::unloadButtonSlot(int drive)
 
 		maxTrack[drive] = 0;
 		curTrack[drive] = 0;
-		enableStatus[drive] = false;
-		headStatus[drive] = false;
 
-		updateIndicators();
+		setIndicator(enabledLabel[drive], &enableStatus[drive], false);
+		setIndicator(headloadLabel[drive], &headStatus[drive], false);
 
 		loadButton[drive]->setEnabled(true);
 		loadButton[drive]->setFocus(Qt::OtherFocusReason);
 		unloadButton[drive]->setEnabled(false);
+		snapshotButton[drive]->setVisible(false);
+		rollbackButton[drive]->setVisible(false);
+
+		saveSession();
 	}
 }
 
+void FDCDialog::snapshotButtonSlot(int drive)
+{
+	QMetaObject::invokeMethod(worker, "snapshotDrive", Qt::QueuedConnection, Q_ARG(int, drive));
+}
+
+void FDCDialog::rollbackButtonSlot(int drive)
+{
+	QMetaObject::invokeMethod(worker, "rollbackDrive", Qt::QueuedConnection, Q_ARG(int, drive));
+}
+
+//
+// Display tick. The worker only updates the shared status block, so
+// everything that changed since the last tick is repainted here at most
+// once, however many commands arrived in between.
+//
 void FDCDialog::timerSlot()
 {
+	int command;
+	int changed;
+
 	// Reset timer
 	tickCount++;
 
+	changed = status->takeChanged();
+
+	for (command = 0; command < STATUS_COMMANDS; command++) {
+		if (changed & (STATUS_STAT << command)) {
+			dashboard.command(status, command);
+		}
+	}
+
+	if (changed & STATUS_DRIVE) {
+		updateIndicators();
+	}
+
+	if (changed & STATUS_CACHE) {
+		dashboard.cache(status);
+	}
+
+	if (changed & STATUS_DIRTY) {
+		dashboard.dirtyTracks(status);
+	}
+
 	// Clear last error text
 	if (errTimeout) {
 		if (--errTimeout == 0) {
 			clearError();
 		}
 	}
+
+	refreshDash();
 }
 
-void FDCDialog::readyReadSlot()
+void FDCDialog::serialPortErrorSlot(const QString &text)
 {
-	int i;
-	quint16 driveNum;
-	quint16 trackLen;
-	qint64 bytesRead;
-	quint16 checksum;
+	QMessageBox::critical(this, "Serial Port Error", text);
+}
 
-#if 0
-	if (!serialPort->isOpen()) {
-		return;
-	}
+void FDCDialog::updateSerialPort()
+{
+	bool opened = false;
+
+	QMetaObject::invokeMethod(worker, "closeSerialPort", Qt::BlockingQueuedConnection);
 
-	if (!serialPort->bytesAvailable()) {
+	metrics->setPort(0, serialPortBox->currentText());
+
+	if (serialPortBox->currentIndex() == -1) {
 		return;
 	}
-#endif
 
-	// If we already have a read active, return
-	if (readActive) {
+	QMetaObject::invokeMethod(worker, "openSerialPort", Qt::BlockingQueuedConnection,
+		Q_RETURN_ARG(bool, opened), Q_ARG(QString, serialPortBox->currentText()), Q_ARG(int, baudRate));
+
+	if (!opened) {
+		serialPortBox->setCurrentIndex(-1);
 		return;
 	}
 
-	bytesRead = readSerialPort(cmdBuf.asBytes, CMDBUF_SIZE, 50);
+	saveSession();
+}
 
-	if (bytesRead < CMDBUF_SIZE) {
-		displayError(QString("received partial command buffer %1/10 bytes").arg(bytesRead));
-		dbgWindow->hexDump(cmdBuf.asBytes, bytesRead);
+//
+// New port list from the scanner. Ports that went away are dropped
+// unless they are in use or were typed in, and the selection and any
+// text being typed are left as they are.
+//
+void FDCDialog::portsFoundSlot(const QStringList &ports)
+{
+	QString current;
+	QString edit;
+	int index;
+
+	if (ports == portNames) {
 		return;
 	}
 
-	// Calculate and validate checksum
-	checksum = calcChecksum(cmdBuf.asBytes, CMD_LEN);
+	portNames = ports;
 
-	if (checksum != cmdBuf.checksum) {
-		displayError(QString("CRC ERROR calc=%1 recv=%2").arg(checksum,4,16).arg(cmdBuf.checksum,4,16));
+	if (serialPortBox->currentIndex() >= 0) {
+		current = serialPortBox->itemText(serialPortBox->currentIndex());
 	}
 
-	// READ command
-	if (QString(cmdBuf.command).left(4) == QString("READ")) {
-		readCount++;
+	edit = serialPortBox->currentText();
 
-		driveNum = cmdBuf.param1 >> 12;
+	QSignalBlocker blocker(serialPortBox);
 
-		displayDash(QString("%1").arg(readCount,6,10,QChar('0')), DASHBOARD_READ, 6, 6);
-		displayDash(QString("0x%1").arg(driveNum,2,16,QChar('0')), DASHBOARD_READ, 14, 4);
-		displayDash(QString("0x%1").arg(cmdBuf.param1 & 0x0fff,4,16,QChar('0')), DASHBOARD_READ, 20, 6);
-		displayDash(QString("0x%1").arg(cmdBuf.param2,4,16,QChar('0')), DASHBOARD_READ, 28, 6);
+	for (index = serialPortBox->count() - 1; index >= 0; index--) {
+		QString name = serialPortBox->itemText(index);
 
-		// Ignore invalid drive numbers
-		if (driveNum > MAX_DRIVE) {
-			return;
+		if (name != current && !name.startsWith(TCP_SCHEME) && !ports.contains(name)) {
+			serialPortBox->removeItem(index);
 		}
+	}
 
-		enableDrive(driveNum);
-		enableHead(driveNum);
-
-		// If drive not mounted, ignore
-		if (!driveFile[driveNum]->isOpen()) {
-			displayError(QString("READ error - drive %1 not loaded").arg(driveNum));
-			return;
+	for (const QString &name : ports) {
+		if (serialPortBox->findText(name) < 0) {
+			serialPortBox->addItem(name);
 		}
+	}
 
-		// Track in lower 12 bits
-		curTrack[driveNum] = cmdBuf.param1 & 0x0fff;
-		trackLen = cmdBuf.param2;
-
-		// If the requested track length is too long, ignore
-		if (trackLen > TRKBUF_SIZE) {
-			displayError(QString("READ requested track len %1 > %2 bytes").arg(trackLen).arg(TRKBUF_SIZE));
-			return;
-		}
+	if (current.isEmpty()) {
+		serialPortBox->setCurrentIndex(-1);
+		serialPortBox->setEditText(edit);
+	}
+	else {
+		serialPortBox->setCurrentIndex(serialPortBox->findText(current));
+	}
+}
 
-		if (curTrack[driveNum] > maxTrack[driveNum]) {
-			displayError(QString("READ requested track %1 > %2").arg(curTrack[driveNum]).arg(maxTrack[driveNum]));
-			return;
-		}
+//
+// Saved with the same keys as the server's INI file, so the GUI's
+// settings can be handed to fdc-sds-server -c as they are
+//
+static const char *backendName[] = { "file", "mapped" };	// indexed by IMAGE_*
+static const char *flushName[] = { "unmount", "async", "sync" };	// indexed by FLUSH_*
 
-		updateIndicators();
+static int imageBoxData(const QString &backend, const QString &flush)
+{
+	int policy;
 
-		driveFile[driveNum]->seek(curTrack[driveNum] * trackLen);
-		if (driveFile[driveNum]->pos() != curTrack[driveNum] * trackLen) {
-			displayError(QString("read() error seeking to %1").arg(curTrack[driveNum] * trackLen));
-		}
+	if (backend.compare(backendName[IMAGE_MAPPED], Qt::CaseInsensitive) != 0) {
+		return IMAGE_FILE;
+	}
 
-		if ((bytesRead = driveFile[driveNum]->read((char *) trkBuf, trackLen)) != trackLen) {
-			displayError(QString("read() failed - read %1 of %2 bytes").arg(bytesRead).arg(trackLen));
-			return;	// Ignore reads past end of file
+	for (policy = FLUSH_SYNC; policy > FLUSH_UNMOUNT; policy--) {
+		if (flush.compare(flushName[policy], Qt::CaseInsensitive) == 0) {
+			break;
 		}
-
-		checksum = calcChecksum(trkBuf, trackLen);
-		trkBuf[trackLen] = checksum & 0x00ff;			// LSB of checksum
-		trkBuf[trackLen+1] = (checksum >> 8) & 0x00ff;	// MSB of checksum
-
-		writeSerialPort(trkBuf, trackLen + CRC_LEN);
 	}
 
-	// WRIT command
-	else if (QString(cmdBuf.command).left(4) == QString("WRIT")) {
-		writCount++;
+	return IMAGE_MAPPED | (policy << 8);
+}
 
-		driveNum = cmdBuf.param1 >> 12;
+//
+// Bring back the options, images and port of the last session. Images
+// are mounted before the port opens, so the FDC+ sees its drives from
+// the first STAT. The saved port is opened straight away rather than
+// waiting for the scanner to list it.
+//
+void FDCDialog::restoreSession()
+{
+	QSettings settings;
+	QString port = settings.value("serial/port").toString();
+	QString baud = settings.value("serial/baud").toString();
+	int index;
+
+	restoring = true;
+
+	cacheBox->setChecked(settings.value("cache/enabled", cacheBox->isChecked()).toBool());
+	writeBehindBox->setChecked(settings.value("cache/writebehind", writeBehindBox->isChecked()).toBool());
+	readAheadBox->setChecked(settings.value("cache/readahead", readAheadBox->isChecked()).toBool());
+	lowLatencyBox->setChecked(settings.value("serial/lowlatency", lowLatencyBox->isChecked()).toBool());
+	overlayBox->setChecked(settings.value("gui/overlay", overlayBox->isChecked()).toBool());
+	savePath = settings.value("gui/path", savePath).toString();
+
+	if ((index = imageBox->findData(imageBoxData(settings.value("image/backend").toString(), settings.value("image/flush").toString()))) >= 0) {
+		imageBox->setCurrentIndex(index);
+	}
 
-		displayDash(QString("%1").arg(writCount,6,10,QChar('0')), DASHBOARD_WRIT, 6, 6);
-		displayDash(QString("0x%1").arg(driveNum,2,16,QChar('0')), DASHBOARD_WRIT, 14, 4);
-		displayDash(QString("0x%1").arg(cmdBuf.param1 & 0x0fff,4,16,QChar('0')), DASHBOARD_WRIT, 20, 6);
-		displayDash(QString("0x%1").arg(cmdBuf.param2,4,16,QChar('0')), DASHBOARD_WRIT, 28, 6);
+	if (!baud.isEmpty()) {
+		index = baudRateBox->findData((baud.compare("auto", Qt::CaseInsensitive) == 0) ? BAUD_AUTO : baud.toInt());
 
-		// Ignore invalid drive numbers
-		if (driveNum > MAX_DRIVE) {
-			return;
+		if (index >= 0) {
+			baudRateBox->setCurrentIndex(index);
 		}
+	}
 
-		curTrack[driveNum] = cmdBuf.param1 & 0x0fff;
-		trackLen = cmdBuf.param2;
-
-		enableDrive(driveNum);
-		enableHead(driveNum);
-
-		// If drive not mounted, ignore
-		if (!driveFile[driveNum]->isOpen()) {
-			displayError(QString("WRIT error - drive %1 not loaded").arg(driveNum));
-			cmdBuf.rcode = STAT_NOT_READY;
-		}
-		else {
-			cmdBuf.rcode = STAT_OK;
-		}
+	for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+		QString fname = settings.value(QString("drives/%1").arg(driveNum)).toString();
 
-		// If the requested track length is too long, ignore
-		if (trackLen > TRKBUF_SIZE) {
-			displayError(QString("WRIT requested track len %1 > %2 bytes").arg(trackLen).arg(TRKBUF_SIZE));
-			cmdBuf.rcode = STAT_NOT_READY;
+		if (fname.isEmpty()) {
+			continue;
 		}
 
-		if (curTrack[driveNum] > maxTrack[driveNum]) {
-			displayError(QString("WRIT requested track %1 > %2").arg(curTrack[driveNum]).arg(maxTrack[driveNum]));
-			return;
+		if (!mountImage(driveNum, fname, settings.value(QString("overlay/%1").arg(driveNum), false).toBool())) {
+			displayError(QString("Could not open disk image '%1'").arg(fname));
 		}
+	}
 
-		// Send WRIT response
-		cmdBuf.checksum = calcChecksum(cmdBuf.asBytes, CMD_LEN);
-
-		if (cmdBuf.rcode == STAT_OK) {
-			writeSerialPort(cmdBuf.asBytes, CMDBUF_SIZE);
-
-			int bytesRead = readSerialPort(trkBuf, trackLen + CRC_LEN, 250);	// Length of track plus 2 byte CRC
-
-			checksum = calcChecksum(trkBuf, trackLen);
-
-			if (bytesRead != trackLen + CRC_LEN) {
-				displayError(QString("WRIT received wrong track length (%1/%2)").arg(bytesRead).arg(trackLen + CRC_LEN));
-				cmdBuf.rcode = STAT_CHECKSUM_ERR;
-			}
-			else if (((checksum & 0xff) == trkBuf[trackLen])
-				&& (((checksum >> 8) & 0xff)) == trkBuf[trackLen + 1]) {
-
-				if (!(driveFile[driveNum]->seek(curTrack[driveNum] * trackLen))) {
-					displayError(QString("WRIT error seeking to %1").arg(curTrack[driveNum] * trackLen));
-					cmdBuf.rcode = STAT_WRITE_ERR;
-				}
-				else if (driveFile[driveNum]->write((char *) trkBuf, trackLen) != trackLen) {
-					displayError("WRIT file write error");
-					cmdBuf.rcode = STAT_WRITE_ERR;
-				}
-			}
-			else {
-				displayError(QString("WRIT track checksum error"));
-				cmdBuf.rcode = STAT_CHECKSUM_ERR;
-			}
-
-			// Set response to WSTA
-			cmdBuf.command[0] = 'W';
-			cmdBuf.command[1] = 'S';
-			cmdBuf.command[2] = 'T';
-			cmdBuf.command[3] = 'A';
-			cmdBuf.checksum = calcChecksum(cmdBuf.asBytes, CMD_LEN);
+	if (!port.isEmpty()) {
+		if (serialPortBox->findText(port) < 0) {
+			serialPortBox->addItem(port);
 		}
 
-		writeSerialPort(cmdBuf.asBytes, CMDBUF_SIZE);
+		serialPortBox->setCurrentIndex(serialPortBox->findText(port));
 	}
 
-	// STAT command
-	else if (QString(cmdBuf.command).left(4) == QString("STAT")) {
-		statCount++;
+	restoring = false;
+}
 
-		enableDrive(0xff);
-		enableHead(0xff);
+//
+// The port is only saved once it opens, so a port that was unplugged
+// at startup is still tried next time
+//
+void FDCDialog::saveSession()
+{
+	QSettings settings;
+	int backend = imageBox->currentData().toInt();
 
-		driveNum = cmdBuf.param1 & 0x00ff;
+	if (restoring) {
+		return;
+	}
 
-		if (driveNum < MAX_DRIVE) {
-			enableStatus[driveNum] = true;
-			headStatus[driveNum] = (cmdBuf.param1 & 0xff00) >> 8;
-			curTrack[driveNum] = cmdBuf.param2;
-		}
+	if (serialPortBox->currentIndex() >= 0) {
+		settings.setValue("serial/port", serialPortBox->currentText());
+	}
 
-		updateIndicators();
+	settings.setValue("serial/baud", (baudRate == BAUD_AUTO) ? QString("auto") : QString::number(baudRate));
+	settings.setValue("serial/lowlatency", lowLatencyBox->isChecked());
+	settings.setValue("cache/enabled", cacheBox->isChecked());
+	settings.setValue("cache/writebehind", writeBehindBox->isChecked());
+	settings.setValue("cache/readahead", readAheadBox->isChecked());
+	settings.setValue("image/backend", backendName[backend & 0xff]);
+	settings.setValue("image/flush", flushName[backend >> 8]);
+	settings.setValue("gui/overlay", overlayBox->isChecked());
+	settings.setValue("gui/path", savePath);
 
-		displayDash(QString("%1").arg(statCount,6,10,QChar('0')), DASHBOARD_STAT, 6, 6);
-		displayDash(QString("0x%1").arg(driveNum,2,16,QChar('0')), DASHBOARD_STAT, 14, 4);
-		displayDash(QString("0x%1").arg(cmdBuf.param1,4,16,QChar('0')), DASHBOARD_STAT, 20, 6);
-		displayDash(QString("0x%1").arg(cmdBuf.param2,4,16,QChar('0')), DASHBOARD_STAT, 28, 6);
-
-		// Respond with status of mounted drives
-		cmdBuf.rcode = STAT_OK;
-		cmdBuf.rdata = 0;
-		for (i = 0; i < MAX_DRIVE; i++) {
-			if (driveFile[i]->isOpen()) {
-				cmdBuf.rdata |= (1 << i);
-			}
+	for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+		if (imagePath[driveNum].isEmpty()) {
+			settings.remove(QString("drives/%1").arg(driveNum));
+		}
+		else {
+			settings.setValue(QString("drives/%1").arg(driveNum), imagePath[driveNum]);
 		}
 
-		cmdBuf.checksum = calcChecksum(cmdBuf.asBytes, CMD_LEN);
-
-		writeSerialPort(cmdBuf.asBytes, CMDBUF_SIZE);
-	}
-	else {
-		displayError(QString("Received unknown command"));
+		if (overlayDrive[driveNum]) {
+			settings.setValue(QString("overlay/%1").arg(driveNum), true);
+		}
+		else {
+			settings.remove(QString("overlay/%1").arg(driveNum));
+		}
 	}
 }
 
-void FDCDialog::updateSerialPort()
+//
+// Bring the LEDs and track bars in line with the status block. Only the
+// selected drive is enabled, and widgets are touched only when their
+// state actually changes.
+//
+void FDCDialog::updateIndicators()
 {
-	if (serialPort->isOpen()) {
-		disconnect(serialPort);
-		serialPort->clear();
-		serialPort->close();
-	}
+	int drive;
+	int selected = status->selected.loadAcquire();
+	bool headLoaded = status->headLoaded.loadAcquire();
+	quint16 track;
 
-	if (serialPortBox->currentIndex() == -1) {
-		return;
-	}
+	for (drive = 0; drive < MAX_DRIVE; drive++) {
+		setIndicator(enabledLabel[drive], &enableStatus[drive], drive == selected);
+		setIndicator(headloadLabel[drive], &headStatus[drive], drive == selected && headLoaded);
 
-	if (serialPort->open(QIODevice::ReadWrite)) {
-		if (serialPort->setBaudRate(baudRate) == false) {
-			QMessageBox::critical(this,
-				"Serial Port Error",
-				QString("Could not set baudrate to %1").arg(baudRate));
-		}
-		serialPort->setDataBits(QSerialPort::Data8);
-		serialPort->setParity(QSerialPort::NoParity);
-		serialPort->setStopBits(QSerialPort::OneStop);
-		serialPort->setFlowControl(QSerialPort::NoFlowControl);
-		serialPort->setDataTerminalReady(true);
-		serialPort->setRequestToSend(true);
-		serialPort->clear();
+		track = status->curTrack[drive].loadAcquire();
 
-		connect(serialPort, &QSerialPort::readyRead, this, &FDCDialog::readyReadSlot);
+		if (track != curTrack[drive] && maxTrack[drive] >= track) {
+			curTrack[drive] = track;
+			trackProgress[drive]->setValue(track);
+		}
 	}
-	else {
-		QMessageBox::critical(this,
-			"Serial Port Error",
-			QString("Could not open serial port '%1' (%2)").arg(serialPort->portName()).arg(serialPort->error()));
+}
 
-		serialPortBox->setCurrentIndex(-1);
+void FDCDialog::setIndicator(QLabel *led, quint8 *shown, bool on)
+{
+	if (*shown != on) {
+		*shown = on;
+		led->setPixmap((on) ? *grnLED : *redLED);
 	}
 }
 
 //
-// Read len bytes into buffer with msec timeout
+// Dashboard edits only change the text kept by FDCDashboard;
+// refreshDash() pushes the rows that changed to their labels once per
+// tick
 //
-int FDCDialog::readSerialPort(const quint8 *buffer, int len, qint64 msec)
+void FDCDialog::refreshDash()
 {
-	int a;
-	int i = 0;
+	int dirty = dashboard.takeDirty();
+	int row;
 
-	if (!serialPort->isOpen()) {
-		return -1;
+	for (row = 0; row < DASHBOARD_ROWS; row++) {
+		if (dirty & (1 << row)) {
+			dashboardLabel[row]->setText(dashboard.row(row));
+		}
 	}
+}
 
-	readActive = true;
-
-	QElapsedTimer timeout;
-	timeout.start();
-
-	i += serialPort->read((char *) buffer, len);
+void FDCDialog::listenMetrics(const QString &address)
+{
+	QString error;
 
-	while (i != -1 && i < len && !timeout.hasExpired(msec)) {
-		serialPort->waitForReadyRead(10);	// Get more characters
-		i += serialPort->read((char *) buffer+i, len-i);
+	if (!metrics->listen(address, &error)) {
+		displayError(error);
 	}
+}
 
-	rbyteCount += i;
-
-	dbgWindow->append(QString().asprintf("Read %d bytes a=%d", i, a));
-
-	readActive = false;
-
-	return i;
+void FDCDialog::displayError(const QString &text)
+{
+	errCount++;
+	dashboard.error(errCount, text);
+	errTimeout = DASHBOARD_ERRTO;
 }
 
 //
-// The FDC+ serial protocol is synchronous. Wait until the entire
-// buffer is sent. Returns -1 on error, true if all bytes were sent,
-// false if timeout.
+// Link state from the worker (baud rate probe, recovery) stays on the
+// STAT row until the next one replaces it, in full on its tooltip
 //
-int FDCDialog::writeSerialPort(const quint8 *buffer, int len, qint64 msec)
+void FDCDialog::displayLink(const QString &text)
 {
-	if (!len) {
-		displayError(QString("write serial port len=%1").arg(len));
-		return -1;
-	}
-
-	serialPort->write((char *) buffer, len);
-
-	wbyteCount += len;
-
-	// All writes are synchronous
-	serialPort->waitForBytesWritten(msec);
+	dashboard.link(text);
+	dashboardLabel[DASHBOARD_STAT]->setToolTip(text);
+}
 
-	return !serialPort->bytesToWrite();
+void FDCDialog::clearError()
+{
+	dashboard.clearError();
+	errTimeout = DASHBOARD_ERRTO;
 }
 
-void FDCDialog::updateIndicators()
+void FDCDialog::reject()
 {
-	int drive;
+	QMessageBox::StandardButton r;
 
-	for (drive = 0; drive < MAX_DRIVE; drive++) {
-		enabledLabel[drive]->setPixmap(*redLED);
-		headloadLabel[drive]->setPixmap(*redLED);
+	r = QMessageBox::question(this, "Exit Program", tr("Are you sure?"), QMessageBox::No | QMessageBox::Yes);
 
-		if (enableStatus[drive]) {
-			enabledLabel[drive]->setPixmap(*grnLED);
-		}
-		if (headStatus[drive]) {
-			headloadLabel[drive]->setPixmap(*grnLED);
-		}
-		if (maxTrack[drive] >= curTrack[drive]) {
-			trackProgress[drive]->setValue(curTrack[drive]);
-		}
+	if (r != QMessageBox::Yes) {
+		return;
 	}
-}
 
-quint16 FDCDialog::calcChecksum(const quint8 *data, int length)
-{
-	int i;
-	quint16 checksum;
+	saveSession();
 
-	checksum = 0;
+	// The status block goes away with the worker
+	timer->stop();
 
-	for (i = 0; i < length; i++) {
-		checksum += data[i];
-	}
+	scanTimer->stop();
+	scanThread->quit();
+	scanThread->wait();
+
+	// Close serial port and drive images, then stop the worker
+	QMetaObject::invokeMethod(worker, "shutdown", Qt::BlockingQueuedConnection);
+	workerThread->quit();
+	workerThread->wait();
+
+	statsWindow->close();
+	delete statsWindow;
+
+#ifdef DEBUG
+	// Close debug window
+	dbgWindow->close();
+#endif
 
-	return checksum;
+	QDialog::reject();
 }
 
-void FDCDialog::enableDrive(quint8 driveNum)
+FDCStatsWindow::FDCStatsWindow(FDCStatus *fdcStatus, QWidget *parent)
+	: QWidget(parent)
 {
-	quint8 drive;
+	static const char *command[STATUS_COMMANDS] = { "STAT", "READ", "WRIT" };
+	static const char *heading[5] = { "Count", "p50 (ms)", "p95 (ms)", "p99 (ms)", "Max (ms)" };
+	int cmd, col;
 
-	for (drive = 0; drive < MAX_DRIVE; drive++) {
-		enableStatus[drive] = false;
-	}
+	status = fdcStatus;
+	baudRate = 0;
 
-	if (driveNum < MAX_DRIVE) {
-		enableStatus[driveNum] = true;
+	setWindowTitle(tr("FDC+ Serial Drive Server Statistics"));
+
+	QVBoxLayout *mainLayout = new QVBoxLayout;
+	QGridLayout *rateLayout = new QGridLayout;
+	QGridLayout *latencyLayout = new QGridLayout;
+	QGroupBox *rateGroup = new QGroupBox(tr("Throughput"));
+	QGroupBox *latencyGroup = new QGroupBox(tr("Response Latency"));
+
+	rxRate = new QLabel;
+	txRate = new QLabel;
+	rxLine = new QLabel;
+	txLine = new QLabel;
+	readRate = new QLabel;
+	writRate = new QLabel;
+	linkScore = new QLabel;
+	linkErrors = new QLabel;
+	profile = new QLabel(tr("Default"));
+
+	rateLayout->addWidget(new QLabel(tr("Receive")), 0, 0);
+	rateLayout->addWidget(rxRate, 0, 1);
+	rateLayout->addWidget(rxLine, 0, 2);
+	rateLayout->addWidget(new QLabel(tr("Transmit")), 1, 0);
+	rateLayout->addWidget(txRate, 1, 1);
+	rateLayout->addWidget(txLine, 1, 2);
+	rateLayout->addWidget(new QLabel(tr("READ")), 2, 0);
+	rateLayout->addWidget(readRate, 2, 1);
+	rateLayout->addWidget(new QLabel(tr("WRIT")), 3, 0);
+	rateLayout->addWidget(writRate, 3, 1);
+	rateLayout->addWidget(new QLabel(tr("Link")), 4, 0);
+	rateLayout->addWidget(linkScore, 4, 1);
+	rateLayout->addWidget(linkErrors, 4, 2);
+	rateLayout->addWidget(new QLabel(tr("Profile")), 5, 0);
+	rateLayout->addWidget(profile, 5, 1, 1, 2);
+	rateGroup->setLayout(rateLayout);
+
+	for (col = 0; col < 5; col++) {
+		latencyLayout->addWidget(new QLabel(heading[col]), 0, col + 1, Qt::AlignRight);
 	}
-}
 
-void FDCDialog::enableHead(quint8 driveNum)
-{
-	quint8 drive;
+	for (cmd = 0; cmd < STATUS_COMMANDS; cmd++) {
+		latencyLayout->addWidget(new QLabel(command[cmd]), cmd + 1, 0);
 
-	for (drive = 0; drive < MAX_DRIVE; drive++) {
-		headStatus[drive] = false;
+		for (col = 0; col < 5; col++) {
+			latency[cmd][col] = new QLabel;
+			latency[cmd][col]->setAlignment(Qt::AlignRight);
+			latencyLayout->addWidget(latency[cmd][col], cmd + 1, col + 1);
+		}
 	}
 
-	if (driveNum < MAX_DRIVE) {
-		headStatus[driveNum] = true;
+	// Link overhead, from WRIT response to the first byte of its track data
+	latencyLayout->addWidget(new QLabel(tr("Link")), STATUS_COMMANDS + 1, 0);
+
+	for (col = 0; col < 5; col++) {
+		turnaround[col] = new QLabel;
+		turnaround[col]->setAlignment(Qt::AlignRight);
+		latencyLayout->addWidget(turnaround[col], STATUS_COMMANDS + 1, col + 1);
 	}
+	latencyGroup->setLayout(latencyLayout);
+
+	QPushButton *resetButton = new QPushButton(tr("Reset"), this);
+	connect(resetButton, &QPushButton::clicked, this, &FDCStatsWindow::resetSlot);
+
+	mainLayout->addWidget(rateGroup);
+	mainLayout->addWidget(latencyGroup);
+	mainLayout->addWidget(resetButton, 0, Qt::AlignRight);
+	setLayout(mainLayout);
+
+	sample();
+
+	timer = new QTimer(this);
+	connect(timer, &QTimer::timeout, this, &FDCStatsWindow::timerSlot);
+	timer->start(STATS_INTERVAL);
 }
 
-void FDCDialog::displayDash(QString text, int row, int pos, int len)
+void FDCStatsWindow::setBaudRate(quint32 rate)
 {
-	dashboardLabel[row]->setText(dashboardLabel[row]->text().replace(pos, len, text));
+	baudRate = rate;
 }
 
-void FDCDialog::displayError(QString text)
+//
+// What the low latency profile did to the port, shown until the port
+// is opened again
+//
+void FDCStatsWindow::setProfile(const QString &text)
 {
-	errCount++;
-	displayDash(QString("%1").arg(errCount,6,10,QChar('0')), DASHBOARD_ERR, 6, 6);
-	displayDash(text.leftJustified(74), DASHBOARD_ERR, 14, 74);
-	errTimeout = DASHBOARD_ERRTO;
+	profile->setText(text);
 }
 
-void FDCDialog::clearError()
+//
+// Take the current totals as the base for the next rate interval
+//
+void FDCStatsWindow::sample()
 {
-	displayDash(QString("").leftJustified(74), DASHBOARD_ERR, 14, 74);
-	errTimeout = DASHBOARD_ERRTO;
+	lastRx = status->rxBytes.loadAcquire();
+	lastTx = status->txBytes.loadAcquire();
+	lastRead = status->cmd[FDC_CMD_READ].count.loadAcquire();
+	lastWrit = status->cmd[FDC_CMD_WRIT].count.loadAcquire();
+	interval.start();
 }
 
-void FDCDialog::reject()
+void FDCStatsWindow::timerSlot()
 {
-	QMessageBox::StandardButton r;
-
-	r = QMessageBox::question(this, "Exit Program", tr("Are you sure?"), QMessageBox::No | QMessageBox::Yes);
-
-	if (r != QMessageBox::Yes) {
+	double secs = interval.nsecsElapsed() / 1e9;
+	quint64 rx = status->rxBytes.loadAcquire();
+	quint64 tx = status->txBytes.loadAcquire();
+	quint64 reads = status->cmd[FDC_CMD_READ].count.loadAcquire();
+	quint64 writs = status->cmd[FDC_CMD_WRIT].count.loadAcquire();
+	double lineRate = (baudRate) ? baudRate / (double) STATS_BITS_PER_BYTE : 0;
+	double rxPerSec, txPerSec;
+
+	if (!isVisible() || secs <= 0) {
+		sample();
 		return;
 	}
 
-	if (serialPort->isOpen()) {
-		serialPort->close();
+	rxPerSec = (rx - lastRx) / secs;
+	txPerSec = (tx - lastTx) / secs;
+
+	rxRate->setText(QString("%1 bytes/s").arg(rxPerSec, 0, 'f', 0));
+	txRate->setText(QString("%1 bytes/s").arg(txPerSec, 0, 'f', 0));
+	rxLine->setText(QString("%1% of line").arg((lineRate) ? rxPerSec * 100 / lineRate : 0, 0, 'f', 1));
+	txLine->setText(QString("%1% of line").arg((lineRate) ? txPerSec * 100 / lineRate : 0, 0, 'f', 1));
+	readRate->setText(QString("%1 tracks/s").arg((reads - lastRead) / secs, 0, 'f', 1));
+	writRate->setText(QString("%1 tracks/s").arg((writs - lastWrit) / secs, 0, 'f', 1));
+	linkScore->setText(QString("%1% clean").arg(status->linkScore.loadAcquire()));
+	linkErrors->setText(QString("%1 errors").arg(status->linkErrors.loadAcquire()));
+
+	showLatency();
+	sample();
+}
+
+void FDCStatsWindow::showLatency()
+{
+	for (int cmd = 0; cmd < STATUS_COMMANDS; cmd++) {
+		showHistogram(latency[cmd], &status->latency[cmd]);
 	}
 
-	for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
-		if (driveFile[driveNum]->isOpen()) {
-			driveFile[driveNum]->close();
-		}
+	showHistogram(turnaround, &status->turnaround);
+}
+
+void FDCStatsWindow::showHistogram(QLabel **row, const FDCLatencyHistogram *hist)
+{
+	row[0]->setText(QString::number(hist->count()));
+	row[1]->setText(QString::number(hist->percentile(0.50) / 1000.0, 'f', 3));
+	row[2]->setText(QString::number(hist->percentile(0.95) / 1000.0, 'f', 3));
+	row[3]->setText(QString::number(hist->percentile(0.99) / 1000.0, 'f', 3));
+	row[4]->setText(QString::number(hist->peak() / 1000.0, 'f', 3));
+}
+
+void FDCStatsWindow::resetSlot()
+{
+	for (int cmd = 0; cmd < STATUS_COMMANDS; cmd++) {
+		status->latency[cmd].reset();
 	}
 
-#ifdef DEBUG
-	// Close debug window
-	dbgWindow->close();
-#endif
+	status->turnaround.reset();
 
-	QDialog::reject();
+	showLatency();
+}
+
+void FDCPortScanner::scan()
+{
+	QStringList ports;
+
+	for (const QSerialPortInfo &info : QSerialPortInfo::availablePorts()) {
+		ports.append(info.portName());
+	}
+
+	emit portsFound(ports);
 }
 
 DbgWidget::DbgWidget(QWidget *parent)
@@ -828,8 +1121,23 @@ void DbgWidget::hexDump(const quint8 *buffer, int len)
 int main(int argc, char **argv)
 {
 	QApplication app(argc, argv);
+	QCoreApplication::setOrganizationName("Deltec Enterprises");
+	QCoreApplication::setApplicationName("fdc-sds-gui");
 	app.setStyle(QStyleFactory::create("Fusion"));
+
+	QCommandLineParser parser;
+	QCommandLineOption metricsOption("metrics", "Serve /metrics (Prometheus) and /metrics.json on [host:]<port>.", "address");
+
+	parser.addHelpOption();
+	parser.addOption(metricsOption);
+	parser.process(app);
+
 	FDCDialog *dialog = new FDCDialog;
+
+	if (parser.isSet(metricsOption)) {
+		dialog->listenMetrics(parser.value(metricsOption));
+	}
+
 	dialog->show();
 	return app.exec();
 }
@@ -10,47 +10,25 @@
 #include <QLineEdit>
 #include <QPushButton>
 #include <QComboBox>
+#include <QCheckBox>
 #include <QPixmap>
-#include <QSerialPort>
 #include <QSerialPortInfo>
+#include <QThread>
 #include <QList>
+#include <QElapsedTimer>
+
+#include "fdc-worker.h"
+#include "fdc-metrics.h"
+#include "fdc-dashboard.h"
 
-#define MAX_DRIVE		4
-#define CMD_LEN			8                       // does not include checksum bytes
-#define CRC_LEN			2			// length of CRC
-#define CMDBUF_SIZE		CMD_LEN+CRC_LEN
-#define TRKBUF_SIZE		137*32                  // maximum valid track length
-
-#define STAT_OK			0x0000			// OK
-#define STAT_NOT_READY		0x0001			// Not Ready
-#define STAT_CHECKSUM_ERR	0x0002			// Checksum Error
-#define STAT_WRITE_ERR		0x0003			// Write Error
-
-#define DASHBOARD_ROWS		4			// Number of dashboard rows
-#define DASHBOARD_STAT		0
-#define DASHBOARD_READ		1
-#define	DASHBOARD_WRIT		2
-#define DASHBOARD_ERR		3			// Error row
 #define DASHBOARD_ERRTO		100			// Error text timeout 100ms ticks
 
-typedef struct TCOMMAND {
-	union {
-		quint8 asBytes[CMDBUF_SIZE];
-		struct {
-			char command[4];
-			union {
-				quint16 param1;
-				quint16 rcode;
-			};
-			union {
-				quint16 param2;
-				quint16 rdata;
-			};
-			quint16 checksum;
-		};
-	};
-} tcommand_t;
+#define DRIVE_COLUMNS		4			// Drives per row in the drive grid
+
+#define STATS_INTERVAL		1000			// Statistics window refresh (ms)
+#define STATS_BITS_PER_BYTE	10			// 8N1 start, data and stop bits
 
+#define PORT_SCAN_INTERVAL	2000			// Serial port hot-plug poll (ms)
 
 class DbgWidget : public QTextEdit
 {
@@ -61,70 +39,147 @@ public:
 	void hexDump(const quint8 *buffer, int len);
 };
 
+//
+// Throughput and response latency, computed from the worker's status
+// block once a second
+//
+class FDCStatsWindow : public QWidget
+{
+	Q_OBJECT
+
+public:
+	FDCStatsWindow(FDCStatus *status, QWidget *parent = nullptr);
+	void setBaudRate(quint32 rate);
+	void setProfile(const QString &text);
+
+private slots:
+	void timerSlot();
+	void resetSlot();
+
+private:
+	FDCStatus *status;
+	QTimer *timer;
+	QElapsedTimer interval;
+	quint32 baudRate;
+	quint64 lastRx;
+	quint64 lastTx;
+	quint64 lastRead;
+	quint64 lastWrit;
+	QLabel *rxRate;
+	QLabel *txRate;
+	QLabel *rxLine;
+	QLabel *txLine;
+	QLabel *readRate;
+	QLabel *writRate;
+	QLabel *linkScore;
+	QLabel *linkErrors;
+	QLabel *profile;				// low latency profile result
+	QLabel *latency[STATUS_COMMANDS][5];		// count, p50, p95, p99, max
+	QLabel *turnaround[5];				// WRIT turnaround, same columns
+
+	void sample(void);
+	void showLatency(void);
+	static void showHistogram(QLabel **row, const FDCLatencyHistogram *hist);
+};
+
+//
+// Serial port enumeration off the GUI thread. availablePorts() can take
+// a noticeable time on some hosts, and QtSerialPort has no hot-plug
+// notification, so the dialog polls here and gets the names back.
+//
+class FDCPortScanner : public QObject
+{
+	Q_OBJECT
+
+public slots:
+	void scan();
+
+signals:
+	void portsFound(const QStringList &ports);
+};
+
 class FDCDialog : public QDialog
 {
 	Q_OBJECT
 
 public:
 	FDCDialog(QWidget *parent = 0);
+	void listenMetrics(const QString &address);
 
 private slots:
 	void serialPortSlot(int index);
 	void baudRateSlot(int index);
+	void cacheBoxSlot(bool checked);
+	void writeBehindBoxSlot(bool checked);
+	void readAheadBoxSlot(bool checked);
+	void lowLatencyBoxSlot(bool checked);
+	void imageBoxSlot(int index);
+	void statsButtonSlot();
 	void loadButtonSlot(int drive);
 	void unloadButtonSlot(int drive);
-	void readyReadSlot();
+	void snapshotButtonSlot(int drive);
+	void rollbackButtonSlot(int drive);
 	void timerSlot();
+	void serialPortErrorSlot(const QString &text);
+	void portsFoundSlot(const QStringList &ports);
+	void displayError(const QString &text);
+	void displayLink(const QString &text);
 
 private:
 	QTimer *timer;
 	QComboBox *serialPortBox;
 	QComboBox *baudRateBox;
+	QCheckBox *cacheBox;
+	QCheckBox *writeBehindBox;
+	QCheckBox *readAheadBox;
+	QCheckBox *lowLatencyBox;
+	QCheckBox *overlayBox;
+	QComboBox *imageBox;
+	QPushButton *statsButton;
+	FDCStatsWindow *statsWindow;
 	QLabel *label;
 	QProgressBar *trackProgress[MAX_DRIVE];
 	QLineEdit *fileName[MAX_DRIVE];
 	QPushButton *loadButton[MAX_DRIVE];
 	QPushButton *unloadButton[MAX_DRIVE];
-	QList<QSerialPortInfo> serialPorts;
-	QSerialPort *serialPort;
+	QPushButton *snapshotButton[MAX_DRIVE];
+	QPushButton *rollbackButton[MAX_DRIVE];
+	QStringList portNames;
+	QThread *scanThread;
+	FDCPortScanner *portScanner;
+	QTimer *scanTimer;
+	QThread *workerThread;
+	FDCWorker *worker;
+	FDCStatus *status;
+	FDCMetrics *metrics;
 	quint32 baudRate;
-	tcommand_t cmdBuf;
-	quint16 trkBufIdx;
-	quint8 trkBuf[TRKBUF_SIZE + CRC_LEN];
-	quint8 driveSize[MAX_DRIVE];
 	quint16 maxTrack[MAX_DRIVE];
 	quint16 curTrack[MAX_DRIVE];
 	quint8 headStatus[MAX_DRIVE];
 	quint8 enableStatus[MAX_DRIVE];
-	QIODevice::OpenMode openMode[MAX_DRIVE];
-	QFile *driveFile[MAX_DRIVE];
 	QString savePath;
+	QString imagePath[MAX_DRIVE];			// mounted images, for the saved session
+	bool overlayDrive[MAX_DRIVE];
+	bool restoring;					// no saves while the last session comes back
 	QLabel *enabledLabel[MAX_DRIVE];
 	QLabel *headloadLabel[MAX_DRIVE];
 	const QPixmap *grnLED;
 	const QPixmap *redLED;
 	QTextEdit *debugWindow;
 	QLabel *dashboardLabel[DASHBOARD_ROWS];
+	FDCDashboard dashboard;
 	quint32 tickCount;
-	quint32 statCount;
-	quint32 readCount;
-	quint32 writCount;
-	quint32 errCount;
-	quint32 rbyteCount;
-	quint32 wbyteCount;
+	quint64 errCount;
 	quint32 errTimeout;
-	bool readActive;
 	DbgWidget *dbgWindow;
 
-	void enableDrive(quint8 driveNum);
-	void enableHead(quint8 driveNum);
 	void updateIndicators(void);
+	void setIndicator(QLabel *led, quint8 *shown, bool on);
+	void refreshDash(void);
 	void updateSerialPort(void);
-	int readSerialPort(const quint8 *buffer, int len, qint64 msec=1000);
-	int writeSerialPort(const quint8 *buffer, int len, qint64 msec=1000);
-	quint16 calcChecksum(const quint8 *data, int length);
-	void displayDash(QString text, int row, int pos, int len);
-	void displayError(QString text);
+	bool mountImage(int drive, const QString &fname, bool overlay);
+	void restoreSession(void);
+	void saveSession(void);
 	void clearError(void);
 	void reject(void);
 };
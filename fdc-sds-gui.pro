@@ -9,6 +9,11 @@ QT += core
 QT += widgets
 QT += serialport
 
+OBJECTS_DIR = .obj/gui
+MOC_DIR = .moc/gui
+
+include(libfdc/libfdc.pri)
+
 # You can make your code fail to compile if you use deprecated APIs.
 # In order to do so, uncomment the following line.
 # Please consult the documentation of the deprecated API in order to know
@@ -0,0 +1,499 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Headless Server
+*      Runs protocol workers on QCoreApplication with no widgets, for hosts
+*      without a display. Each serial port is a session with its own worker
+*      thread and drive table; read-only images are shared between sessions
+*      through one image pool. Ports, baud rates and drive images come from
+*      the command line or an INI file. Counters of every session can be
+*      scraped over HTTP with --metrics. See fdc-sds-gui.cpp for a
+*      description of the protocol.
+*
+***********************************************************************************/
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QSettings>
+#include <QSocketNotifier>
+#include <QThread>
+#include <QList>
+#include <QDebug>
+#include <string.h>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "fdc-worker.h"
+#include "fdc-compressed.h"
+#include "fdc-metrics.h"
+
+#define DEFAULT_BAUD		403200
+
+#define MOUNT_READWRITE		0			// session drive mount modes
+#define MOUNT_READONLY		1
+#define MOUNT_OVERLAY		2
+
+//
+// SIGINT and SIGTERM quit the event loop so the drives are unmounted and
+// any write-behind tracks are flushed before exit
+//
+#ifdef Q_OS_WIN
+static BOOL WINAPI consoleHandler(DWORD type)
+{
+	Q_UNUSED(type);
+
+	QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
+
+	return TRUE;
+}
+
+static void installQuitHandler(void)
+{
+	SetConsoleCtrlHandler(consoleHandler, TRUE);
+}
+#else
+static int quitFd[2];
+
+static void quitHandler(int sig)
+{
+	char c = sig;
+
+	if (write(quitFd[0], &c, 1) < 0) {
+		// nothing useful to do in a signal handler
+	}
+}
+
+static void installQuitHandler(void)
+{
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, quitFd) < 0) {
+		return;
+	}
+
+	QSocketNotifier *notifier = new QSocketNotifier(quitFd[1], QSocketNotifier::Read, QCoreApplication::instance());
+	QObject::connect(notifier, &QSocketNotifier::activated, QCoreApplication::instance(), &QCoreApplication::quit);
+
+	struct sigaction sa;
+
+	sa.sa_handler = quitHandler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+}
+#endif
+
+static int imageBackend(const QString &name)
+{
+	return (name.compare("mapped", Qt::CaseInsensitive) == 0) ? IMAGE_MAPPED : IMAGE_FILE;
+}
+
+static int flushPolicy(const QString &name)
+{
+	if (name.compare("async", Qt::CaseInsensitive) == 0) {
+		return FLUSH_ASYNC;
+	}
+	if (name.compare("sync", Qt::CaseInsensitive) == 0) {
+		return FLUSH_SYNC;
+	}
+
+	return FLUSH_UNMOUNT;
+}
+
+typedef struct TSESSION {
+	QString portName;
+	int baudRate;
+	QString drive[MAX_DRIVE];
+	int mode[MAX_DRIVE];
+	QThread *thread;
+	FDCWorker *worker;
+} tsession_t;
+
+//
+// Baud rate option or setting, a number or auto
+//
+static int parseBaud(const QString &rate)
+{
+	return (rate.compare("auto", Qt::CaseInsensitive) == 0) ? BAUD_AUTO : rate.toInt();
+}
+
+//
+// Serial port, baud rate and drives of one session from the current
+// settings group
+//
+static void readSession(QSettings &settings, tsession_t *session)
+{
+	session->portName = settings.value("port", settings.value("serial/port")).toString();
+	session->baudRate = parseBaud(settings.value("baud", settings.value("serial/baud", DEFAULT_BAUD)).toString());
+
+	for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+		session->drive[driveNum] = settings.value(QString("drives/%1").arg(driveNum)).toString();
+		session->mode[driveNum] = MOUNT_READWRITE;
+
+		if (settings.value(QString("readonly/%1").arg(driveNum), false).toBool()) {
+			session->mode[driveNum] = MOUNT_READONLY;
+		}
+		if (settings.value(QString("overlay/%1").arg(driveNum), false).toBool()) {
+			session->mode[driveNum] = MOUNT_OVERLAY;
+		}
+	}
+}
+
+static bool parseDrive(const QString &mount, tsession_t *session, int mode)
+{
+	int sep = mount.indexOf('=');
+	bool ok = false;
+	int driveNum = mount.left(sep).toInt(&ok);
+
+	if (sep < 0 || !ok || driveNum < 0 || driveNum >= MAX_DRIVE) {
+		qWarning().noquote() << QString("Invalid drive option '%1'").arg(mount);
+		return false;
+	}
+
+	session->drive[driveNum] = mount.mid(sep + 1);
+	session->mode[driveNum] = mode;
+
+	return true;
+}
+
+//
+// Mount the session's drives and open its port on the session thread
+//
+static bool startSession(tsession_t *session, int number)
+{
+	bool opened = false;
+
+	for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+		if (session->drive[driveNum].isEmpty()) {
+			continue;
+		}
+
+		int maxTrack = -1;
+
+		if (session->mode[driveNum] == MOUNT_OVERLAY) {
+			QMetaObject::invokeMethod(session->worker, "mountOverlay", Qt::BlockingQueuedConnection,
+				Q_RETURN_ARG(int, maxTrack), Q_ARG(int, driveNum), Q_ARG(QString, session->drive[driveNum]));
+		}
+		else {
+			QMetaObject::invokeMethod(session->worker, "mountDrive", Qt::BlockingQueuedConnection,
+				Q_RETURN_ARG(int, maxTrack), Q_ARG(int, driveNum), Q_ARG(QString, session->drive[driveNum]),
+				Q_ARG(bool, session->mode[driveNum] == MOUNT_READONLY));
+		}
+
+		if (maxTrack < 0) {
+			qWarning().noquote() << QString("Session %1: could not open disk image '%2'").arg(number).arg(session->drive[driveNum]);
+			return false;
+		}
+
+		QMetaObject::invokeMethod(session->worker, "warmDrive", Qt::QueuedConnection, Q_ARG(int, driveNum));
+
+		static const char *modeName[] = { "", ", read-only", ", overlay" };
+
+		qInfo().noquote() << QString("Session %1 drive %2: %3 (%4 tracks%5)").arg(number).arg(driveNum)
+			.arg(session->drive[driveNum]).arg(maxTrack + 1).arg(modeName[session->mode[driveNum]]);
+	}
+
+	QMetaObject::invokeMethod(session->worker, "openSerialPort", Qt::BlockingQueuedConnection,
+		Q_RETURN_ARG(bool, opened), Q_ARG(QString, session->portName), Q_ARG(int, session->baudRate));
+
+	if (opened && session->baudRate == BAUD_AUTO) {
+		qInfo().noquote() << QString("Session %1: serving on %2, probing the baud rate").arg(number).arg(session->portName);
+	}
+	else if (opened) {
+		qInfo().noquote() << QString("Session %1: serving on %2 at %3 baud").arg(number).arg(session->portName).arg(session->baudRate);
+	}
+
+	return opened;
+}
+
+static void stopSession(tsession_t *session)
+{
+	QMetaObject::invokeMethod(session->worker, "shutdown", Qt::BlockingQueuedConnection);
+	session->thread->quit();
+	session->thread->wait();
+
+	delete session->worker;
+	delete session->thread;
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("fdc-sds-server");
+	QCoreApplication::setApplicationVersion("1.0");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("FDC+ Serial Drive Server (headless). A config file with [session0], [session1], ...\n"
+		"groups serves several FDC+ controllers, each on its own port, from one process.");
+	parser.addHelpOption();
+	parser.addVersionOption();
+
+	QCommandLineOption configOption(QStringList() << "c" << "config", "Read settings from INI <file>.", "file");
+	QCommandLineOption portOption(QStringList() << "p" << "port", "Serial port <name>, or tcp://host:port for a serial device server.", "name");
+	QCommandLineOption baudOption(QStringList() << "b" << "baud", "Baud <rate>, or auto to probe for it (default 403200).", "rate");
+	QCommandLineOption driveOption(QStringList() << "d" << "drive", "Mount <image> on drive <n>, as n=image.", "n=image");
+	QCommandLineOption readOnlyOption(QStringList() << "r" << "read-only", "Mount <image> read-only on drive <n>.", "n=image");
+	QCommandLineOption overlayOption("overlay", "Mount <image> on drive <n> with writes kept in memory.", "n=image");
+	QCommandLineOption noCacheOption("no-cache", "Disable the track cache.");
+	QCommandLineOption writeBehindOption("write-behind", "Return WSTA before track data reaches the image.");
+	QCommandLineOption noReadAheadOption("no-read-ahead", "Do not load tracks ahead of READ.");
+	QCommandLineOption lowLatencyOption("low-latency", "Tune serial ports for short round trips (FTDI latency timer, driver buffering).");
+	QCommandLineOption traceOption("trace", "Capture transactions to <file>, <file>.N for session N of several.", "file");
+	QCommandLineOption packOption("pack", "Write a compressed copy of <image> to <image>.fdz, or compact a compressed <image>, and exit.", "image");
+	QCommandLineOption unpackOption("unpack", "Write the plain image of <image>.fdz to <image> and exit.", "image.fdz");
+	QCommandLineOption imageOption("image", "Image backend, file or mapped.", "backend");
+	QCommandLineOption flushOption("flush", "Mapped image flush policy, unmount, async or sync.", "policy");
+	QCommandLineOption metricsOption("metrics", "Serve /metrics (Prometheus) and /metrics.json on [host:]<port>.", "address");
+
+	parser.addOption(configOption);
+	parser.addOption(portOption);
+	parser.addOption(baudOption);
+	parser.addOption(driveOption);
+	parser.addOption(readOnlyOption);
+	parser.addOption(overlayOption);
+	parser.addOption(noCacheOption);
+	parser.addOption(writeBehindOption);
+	parser.addOption(noReadAheadOption);
+	parser.addOption(lowLatencyOption);
+	parser.addOption(traceOption);
+	parser.addOption(packOption);
+	parser.addOption(unpackOption);
+	parser.addOption(imageOption);
+	parser.addOption(flushOption);
+	parser.addOption(metricsOption);
+	parser.addPositionalArgument("images", "Images mounted on drives 0, 1, ... in order.", "[images...]");
+
+	parser.process(app);
+
+	// Image conversion only, no sessions
+	if (parser.isSet(packOption) || parser.isSet(unpackOption)) {
+		QString error;
+		bool ok;
+
+		if (parser.isSet(packOption)) {
+			QString src = parser.value(packOption);
+
+			QString dst = (FDCCompressedImage::probe(src)) ? src : src + FDZ_SUFFIX;
+
+			ok = FDCCompressedImage::pack(src, dst, &error);
+		}
+		else {
+			QString src = parser.value(unpackOption);
+			QString dst = (src.endsWith(FDZ_SUFFIX)) ? src.left(src.size() - strlen(FDZ_SUFFIX)) : src + ".dsk";
+
+			ok = FDCCompressedImage::unpack(src, dst, &error);
+		}
+
+		if (!ok) {
+			qWarning().noquote() << error;
+		}
+
+		return (ok) ? 0 : 1;
+	}
+
+	// Settings file first, command line options override it
+	QList<tsession_t> sessions;
+	tsession_t single;
+	bool cacheEnabled = true;
+	bool writeBehind = false;
+	bool readAhead = true;
+	bool lowLatency = false;
+	QString backend = "file";
+	QString flush = "unmount";
+	QString metricsAddress;
+
+	single.baudRate = DEFAULT_BAUD;
+
+	for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+		single.mode[driveNum] = MOUNT_READWRITE;
+	}
+
+	if (parser.isSet(configOption)) {
+		QSettings settings(parser.value(configOption), QSettings::IniFormat);
+
+		if (settings.status() != QSettings::NoError) {
+			qWarning().noquote() << QString("Could not read '%1'").arg(parser.value(configOption));
+			return 1;
+		}
+
+		cacheEnabled = settings.value("cache/enabled", true).toBool();
+		writeBehind = settings.value("cache/writebehind", false).toBool();
+		readAhead = settings.value("cache/readahead", true).toBool();
+		lowLatency = settings.value("serial/lowlatency", false).toBool();
+		backend = settings.value("image/backend", backend).toString();
+		flush = settings.value("image/flush", flush).toString();
+		metricsAddress = settings.value("metrics/listen").toString();
+
+		readSession(settings, &single);
+
+		for (int number = 0; settings.childGroups().contains(QString("session%1").arg(number)); number++) {
+			tsession_t session;
+
+			settings.beginGroup(QString("session%1").arg(number));
+			readSession(settings, &session);
+			settings.endGroup();
+
+			sessions.append(session);
+		}
+	}
+
+	if (parser.isSet(portOption)) {
+		single.portName = parser.value(portOption);
+	}
+	if (parser.isSet(baudOption)) {
+		single.baudRate = parseBaud(parser.value(baudOption));
+	}
+	if (parser.isSet(noCacheOption)) {
+		cacheEnabled = false;
+	}
+	if (parser.isSet(writeBehindOption)) {
+		writeBehind = true;
+	}
+	if (parser.isSet(noReadAheadOption)) {
+		readAhead = false;
+	}
+	if (parser.isSet(lowLatencyOption)) {
+		lowLatency = true;
+	}
+	if (parser.isSet(imageOption)) {
+		backend = parser.value(imageOption);
+	}
+	if (parser.isSet(flushOption)) {
+		flush = parser.value(flushOption);
+	}
+	if (parser.isSet(metricsOption)) {
+		metricsAddress = parser.value(metricsOption);
+	}
+
+	const QStringList images = parser.positionalArguments();
+
+	for (int i = 0; i < images.size() && i < MAX_DRIVE; i++) {
+		single.drive[i] = images.at(i);
+	}
+
+	for (const QString &mount : parser.values(driveOption)) {
+		if (!parseDrive(mount, &single, MOUNT_READWRITE)) {
+			return 1;
+		}
+	}
+
+	for (const QString &mount : parser.values(readOnlyOption)) {
+		if (!parseDrive(mount, &single, MOUNT_READONLY)) {
+			return 1;
+		}
+	}
+
+	for (const QString &mount : parser.values(overlayOption)) {
+		if (!parseDrive(mount, &single, MOUNT_OVERLAY)) {
+			return 1;
+		}
+	}
+
+	// Without session groups, the top level settings and options are the only session
+	if (sessions.isEmpty()) {
+		sessions.append(single);
+	}
+
+	for (int number = 0; number < sessions.size(); number++) {
+		if (sessions.at(number).portName.isEmpty()) {
+			qWarning().noquote() << QString("Session %1: no serial port given").arg(number);
+			return 1;
+		}
+	}
+
+	// One worker thread per session, all mounting through one image pool
+	FDCImagePool pool;
+	bool started = true;
+
+	for (int number = 0; number < sessions.size(); number++) {
+		tsession_t *session = &sessions[number];
+
+		session->thread = new QThread;
+		session->worker = new FDCWorker(&pool);
+		session->worker->moveToThread(session->thread);
+
+		QObject::connect(session->worker, &FDCWorker::serialPortError, [number](const QString &text) {
+			qWarning().noquote() << QString("Session %1: %2").arg(number).arg(text);
+		});
+		QObject::connect(session->worker, &FDCWorker::errorMessage, [number](const QString &text) {
+			qWarning().noquote() << QString("Session %1: %2").arg(number).arg(text);
+		});
+		QObject::connect(session->worker, &FDCWorker::linkStatus, [number](const QString &text) {
+			qInfo().noquote() << QString("Session %1: %2").arg(number).arg(text);
+		});
+		QObject::connect(session->worker, &FDCWorker::lowLatencyProfile, [number](const QString &text) {
+			qInfo().noquote() << QString("Session %1: %2").arg(number).arg(text);
+		});
+
+		session->thread->start(QThread::HighestPriority);
+
+		QMetaObject::invokeMethod(session->worker, "setTrackCache", Qt::BlockingQueuedConnection, Q_ARG(bool, cacheEnabled));
+		QMetaObject::invokeMethod(session->worker, "setWriteBehind", Qt::BlockingQueuedConnection, Q_ARG(bool, writeBehind));
+		QMetaObject::invokeMethod(session->worker, "setReadAhead", Qt::BlockingQueuedConnection, Q_ARG(bool, readAhead));
+		QMetaObject::invokeMethod(session->worker, "setLowLatency", Qt::BlockingQueuedConnection, Q_ARG(bool, lowLatency));
+		QMetaObject::invokeMethod(session->worker, "setImageBackend", Qt::BlockingQueuedConnection,
+			Q_ARG(int, imageBackend(backend)), Q_ARG(int, flushPolicy(flush)));
+
+		if (started && !startSession(session, number)) {
+			started = false;
+		}
+
+		if (started && parser.isSet(traceOption)) {
+			QString fname = parser.value(traceOption);
+			bool traced = false;
+
+			if (sessions.size() > 1) {
+				fname += QString(".%1").arg(number);
+			}
+
+			QMetaObject::invokeMethod(session->worker, "startTrace", Qt::BlockingQueuedConnection,
+				Q_RETURN_ARG(bool, traced), Q_ARG(QString, fname));
+
+			if (traced) {
+				qInfo().noquote() << QString("Session %1: tracing to %2").arg(number).arg(fname);
+			}
+		}
+	}
+
+	if (!started) {
+		for (int number = 0; number < sessions.size(); number++) {
+			stopSession(&sessions[number]);
+		}
+		return 1;
+	}
+
+	qInfo().noquote() << QString("%1 checksums").arg(checksumKernelName(checksumKernelSelected()));
+
+	// Status blocks are read from the main thread, off the session threads
+	FDCMetrics metrics;
+
+	if (!metricsAddress.isEmpty()) {
+		QString error;
+
+		for (int number = 0; number < sessions.size(); number++) {
+			metrics.addSession(sessions.at(number).portName, sessions.at(number).worker->status());
+		}
+
+		if (metrics.listen(metricsAddress, &error)) {
+			qInfo().noquote() << QString("Metrics on %1").arg(metricsAddress);
+		}
+		else {
+			qWarning().noquote() << error;
+		}
+	}
+
+	installQuitHandler();
+
+	int rc = app.exec();
+
+	for (int number = 0; number < sessions.size(); number++) {
+		stopSession(&sessions[number]);
+	}
+
+	return rc;
+}
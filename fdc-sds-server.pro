@@ -0,0 +1,19 @@
+######################################################################
+# Headless server, no QtWidgets
+######################################################################
+
+TEMPLATE = app
+TARGET = fdc-sds-server
+INCLUDEPATH += .
+CONFIG += console
+CONFIG -= app_bundle
+QT = core
+QT += serialport
+
+OBJECTS_DIR = .obj/server
+MOC_DIR = .moc/server
+
+include(libfdc/libfdc.pri)
+
+# Input
+SOURCES += fdc-sds-server.cpp
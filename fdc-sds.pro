@@ -0,0 +1,24 @@
+######################################################################
+# Build everything: qmake fdc-sds.pro && make
+######################################################################
+
+TEMPLATE = subdirs
+
+SUBDIRS += libfdc
+SUBDIRS += gui
+SUBDIRS += server
+SUBDIRS += microbench
+
+libfdc.file = libfdc/libfdc.pro
+gui.file = fdc-sds-gui.pro
+gui.depends = libfdc
+server.file = fdc-sds-server.pro
+server.depends = libfdc
+microbench.file = bench/micro/micro.pro
+microbench.depends = libfdc
+
+# Benchmark needs a pseudo terminal
+unix {
+	SUBDIRS += bench
+	bench.depends = libfdc
+}
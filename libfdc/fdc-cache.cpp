@@ -0,0 +1,739 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Track Cache
+*      Keeps mounted disk image tracks in memory so that READ does not
+*      have to seek and read the image file for every transaction.
+*
+*      The cache is used by the protocol worker and, in write-behind mode,
+*      by the background writer. lock protects the cache contents and
+*      ioLock the image. flushLock keeps a flush in progress from racing
+*      detach(). The read ahead thread holds flushLock too, so a track
+*      being prefetched keeps the image attached. Locks are always taken
+*      in flushLock, lock, ioLock order.
+*
+***********************************************************************************/
+
+#include <QMutexLocker>
+#include <algorithm>
+#include <string.h>
+
+#include "fdc-cache.h"
+
+FDCTrackCache::FDCTrackCache()
+{
+	image = nullptr;
+	enabled = false;
+	writeBehind = false;
+	resident = nullptr;
+	residentSize = 0;
+	preloaded = false;
+	sumLen = 0;
+	offsets = nullptr;
+	offsetCount = 0;
+	trackSlot = nullptr;
+	slotCount = 0;
+	mru = -1;
+	lru = -1;
+	dirty = 0;
+	writeGen = 0;
+}
+
+FDCTrackCache::~FDCTrackCache()
+{
+	detach();
+}
+
+//
+// Attach the cache to an open image. Mapped images are used in place,
+// other images up to CACHE_PRELOAD_SIZE are read whole and larger images
+// get up to CACHE_TRACKS LRU track slots. If the geometry fixes the track
+// length, the checksums of a resident image are computed now. Write-behind applies
+// to preloaded and LRU cached images only; a mapping is already the
+// in-memory copy.
+//
+void FDCTrackCache::attach(FDCImage *driveImage, bool enable, const FDCGeometry &geometry, bool delayWrites)
+{
+	int slot;
+
+	detach();
+
+	QMutexLocker locker(&lock);
+	QMutexLocker io(&ioLock);
+
+	image = driveImage;
+	enabled = enable;
+
+	// Uncached reads use the track offsets too
+	geom = geometry;
+	sumLen = geom.trackLen();
+	offsets = geom.offsets();
+	offsetCount = (geom.isFixed()) ? geom.tracks() : 0;
+
+	if (!enabled) {
+		return;
+	}
+
+	if (image->data() != nullptr) {
+		resident = image->data();
+		residentSize = image->size();
+		sumResident(0);
+		return;
+	}
+
+	writeBehind = delayWrites;
+
+	if (image->size() <= CACHE_PRELOAD_SIZE && loadPreload()) {
+		return;
+	}
+
+	slotCount = (geom.isFixed()) ? qMin(CACHE_TRACKS, geom.tracks()) : CACHE_TRACKS;
+	trackSlot = new ttrackslot_t[slotCount];
+
+	for (slot = 0; slot < slotCount; slot++) {
+		trackSlot[slot].track = 0;
+		trackSlot[slot].len = 0;
+		trackSlot[slot].checksum = 0;
+		trackSlot[slot].dirty = false;
+		trackSlot[slot].flushing = false;
+		trackSlot[slot].prefetched = false;
+		trackSlot[slot].prev = slot - 1;
+		trackSlot[slot].next = (slot < slotCount - 1) ? slot + 1 : -1;
+	}
+
+	mru = 0;
+	lru = slotCount - 1;
+}
+
+//
+// Write back any dirty tracks and release the cache
+//
+void FDCTrackCache::detach()
+{
+	flushDirty();
+
+	QMutexLocker flushLocker(&flushLock);
+	QMutexLocker locker(&lock);
+
+	delete[] trackSlot;
+
+	trackSlot = nullptr;
+	resident = nullptr;
+	residentSize = 0;
+	preload.clear();
+	preloaded = false;
+	residentSum.clear();
+	residentDirty.clear();
+	index.clear();
+	flushBuf.clear();
+	image = nullptr;
+	enabled = false;
+	writeBehind = false;
+	sumLen = 0;
+	geom.clear();
+	offsets = nullptr;
+	offsetCount = 0;
+	slotCount = 0;
+	mru = -1;
+	lru = -1;
+	dirty = 0;
+}
+
+//
+// Point data at the requested track and return its checksum. Returns
+// the number of bytes available, which is less than trackLen past the
+// end of the image, or -1 if the image could not be positioned. data
+// remains valid until the next call from the same thread. outcome, if
+// given, is set to one of CACHE_*. Caches can be shared between
+// sessions, so hit and miss totals are kept by the caller.
+//
+qint64 FDCTrackCache::readTrack(quint16 track, quint16 trackLen, const quint8 **data, quint16 *checksum, int *outcome)
+{
+	qint64 offset = offsetOf(track, trackLen);
+	qint64 bytesRead;
+	const quint8 *base;
+	int slot;
+	int result;
+
+	if (outcome == nullptr) {
+		outcome = &result;
+	}
+
+	*outcome = CACHE_UNCACHED;
+
+	QMutexLocker locker(&lock);
+
+	if (!enabled) {
+		if ((base = image->data()) != nullptr) {
+			if (offset > image->size()) {
+				return -1;
+			}
+
+			*data = base + offset;
+			bytesRead = qMin((qint64) trackLen, image->size() - offset);
+			*checksum = calcChecksum(*data, bytesRead);
+
+			return bytesRead;
+		}
+
+		return readUncached(offset, trackLen, data, checksum);
+	}
+
+	if (resident != nullptr) {
+		*outcome = CACHE_HIT;
+
+		if (offset >= residentSize) {
+			*data = nullptr;
+			*checksum = 0;
+			return 0;
+		}
+
+		*data = resident + offset;
+		bytesRead = qMin((qint64) trackLen, residentSize - offset);
+
+		if (trackLen == sumLen && track < residentSum.size()) {
+			*checksum = residentSum.at(track);
+		}
+		else {
+			*checksum = calcChecksum(*data, bytesRead);
+		}
+
+		return bytesRead;
+	}
+
+	QHash<quint16, int>::const_iterator it = index.constFind(track);
+
+	if (it != index.constEnd() && trackSlot[it.value()].len == trackLen) {
+		*outcome = CACHE_HIT;
+
+		slot = it.value();
+		unlink(slot);
+		linkFront(slot);
+
+		if (trackSlot[slot].prefetched) {
+			trackSlot[slot].prefetched = false;
+			*outcome = CACHE_PREFETCH_HIT;
+		}
+
+		*data = trackSlot[slot].data;
+		*checksum = trackSlot[slot].checksum;
+		return trackLen;
+	}
+
+	*outcome = CACHE_MISS;
+
+	// Reuse the slot already holding this track, otherwise evict the oldest
+	if (it != index.constEnd()) {
+		slot = it.value();
+
+		if (trackSlot[slot].dirty || trackSlot[slot].flushing) {
+			return readUncached(offset, trackLen, data, checksum);
+		}
+	}
+	else if ((slot = evictSlot()) < 0) {
+		return readUncached(offset, trackLen, data, checksum);
+	}
+
+	unlink(slot);
+
+	ioLock.lock();
+	bytesRead = image->read(offset, trackSlot[slot].data, trackLen);
+	ioLock.unlock();
+
+	*data = trackSlot[slot].data;
+	*checksum = calcChecksum(trackSlot[slot].data, qMax(bytesRead, (qint64) 0));
+
+	trackSlot[slot].prefetched = false;
+
+	if (bytesRead == trackLen) {
+		trackSlot[slot].track = track;
+		trackSlot[slot].len = trackLen;
+		trackSlot[slot].checksum = *checksum;
+		index.insert(track, slot);
+	}
+	else {
+		trackSlot[slot].len = 0;
+		index.remove(track);
+	}
+
+	linkFront(slot);
+
+	return bytesRead;
+}
+
+//
+// Store a track and its checksum, which the caller has already verified
+// against the data. In write-behind mode the track is only marked dirty,
+// otherwise it is written through to the image. Returns the number of
+// bytes accepted, or -1 if the image could not be positioned.
+//
+qint64 FDCTrackCache::writeTrack(quint16 track, quint16 trackLen, const quint8 *data, quint16 checksum)
+{
+	qint64 offset = offsetOf(track, trackLen);
+	int slot;
+
+	QMutexLocker locker(&lock);
+
+	writeGen++;
+
+	if (!writeBehind) {
+		return writeThrough(track, trackLen, data, checksum);
+	}
+
+	if (preloaded) {
+		if (offset + trackLen > preload.size()) {
+			int oldSize = preload.size();
+
+			preload.resize(offset + trackLen);
+			memset(preload.data() + oldSize, 0, preload.size() - oldSize);
+		}
+
+		memcpy(preload.data() + offset, data, trackLen);
+
+		resident = (const quint8 *) preload.constData();
+		residentSize = preload.size();
+
+		if (trackLen == sumLen) {
+			if (track < residentSum.size()) {
+				residentSum[track] = checksum;
+			}
+			else {
+				sumResident(residentSum.size());
+			}
+		}
+
+		if (!residentDirty.contains(track)) {
+			dirty++;
+		}
+		residentDirty.insert(track, trackLen);
+
+		return trackLen;
+	}
+
+	QHash<quint16, int>::const_iterator it = index.constFind(track);
+
+	if (it != index.constEnd()) {
+		slot = it.value();
+
+		// A dirty copy at another track length can't be replaced
+		if (trackSlot[slot].len != trackLen && (trackSlot[slot].dirty || trackSlot[slot].flushing)) {
+			return writeThrough(track, trackLen, data, checksum);
+		}
+	}
+	else if ((slot = evictSlot()) < 0) {
+		return writeThrough(track, trackLen, data, checksum);
+	}
+
+	unlink(slot);
+
+	memcpy(trackSlot[slot].data, data, trackLen);
+	trackSlot[slot].track = track;
+	trackSlot[slot].len = trackLen;
+	trackSlot[slot].checksum = checksum;
+	trackSlot[slot].prefetched = false;
+	index.insert(track, slot);
+
+	if (!trackSlot[slot].dirty) {
+		trackSlot[slot].dirty = true;
+		dirty++;
+	}
+
+	linkFront(slot);
+
+	return trackLen;
+}
+
+//
+// Write all dirty tracks to the image in track order, joining adjacent
+// tracks into a single write. The cache stays usable while the image
+// is being written. Returns the number of tracks written or -1 if any
+// of them failed, in which case they stay dirty.
+//
+int FDCTrackCache::flushDirty()
+{
+	QVector<tflushtrack_t> list;
+	tflushtrack_t entry;
+	qint64 total = 0;
+	qint64 pos = 0;
+	bool ok = true;
+	int i, j;
+
+	QMutexLocker flushLocker(&flushLock);
+
+	lock.lock();
+
+	if (!writeBehind || !dirty) {
+		lock.unlock();
+		return 0;
+	}
+
+	entry.failed = false;
+
+	if (preloaded) {
+		QHash<quint16, quint16>::const_iterator it;
+
+		for (it = residentDirty.constBegin(); it != residentDirty.constEnd(); ++it) {
+			entry.track = it.key();
+			entry.len = it.value();
+			entry.slot = -1;
+			list.append(entry);
+		}
+
+		residentDirty.clear();
+	}
+	else {
+		for (i = 0; i < slotCount; i++) {
+			if (trackSlot[i].dirty) {
+				entry.track = trackSlot[i].track;
+				entry.len = trackSlot[i].len;
+				entry.slot = i;
+				list.append(entry);
+
+				trackSlot[i].dirty = false;
+				trackSlot[i].flushing = true;
+			}
+		}
+	}
+
+	dirty = 0;
+
+	std::sort(list.begin(), list.end(), [](const tflushtrack_t &a, const tflushtrack_t &b) { return a.track < b.track; });
+
+	for (i = 0; i < list.size(); i++) {
+		total += list[i].len;
+	}
+
+	flushBuf.resize(total);
+
+	for (i = 0; i < list.size(); i++) {
+		const quint8 *src = (list[i].slot < 0) ? resident + offsetOf(list[i].track, list[i].len) : trackSlot[list[i].slot].data;
+
+		memcpy(flushBuf.data() + pos, src, list[i].len);
+		pos += list[i].len;
+	}
+
+	ioLock.lock();
+	lock.unlock();
+
+	for (i = 0, pos = 0; i < list.size(); i = j) {
+		qint64 runOffset = offsetOf(list[i].track, list[i].len);
+		qint64 runLen = list[i].len;
+
+		for (j = i + 1; j < list.size() && offsetOf(list[j].track, list[j].len) == runOffset + runLen; j++) {
+			runLen += list[j].len;
+		}
+
+		if (image->write(runOffset, (const quint8 *) flushBuf.constData() + pos, runLen) != runLen) {
+			for (int k = i; k < j; k++) {
+				list[k].failed = true;
+			}
+			ok = false;
+		}
+
+		pos += runLen;
+	}
+
+	if (!image->flush()) {
+		for (i = 0; i < list.size(); i++) {
+			list[i].failed = true;
+		}
+		ok = false;
+	}
+
+	ioLock.unlock();
+	lock.lock();
+
+	for (i = 0; i < list.size(); i++) {
+		if (list[i].slot < 0) {
+			if (list[i].failed && !residentDirty.contains(list[i].track)) {
+				residentDirty.insert(list[i].track, list[i].len);
+				dirty++;
+			}
+			continue;
+		}
+
+		ttrackslot_t *s = &trackSlot[list[i].slot];
+
+		s->flushing = false;
+
+		if (list[i].failed && !s->dirty) {
+			s->dirty = true;
+			dirty++;
+		}
+	}
+
+	lock.unlock();
+
+	return (ok) ? list.size() : -1;
+}
+
+//
+// Read a track into an LRU slot ahead of its READ. lock is released
+// while the image is read, so READ hits carry on, and the track is only
+// inserted if no WRIT came in meanwhile. Returns true if the track was
+// loaded.
+//
+bool FDCTrackCache::prefetchTrack(quint16 track, quint16 trackLen)
+{
+	qint64 bytesRead;
+	quint32 gen;
+	int slot;
+
+	QMutexLocker flushLocker(&flushLock);
+
+	lock.lock();
+
+	if (!enabled || trackSlot == nullptr || !trackLen || trackLen > TRKBUF_SIZE || index.contains(track)) {
+		lock.unlock();
+		return false;
+	}
+
+	gen = writeGen;
+
+	lock.unlock();
+
+	ioLock.lock();
+	bytesRead = image->read(offsetOf(track, trackLen), prefetchBuf, trackLen);
+	ioLock.unlock();
+
+	if (bytesRead != trackLen) {
+		return false;
+	}
+
+	QMutexLocker locker(&lock);
+
+	if (gen != writeGen || index.contains(track) || (slot = evictSlot()) < 0) {
+		return false;
+	}
+
+	unlink(slot);
+
+	trackSlot[slot].checksum = copyChecksum(trackSlot[slot].data, prefetchBuf, trackLen);
+	trackSlot[slot].track = track;
+	trackSlot[slot].len = trackLen;
+	trackSlot[slot].prefetched = true;
+	index.insert(track, slot);
+
+	linkFront(slot);
+
+	return true;
+}
+
+int FDCTrackCache::dirtyCount()
+{
+	QMutexLocker locker(&lock);
+
+	return dirty;
+}
+
+//
+// Read the whole image into memory. Called with both locks held.
+//
+bool FDCTrackCache::loadPreload()
+{
+	preload.resize(image->size());
+
+	if (image->read(0, (quint8 *) preload.data(), preload.size()) != preload.size()) {
+		preload.clear();
+		preloaded = false;
+		resident = nullptr;
+		residentSize = 0;
+		residentSum.clear();
+		return false;
+	}
+
+	resident = (const quint8 *) preload.constData();
+	residentSize = preload.size();
+	preloaded = true;
+	sumResident(0);
+
+	return true;
+}
+
+//
+// Read a track bypassing the cache. Called with lock held.
+//
+qint64 FDCTrackCache::readUncached(qint64 offset, quint16 trackLen, const quint8 **data, quint16 *checksum)
+{
+	qint64 bytesRead;
+
+	QMutexLocker io(&ioLock);
+
+	bytesRead = image->read(offset, trkBuf, trackLen);
+
+	*data = trkBuf;
+	*checksum = calcChecksum(trkBuf, qMax(bytesRead, (qint64) 0));
+
+	return bytesRead;
+}
+
+//
+// Write a track to the image and update the cached copy. Called with
+// lock held.
+//
+qint64 FDCTrackCache::writeThrough(quint16 track, quint16 trackLen, const quint8 *data, quint16 checksum)
+{
+	qint64 offset = offsetOf(track, trackLen);
+	qint64 bytesWritten;
+	int slot;
+
+	QMutexLocker io(&ioLock);
+
+	bytesWritten = image->write(offset, data, trackLen);
+
+	if (!enabled) {
+		return bytesWritten;
+	}
+
+	if (resident != nullptr) {
+		if (preloaded) {
+			if (bytesWritten != trackLen) {
+				// Image no longer matches the copy, reload it
+				if (!loadPreload()) {
+					enabled = false;
+				}
+				return bytesWritten;
+			}
+
+			if (offset + trackLen > preload.size()) {
+				int oldSize = preload.size();
+
+				preload.resize(offset + trackLen);
+				memset(preload.data() + oldSize, 0, preload.size() - oldSize);
+			}
+
+			memcpy(preload.data() + offset, data, trackLen);
+
+			resident = (const quint8 *) preload.constData();
+			residentSize = preload.size();
+		}
+
+		// A mapping already holds the new data
+		if (trackLen == sumLen) {
+			if (bytesWritten != trackLen) {
+				sumResident(qMin((int) track, residentSum.size()));
+			}
+			else if (track < residentSum.size()) {
+				residentSum[track] = checksum;
+			}
+			else {
+				sumResident(residentSum.size());
+			}
+		}
+
+		return bytesWritten;
+	}
+
+	QHash<quint16, int>::const_iterator it = index.constFind(track);
+
+	if (it != index.constEnd()) {
+		slot = it.value();
+
+		if (trackSlot[slot].dirty || trackSlot[slot].flushing) {
+			return bytesWritten;
+		}
+	}
+	else if ((slot = evictSlot()) < 0) {
+		return bytesWritten;
+	}
+
+	unlink(slot);
+
+	trackSlot[slot].prefetched = false;
+
+	if (bytesWritten == trackLen) {
+		memcpy(trackSlot[slot].data, data, trackLen);
+		trackSlot[slot].track = track;
+		trackSlot[slot].len = trackLen;
+		trackSlot[slot].checksum = checksum;
+		index.insert(track, slot);
+	}
+	else {
+		trackSlot[slot].len = 0;
+		index.remove(track);
+	}
+
+	linkFront(slot);
+
+	return bytesWritten;
+}
+
+//
+// Free the least recently used slot that holds no unwritten data.
+// Returns -1 if every slot is dirty.
+//
+int FDCTrackCache::evictSlot()
+{
+	int slot;
+
+	for (slot = lru; slot >= 0; slot = trackSlot[slot].prev) {
+		if (!trackSlot[slot].dirty && !trackSlot[slot].flushing) {
+			if (trackSlot[slot].len) {
+				index.remove(trackSlot[slot].track);
+			}
+			trackSlot[slot].len = 0;
+
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+//
+// Compute checksums of resident image tracks from firstTrack on
+//
+void FDCTrackCache::sumResident(int firstTrack)
+{
+	int tracks;
+
+	if (!sumLen) {
+		return;
+	}
+
+	tracks = qMin((qint64) offsetCount, qMax(residentSize - geom.base(), (qint64) 0) / sumLen);
+
+	residentSum.resize(tracks);
+
+	for (int track = firstTrack; track < tracks; track++) {
+		residentSum[track] = calcChecksum(resident + offsetOf(track, sumLen), sumLen);
+	}
+}
+
+void FDCTrackCache::unlink(int slot)
+{
+	ttrackslot_t *s = &trackSlot[slot];
+
+	if (s->prev >= 0) {
+		trackSlot[s->prev].next = s->next;
+	}
+	else {
+		mru = s->next;
+	}
+
+	if (s->next >= 0) {
+		trackSlot[s->next].prev = s->prev;
+	}
+	else {
+		lru = s->prev;
+	}
+
+	s->prev = -1;
+	s->next = -1;
+}
+
+void FDCTrackCache::linkFront(int slot)
+{
+	ttrackslot_t *s = &trackSlot[slot];
+
+	s->prev = -1;
+	s->next = mru;
+
+	if (mru >= 0) {
+		trackSlot[mru].prev = slot;
+	}
+	else {
+		lru = slot;
+	}
+
+	mru = slot;
+}
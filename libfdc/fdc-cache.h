@@ -0,0 +1,121 @@
+#ifndef FDCCACHE_H
+#define FDCCACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QVector>
+#include <QMutex>
+
+#include "fdc-protocol.h"
+#include "fdc-image.h"
+#include "fdc-geometry.h"
+
+#define CACHE_PRELOAD_SIZE	(2*1024*1024)		// preload whole images up to this size
+#define CACHE_TRACKS		256			// most LRU tracks kept for larger images
+
+#define CACHE_UNCACHED		0			// readTrack() outcomes
+#define CACHE_HIT		1
+#define CACHE_PREFETCH_HIT	2			// first READ of a track loaded ahead
+#define CACHE_MISS		3
+
+typedef struct TTRACKSLOT {
+	quint16 track;
+	quint16 len;
+	quint16 checksum;
+	bool dirty;					// not yet written to the image
+	bool flushing;					// being written to the image
+	bool prefetched;				// read ahead and not yet requested
+	int prev;					// LRU list, towards most recent
+	int next;					// LRU list, towards least recent
+	quint8 data[TRKBUF_SIZE];
+} ttrackslot_t;
+
+typedef struct TFLUSHTRACK {
+	quint16 track;
+	quint16 len;
+	int slot;
+	bool failed;
+} tflushtrack_t;
+
+//
+// Per-drive track cache. Small images are preloaded whole at mount
+// time, larger images keep the most recently used tracks, and memory
+// mapped images are served from the mapping without a copy. The 16 bit
+// checksum of every cached track is kept alongside the data so a READ
+// hit never has to sum the track.
+//
+// Writes are normally written through to the image. In write-behind
+// mode they only update the cache and mark the track dirty, and
+// flushDirty() later writes the dirty tracks to the image from another
+// thread. Either way READ always returns what was last written.
+//
+// The geometry of the image gives the track offsets and, where the
+// image has fewer tracks than CACHE_TRACKS, the number of LRU slots.
+//
+// LRU cached images can also be read ahead. prefetchTrack() loads a
+// track from another thread without holding up READ hits, and drops it
+// if a WRIT arrives while the image is being read.
+//
+class FDCTrackCache
+{
+public:
+	FDCTrackCache();
+	~FDCTrackCache();
+
+	void attach(FDCImage *image, bool enable, const FDCGeometry &geometry = FDCGeometry(), bool writeBehind = false);
+	void detach(void);
+	qint64 readTrack(quint16 track, quint16 trackLen, const quint8 **data, quint16 *checksum, int *outcome = nullptr);
+	qint64 writeTrack(quint16 track, quint16 trackLen, const quint8 *data, quint16 checksum);
+	int flushDirty(void);
+	bool prefetchTrack(quint16 track, quint16 trackLen);
+
+	bool isEnabled(void) const { return enabled; }
+	bool isResident(void) const { return resident != nullptr; }
+	const quint8 *residentData(void) const { return resident; }
+	bool isWriteBehind(void) const { return writeBehind; }
+	bool isPrefetchable(void) const { return trackSlot != nullptr; }
+	int dirtyCount(void);
+
+private:
+	QMutex flushLock;				// one flushDirty() at a time
+	QMutex lock;					// cache contents
+	QMutex ioLock;					// image access
+	FDCImage *image;
+	bool enabled;
+	bool writeBehind;
+	const quint8 *resident;				// whole image in memory
+	qint64 residentSize;
+	QByteArray preload;				// preloaded copy of an unmapped image
+	bool preloaded;
+	QVector<quint16> residentSum;			// resident track checksums
+	quint16 sumLen;					// track length of residentSum
+	FDCGeometry geom;
+	const qint64 *offsets;				// track offsets of the geometry
+	int offsetCount;				// 0 if the track length is not fixed
+	QHash<quint16, quint16> residentDirty;		// dirty preloaded tracks and lengths
+	ttrackslot_t *trackSlot;			// LRU track slots
+	QHash<quint16, int> index;			// track number to slot
+	int slotCount;
+	int mru;
+	int lru;
+	int dirty;
+	QByteArray flushBuf;
+	quint8 trkBuf[TRKBUF_SIZE];			// uncached read buffer
+	quint8 prefetchBuf[TRKBUF_SIZE];		// read ahead buffer, under flushLock
+	quint32 writeGen;				// bumped by every writeTrack()
+
+	// Image offset of a track, looked up if the geometry fixes its length
+	qint64 offsetOf(quint16 track, quint16 trackLen) const
+	{
+		return (trackLen == sumLen && track < offsetCount) ? offsets[track] : (qint64) track * trackLen;
+	}
+
+	bool loadPreload(void);
+	qint64 readUncached(qint64 offset, quint16 trackLen, const quint8 **data, quint16 *checksum);
+	qint64 writeThrough(quint16 track, quint16 trackLen, const quint8 *data, quint16 checksum);
+	int evictSlot(void);
+	void sumResident(int firstTrack);
+	void unlink(int slot);
+	void linkFront(int slot);
+};
+#endif
@@ -0,0 +1,346 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Checksum Kernels
+*      SSE2, AVX2 and NEON versions of the 16 bit track byte sum, and of
+*      the sum fused with a copy, with scalar fallbacks and runtime
+*      selection.
+*
+***********************************************************************************/
+
+#include "fdc-checksum.h"
+
+#if defined(Q_PROCESSOR_X86)
+#define CHECKSUM_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2		__attribute__((target("sse2")))
+#define TARGET_AVX2		__attribute__((target("avx2")))
+#endif
+#endif
+
+#if defined(Q_PROCESSOR_ARM) && (defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64))
+#define CHECKSUM_ARM
+#include <arm_neon.h>
+#endif
+
+typedef quint16 (*checksumfn_t)(const quint8 *data, int length);
+typedef quint16 (*copychecksumfn_t)(quint8 *dst, const quint8 *src, int length);
+
+static quint16 scalarChecksum(const quint8 *data, int length)
+{
+	quint16 checksum = 0;
+
+	while (length--) {
+		checksum += *data++;
+	}
+
+	return checksum;
+}
+
+static quint16 scalarCopyChecksum(quint8 *dst, const quint8 *src, int length)
+{
+	quint16 checksum = 0;
+
+	while (length--) {
+		checksum += *dst++ = *src++;
+	}
+
+	return checksum;
+}
+
+#ifdef CHECKSUM_X86
+//
+// psadbw against zero adds each group of 8 bytes into a 64 bit lane,
+// so a track never gets close to overflowing the accumulators
+//
+TARGET_SSE2 static quint16 sse2Checksum(const quint8 *data, int length)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	int i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (data + i)), zero));
+		acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (data + i + 16)), zero));
+	}
+
+	for (; i + 16 <= length; i += 16) {
+		acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (data + i)), zero));
+	}
+
+	acc0 = _mm_add_epi64(acc0, acc1);
+	acc0 = _mm_add_epi64(acc0, _mm_unpackhi_epi64(acc0, acc0));
+
+	return (quint16) _mm_cvtsi128_si32(acc0) + scalarChecksum(data + i, length - i);
+}
+
+TARGET_AVX2 static quint16 avx2Checksum(const quint8 *data, int length)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	__m128i sum;
+	int i = 0;
+
+	for (; i + 64 <= length; i += 64) {
+		acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *) (data + i)), zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *) (data + i + 32)), zero));
+	}
+
+	for (; i + 32 <= length; i += 32) {
+		acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *) (data + i)), zero));
+	}
+
+	acc0 = _mm256_add_epi64(acc0, acc1);
+	sum = _mm_add_epi64(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+
+	return (quint16) _mm_cvtsi128_si32(sum) + scalarChecksum(data + i, length - i);
+}
+
+//
+// The copy kernels sum each vector while it is in a register on its
+// way to dst, so a track is read from memory once
+//
+TARGET_SSE2 static quint16 sse2CopyChecksum(quint8 *dst, const quint8 *src, int length)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	__m128i v;
+	int i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (src + i));
+		_mm_storeu_si128((__m128i *) (dst + i), v);
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+	}
+
+	acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+
+	return (quint16) _mm_cvtsi128_si32(acc) + scalarCopyChecksum(dst + i, src + i, length - i);
+}
+
+TARGET_AVX2 static quint16 avx2CopyChecksum(quint8 *dst, const quint8 *src, int length)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = _mm256_setzero_si256();
+	__m256i v;
+	__m128i sum;
+	int i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (src + i));
+		_mm256_storeu_si256((__m256i *) (dst + i), v);
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+	}
+
+	sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+
+	return (quint16) _mm_cvtsi128_si32(sum) + scalarCopyChecksum(dst + i, src + i, length - i);
+}
+
+static bool haveSSE2(void)
+{
+#if defined(Q_PROCESSOR_X86_64) || defined(__SSE2__)
+	return true;
+#elif defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 1);
+
+	return (info[3] & (1 << 26)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static bool haveAVX2(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+
+	// OSXSAVE and AVX, and the OS saves the YMM state
+	__cpuid(info, 1);
+	if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6) {
+		return false;
+	}
+
+	__cpuidex(info, 7, 0);
+
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifdef CHECKSUM_ARM
+//
+// Pairwise widening adds, bytes to 16 bit to 32 bit lanes
+//
+static quint16 neonChecksum(const quint8 *data, int length)
+{
+	uint32x4_t acc0 = vdupq_n_u32(0);
+	uint32x4_t acc1 = vdupq_n_u32(0);
+	uint32x2_t sum;
+	int i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		acc0 = vpadalq_u16(acc0, vpaddlq_u8(vld1q_u8(data + i)));
+		acc1 = vpadalq_u16(acc1, vpaddlq_u8(vld1q_u8(data + i + 16)));
+	}
+
+	for (; i + 16 <= length; i += 16) {
+		acc0 = vpadalq_u16(acc0, vpaddlq_u8(vld1q_u8(data + i)));
+	}
+
+	acc0 = vaddq_u32(acc0, acc1);
+	sum = vadd_u32(vget_low_u32(acc0), vget_high_u32(acc0));
+	sum = vpadd_u32(sum, sum);
+
+	return (quint16) vget_lane_u32(sum, 0) + scalarChecksum(data + i, length - i);
+}
+
+static quint16 neonCopyChecksum(quint8 *dst, const quint8 *src, int length)
+{
+	uint32x4_t acc = vdupq_n_u32(0);
+	uint32x2_t sum;
+	uint8x16_t v;
+	int i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		v = vld1q_u8(src + i);
+		vst1q_u8(dst + i, v);
+		acc = vpadalq_u16(acc, vpaddlq_u8(v));
+	}
+
+	sum = vadd_u32(vget_low_u32(acc), vget_high_u32(acc));
+	sum = vpadd_u32(sum, sum);
+
+	return (quint16) vget_lane_u32(sum, 0) + scalarCopyChecksum(dst + i, src + i, length - i);
+}
+#endif
+
+static const checksumfn_t kernel[CHECKSUM_KERNELS] = {
+	scalarChecksum,
+#ifdef CHECKSUM_X86
+	sse2Checksum,
+	avx2Checksum,
+#else
+	nullptr,
+	nullptr,
+#endif
+#ifdef CHECKSUM_ARM
+	neonChecksum,
+#else
+	nullptr,
+#endif
+};
+
+static const copychecksumfn_t copyKernel[CHECKSUM_KERNELS] = {
+	scalarCopyChecksum,
+#ifdef CHECKSUM_X86
+	sse2CopyChecksum,
+	avx2CopyChecksum,
+#else
+	nullptr,
+	nullptr,
+#endif
+#ifdef CHECKSUM_ARM
+	neonCopyChecksum,
+#else
+	nullptr,
+#endif
+};
+
+bool checksumKernelAvailable(int k)
+{
+	switch (k) {
+		case CHECKSUM_SCALAR:
+			return true;
+#ifdef CHECKSUM_X86
+		case CHECKSUM_SSE2:
+			return haveSSE2();
+		case CHECKSUM_AVX2:
+			return haveAVX2();
+#endif
+#ifdef CHECKSUM_ARM
+		case CHECKSUM_NEON:
+			return true;
+#endif
+	}
+
+	return false;
+}
+
+static int selectKernel(void)
+{
+	static const int preference[] = { CHECKSUM_AVX2, CHECKSUM_NEON, CHECKSUM_SSE2 };
+
+	for (int k : preference) {
+		if (checksumKernelAvailable(k)) {
+			return k;
+		}
+	}
+
+	return CHECKSUM_SCALAR;
+}
+
+//
+// Selected on first use, so checksums work from any static initializer
+//
+static int selected(void)
+{
+	static const int k = selectKernel();
+
+	return k;
+}
+
+quint16 trackChecksum(const quint8 *data, int length)
+{
+	static const checksumfn_t fn = kernel[selected()];
+
+	return fn(data, length);
+}
+
+quint16 trackCopyChecksum(quint8 *dst, const quint8 *src, int length)
+{
+	static const copychecksumfn_t fn = copyKernel[selected()];
+
+	return fn(dst, src, length);
+}
+
+quint16 kernelChecksum(int k, const quint8 *data, int length)
+{
+	return (k >= 0 && k < CHECKSUM_KERNELS && checksumKernelAvailable(k)) ? kernel[k](data, length) : scalarChecksum(data, length);
+}
+
+quint16 kernelCopyChecksum(int k, quint8 *dst, const quint8 *src, int length)
+{
+	return (k >= 0 && k < CHECKSUM_KERNELS && checksumKernelAvailable(k)) ? copyKernel[k](dst, src, length) : scalarCopyChecksum(dst, src, length);
+}
+
+int checksumKernelSelected()
+{
+	return selected();
+}
+
+const char *checksumKernelName(int k)
+{
+	static const char *name[CHECKSUM_KERNELS] = { "scalar", "sse2", "avx2", "neon" };
+
+	return (k >= 0 && k < CHECKSUM_KERNELS) ? name[k] : "unknown";
+}
@@ -0,0 +1,29 @@
+#ifndef FDCCHECKSUM_H
+#define FDCCHECKSUM_H
+
+#include <QtGlobal>
+
+#define CHECKSUM_SCALAR		0			// checksum kernels
+#define CHECKSUM_SSE2		1
+#define CHECKSUM_AVX2		2
+#define CHECKSUM_NEON		3
+#define CHECKSUM_KERNELS	4
+
+#define CHECKSUM_SIMD_MIN	64			// shorter buffers are summed inline
+
+//
+// 16 bit byte sums using the fastest kernel the CPU supports, chosen
+// once at startup. Every kernel gives exactly the result of the scalar
+// loop. trackCopyChecksum() also copies src to dst in the same pass.
+// The per-kernel entry points are there for verification and
+// benchmarks.
+//
+quint16 trackChecksum(const quint8 *data, int length);
+quint16 trackCopyChecksum(quint8 *dst, const quint8 *src, int length);
+quint16 kernelChecksum(int kernel, const quint8 *data, int length);
+quint16 kernelCopyChecksum(int kernel, quint8 *dst, const quint8 *src, int length);
+bool checksumKernelAvailable(int kernel);
+int checksumKernelSelected(void);
+const char *checksumKernelName(int kernel);
+
+#endif
@@ -0,0 +1,454 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Compressed Images
+*      Track indexed container of fill, zlib and raw track blocks, served
+*      to the FDC+ as the plain image it was packed from.
+*
+***********************************************************************************/
+
+#include <QtEndian>
+#include <QSaveFile>
+#include <string.h>
+
+#include "fdc-compressed.h"
+#include "fdc-geometry.h"
+#include "fdc-protocol.h"
+
+#define FDZ_HEADER_LEN		24			// on disk sizes
+#define FDZ_ENTRY_LEN		16
+
+static void putHeader(quint8 *buf, const tfdzheader_t &h)
+{
+	memcpy(buf, h.magic, 4);
+	qToLittleEndian<quint16>(h.version, buf + 4);
+	qToLittleEndian<quint16>(h.trackLen, buf + 6);
+	qToLittleEndian<quint32>(h.tracks, buf + 8);
+	qToLittleEndian<quint32>(h.reserved, buf + 12);
+	qToLittleEndian<quint64>(h.size, buf + 16);
+}
+
+static void getHeader(const quint8 *buf, tfdzheader_t *h)
+{
+	memcpy(h->magic, buf, 4);
+	h->version = qFromLittleEndian<quint16>(buf + 4);
+	h->trackLen = qFromLittleEndian<quint16>(buf + 6);
+	h->tracks = qFromLittleEndian<quint32>(buf + 8);
+	h->reserved = qFromLittleEndian<quint32>(buf + 12);
+	h->size = qFromLittleEndian<quint64>(buf + 16);
+}
+
+static void putEntry(quint8 *buf, const tfdzentry_t &e)
+{
+	qToLittleEndian<quint64>(e.offset, buf);
+	qToLittleEndian<quint32>(e.length, buf + 8);
+	buf[12] = e.type;
+	buf[13] = e.fill;
+	qToLittleEndian<quint16>(e.reserved, buf + 14);
+}
+
+static void getEntry(const quint8 *buf, tfdzentry_t *e)
+{
+	e->offset = qFromLittleEndian<quint64>(buf);
+	e->length = qFromLittleEndian<quint32>(buf + 8);
+	e->type = buf[12];
+	e->fill = buf[13];
+	e->reserved = qFromLittleEndian<quint16>(buf + 14);
+}
+
+bool FDCCompressedImage::open(const QString &fname, QIODevice::OpenMode mode)
+{
+	quint8 buf[FDZ_HEADER_LEN];
+
+	file.setFileName(fname);
+
+	if (!file.open(mode)) {
+		return false;
+	}
+
+	if (file.read((char *) buf, FDZ_HEADER_LEN) != FDZ_HEADER_LEN) {
+		file.close();
+		return false;
+	}
+
+	getHeader(buf, &header);
+
+	// Bound the index before reading it
+	if (memcmp(header.magic, FDZ_MAGIC, 4) || header.version != FDZ_VERSION
+		|| header.tracks > GEOM_MAX_TRACKS
+		|| !header.trackLen || header.trackLen > TRKBUF_SIZE
+		|| header.size > (quint64) header.tracks * header.trackLen) {
+		file.close();
+		return false;
+	}
+
+	QByteArray table = file.read((qint64) header.tracks * FDZ_ENTRY_LEN);
+
+	if (table.size() != (qint64) header.tracks * FDZ_ENTRY_LEN) {
+		file.close();
+		return false;
+	}
+
+	index.resize(header.tracks);
+
+	for (quint32 t = 0; t < header.tracks; t++) {
+		getEntry((const quint8 *) table.constData() + t * FDZ_ENTRY_LEN, &index[t]);
+	}
+
+	decoded.resize(header.trackLen);
+	decodedTrack = -1;
+
+	return true;
+}
+
+void FDCCompressedImage::close()
+{
+	file.close();
+	index.clear();
+	decoded.clear();
+	decodedTrack = -1;
+}
+
+qint64 FDCCompressedImage::read(qint64 offset, quint8 *data, qint64 len)
+{
+	qint64 pos;
+
+	if (!file.isOpen() || offset < 0 || offset > (qint64) header.size) {
+		return -1;
+	}
+
+	len = qMin(len, (qint64) header.size - offset);
+
+	for (pos = 0; pos < len; ) {
+		int t = (offset + pos) / header.trackLen;
+		int within = (offset + pos) % header.trackLen;
+		qint64 n = qMin((qint64) header.trackLen - within, len - pos);
+		const quint8 *src = track(t);
+
+		if (src == nullptr) {
+			return (pos) ? pos : -1;
+		}
+
+		memcpy(data + pos, src + within, n);
+		pos += n;
+	}
+
+	return len;
+}
+
+qint64 FDCCompressedImage::write(qint64 offset, const quint8 *data, qint64 len)
+{
+	QByteArray buf(header.trackLen, 0);
+	qint64 pos;
+
+	if (!file.isOpen() || !(file.openMode() & QIODevice::WriteOnly) || offset < 0 || offset > (qint64) header.size) {
+		return -1;
+	}
+
+	len = qMin(len, (qint64) header.size - offset);
+
+	for (pos = 0; pos < len; ) {
+		int t = (offset + pos) / header.trackLen;
+		int within = (offset + pos) % header.trackLen;
+		qint64 n = qMin((qint64) header.trackLen - within, len - pos);
+
+		// Part of a track, merge with what is there
+		if (within || n < header.trackLen) {
+			const quint8 *src = track(t);
+
+			if (src == nullptr) {
+				break;
+			}
+			memcpy(buf.data(), src, header.trackLen);
+		}
+
+		memcpy(buf.data() + within, data + pos, n);
+
+		if (!store(t, (const quint8 *) buf.constData())) {
+			break;
+		}
+
+		pos += n;
+	}
+
+	return (pos || !len) ? pos : -1;
+}
+
+bool FDCCompressedImage::flush()
+{
+	return file.flush();
+}
+
+//
+// Decompressed track t, or nullptr if its block can't be read
+//
+const quint8 *FDCCompressedImage::track(int t)
+{
+	if (t == decodedTrack) {
+		return (const quint8 *) decoded.constData();
+	}
+
+	const tfdzentry_t &entry = index.at(t);
+
+	decodedTrack = -1;
+
+	switch (entry.type) {
+		case FDZ_BLOCK_FILL:
+			memset(decoded.data(), entry.fill, header.trackLen);
+			break;
+
+		case FDZ_BLOCK_RAW:
+			if (entry.length != header.trackLen || !file.seek(entry.offset)
+				|| file.read(decoded.data(), header.trackLen) != header.trackLen) {
+				return nullptr;
+			}
+			break;
+
+		case FDZ_BLOCK_ZLIB: {
+			if (!file.seek(entry.offset)) {
+				return nullptr;
+			}
+
+			QByteArray raw = qUncompress(file.read(entry.length));
+
+			if (raw.size() != header.trackLen) {
+				return nullptr;
+			}
+
+			memcpy(decoded.data(), raw.constData(), header.trackLen);
+			break;
+		}
+
+		default:
+			return nullptr;
+	}
+
+	decodedTrack = t;
+
+	return (const quint8 *) decoded.constData();
+}
+
+//
+// Compress and write track t and its index entry. The block is always
+// appended and the entry rewritten last, so until then the old entry
+// still points at the old, intact block and a crash loses at most this
+// write. Blocks left behind are only reclaimed by packing the image
+// again. The compression runs on the caller's thread, in write-through
+// mode that is before WSTA goes back.
+//
+bool FDCCompressedImage::store(int t, const quint8 *data)
+{
+	tfdzentry_t entry;
+	QByteArray block;
+	quint8 buf[FDZ_ENTRY_LEN];
+
+	encode(data, header.trackLen, &entry, &block);
+
+	if (block.size()) {
+		entry.offset = file.size();
+
+		if (!file.seek(entry.offset) || file.write(block) != block.size() || !file.flush()) {
+			return false;
+		}
+	}
+
+	putEntry(buf, entry);
+
+	if (!file.seek(FDZ_HEADER_LEN + (qint64) t * FDZ_ENTRY_LEN) || file.write((const char *) buf, FDZ_ENTRY_LEN) != FDZ_ENTRY_LEN) {
+		return false;
+	}
+
+	index[t] = entry;
+
+	memcpy(decoded.data(), data, header.trackLen);
+	decodedTrack = t;
+
+	return true;
+}
+
+void FDCCompressedImage::encode(const quint8 *data, int len, tfdzentry_t *entry, QByteArray *block)
+{
+	int i;
+
+	entry->offset = 0;
+	entry->length = 0;
+	entry->fill = 0;
+	entry->reserved = 0;
+
+	for (i = 1; i < len && data[i] == data[0]; i++) {
+	}
+
+	if (i == len) {
+		entry->type = FDZ_BLOCK_FILL;
+		entry->fill = data[0];
+		block->clear();
+		return;
+	}
+
+	*block = qCompress(data, len);
+
+	if (block->size() < len) {
+		entry->type = FDZ_BLOCK_ZLIB;
+	}
+	else {
+		entry->type = FDZ_BLOCK_RAW;
+		*block = QByteArray((const char *) data, len);
+	}
+
+	entry->length = block->size();
+}
+
+bool FDCCompressedImage::probe(const QString &fname)
+{
+	QFile f(fname);
+	char magic[4];
+
+	return f.open(QIODevice::ReadOnly) && f.read(magic, 4) == 4 && !memcmp(magic, FDZ_MAGIC, 4);
+}
+
+//
+// Write a compressed copy of a plain image. The track length is the one
+// its size implies, see FDCGeometry::fromSize(). A compressed source is
+// repacked with its own track length, which drops the blocks that
+// store() left behind; src and dst may then be the same file, dst is
+// only replaced once the copy is complete.
+//
+bool FDCCompressedImage::pack(const QString &src, const QString &dst, QString *error)
+{
+	FDCCompressedImage packed;
+	QFile in(src);
+	QSaveFile out(dst);
+	tfdzheader_t hdr;
+	quint8 buf[FDZ_HEADER_LEN];
+	FDCGeometry geometry;
+	quint16 trackLen;
+	qint64 size;
+	bool repack = probe(src);
+
+	if (repack) {
+		if (!packed.open(src, QIODevice::ReadOnly)) {
+			*error = QString("'%1' is not a compressed image").arg(src);
+			return false;
+		}
+
+		trackLen = packed.header.trackLen;
+		size = packed.size();
+	}
+	else {
+		if (!in.open(QIODevice::ReadOnly)) {
+			*error = QString("Could not open '%1'").arg(src);
+			return false;
+		}
+
+		size = in.size();
+		geometry.fromSize(size);
+		trackLen = geometry.trackLen();
+
+		if (!trackLen) {
+			trackLen = TRKBUF_SIZE;
+		}
+	}
+
+	memcpy(hdr.magic, FDZ_MAGIC, 4);
+	hdr.version = FDZ_VERSION;
+	hdr.trackLen = trackLen;
+	hdr.tracks = (size + trackLen - 1) / trackLen;
+	hdr.reserved = 0;
+	hdr.size = size;
+
+	if (hdr.tracks > GEOM_MAX_TRACKS) {
+		*error = QString("'%1' has more than %2 tracks").arg(src).arg(GEOM_MAX_TRACKS);
+		return false;
+	}
+
+	if (!out.open(QIODevice::WriteOnly)) {
+		*error = QString("Could not create '%1'").arg(dst);
+		return false;
+	}
+
+	QByteArray table(hdr.tracks * FDZ_ENTRY_LEN, 0);
+	qint64 pos = FDZ_HEADER_LEN + table.size();
+
+	putHeader(buf, hdr);
+	out.write((const char *) buf, FDZ_HEADER_LEN);
+	out.write(table);
+
+	for (quint32 t = 0; t < hdr.tracks; t++) {
+		QByteArray raw;
+		QByteArray block;
+		tfdzentry_t entry;
+
+		if (repack) {
+			raw.resize(trackLen);
+			qint64 n = packed.read((qint64) t * trackLen, (quint8 *) raw.data(), trackLen);
+
+			if (n < 0) {
+				*error = QString("Could not read '%1'").arg(src);
+				return false;
+			}
+			raw.resize(n);
+		}
+		else {
+			raw = in.read(trackLen);
+		}
+
+		// A short last track is padded
+		raw.append(QByteArray(trackLen - raw.size(), 0));
+
+		encode((const quint8 *) raw.constData(), trackLen, &entry, &block);
+
+		if (block.size()) {
+			entry.offset = pos;
+			if (out.write(block) != block.size()) {
+				*error = QString("Could not write '%1'").arg(dst);
+				return false;
+			}
+			pos += block.size();
+		}
+
+		putEntry((quint8 *) table.data() + t * FDZ_ENTRY_LEN, entry);
+	}
+
+	if (!out.seek(FDZ_HEADER_LEN) || out.write(table) != table.size()) {
+		*error = QString("Could not write '%1'").arg(dst);
+		return false;
+	}
+
+	packed.close();
+
+	if (!out.commit()) {
+		*error = QString("Could not write '%1'").arg(dst);
+		return false;
+	}
+
+	return true;
+}
+
+bool FDCCompressedImage::unpack(const QString &src, const QString &dst, QString *error)
+{
+	FDCCompressedImage image;
+	QFile out(dst);
+	QByteArray buf;
+
+	if (!image.open(src, QIODevice::ReadOnly)) {
+		*error = QString("'%1' is not a compressed image").arg(src);
+		return false;
+	}
+
+	if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		*error = QString("Could not create '%1'").arg(dst);
+		return false;
+	}
+
+	buf.resize(image.header.trackLen);
+
+	for (qint64 pos = 0; pos < image.size(); pos += buf.size()) {
+		qint64 n = image.read(pos, (quint8 *) buf.data(), buf.size());
+
+		if (n <= 0 || out.write(buf.constData(), n) != n) {
+			*error = QString("Could not unpack '%1'").arg(src);
+			return false;
+		}
+	}
+
+	return true;
+}
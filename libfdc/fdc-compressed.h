@@ -0,0 +1,78 @@
+#ifndef FDCCOMPRESSED_H
+#define FDCCOMPRESSED_H
+
+#include <QFile>
+#include <QVector>
+#include <QByteArray>
+
+#include "fdc-image.h"
+
+#define FDZ_MAGIC		"FDCZ"			// compressed container header
+#define FDZ_VERSION		1
+#define FDZ_SUFFIX		".fdz"
+
+#define FDZ_BLOCK_RAW		0			// track stored as is
+#define FDZ_BLOCK_ZLIB		1			// qCompress() of the track
+#define FDZ_BLOCK_FILL		2			// every byte is fill, no data
+
+typedef struct TFDZHEADER {
+	char magic[4];
+	quint16 version;
+	quint16 trackLen;
+	quint32 tracks;					// index entries
+	quint32 reserved;
+	quint64 size;					// uncompressed image size
+} tfdzheader_t;
+
+typedef struct TFDZENTRY {
+	quint64 offset;					// block position in the file
+	quint32 length;					// block length in the file
+	quint8 type;					// FDZ_BLOCK_*
+	quint8 fill;					// fill byte of FDZ_BLOCK_FILL
+	quint16 reserved;
+} tfdzentry_t;
+
+//
+// Compressed disk image container. A header and a track index table
+// are followed by one block per track, uniform tracks (mostly 0xE5 on
+// empty disks) take no space at all and the rest are zlib compressed
+// where that helps. The FDC+ sees the uncompressed image: read()
+// decompresses tracks as they are asked for, which the track cache then
+// keeps, and write() recompresses the tracks it touches. Rewritten
+// blocks are appended to the file and the index entry updated after
+// them, pack() on the image compacts it again. The image cannot grow
+// past the tracks it was packed with.
+//
+// Recompression is done where the write is. Mounted write-through,
+// every WRIT pays for a qCompress() before WSTA; use write-behind on
+// images that see many writes.
+//
+// All values are stored little endian.
+//
+class FDCCompressedImage : public FDCImage
+{
+public:
+	bool open(const QString &fname, QIODevice::OpenMode mode);
+	void close(void);
+	bool isOpen(void) const { return file.isOpen(); }
+	qint64 size(void) const { return header.size; }
+	qint64 read(qint64 offset, quint8 *data, qint64 len);
+	qint64 write(qint64 offset, const quint8 *data, qint64 len);
+	bool flush(void);
+
+	static bool probe(const QString &fname);
+	static bool pack(const QString &src, const QString &dst, QString *error);
+	static bool unpack(const QString &src, const QString &dst, QString *error);
+
+private:
+	QFile file;
+	tfdzheader_t header;
+	QVector<tfdzentry_t> index;
+	QByteArray decoded;				// last track decompressed
+	int decodedTrack;
+
+	const quint8 *track(int t);
+	bool store(int t, const quint8 *data);
+	static void encode(const quint8 *data, int len, tfdzentry_t *entry, QByteArray *block);
+};
+#endif
@@ -0,0 +1,83 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Dashboard
+*      Fixed column text of the dashboard rows, from the status block.
+*
+***********************************************************************************/
+
+#include "fdc-dashboard.h"
+#include "fdc-worker.h"
+
+FDCDashboard::FDCDashboard()
+{
+	text[DASHBOARD_STAT] = QString("STAT").leftJustified(DASHBOARD_WIDTH);
+	text[DASHBOARD_READ] = QString("READ").leftJustified(DASHBOARD_WIDTH);
+	text[DASHBOARD_WRIT] = QString("WRIT").leftJustified(DASHBOARD_WIDTH);
+	text[DASHBOARD_ERR] = QString("ERROR").leftJustified(DASHBOARD_WIDTH);
+	dirty = (1 << DASHBOARD_ROWS) - 1;
+}
+
+void FDCDashboard::put(const QString &field, int row, int pos, int len)
+{
+	text[row].replace(pos, len, field);
+	dirty |= (1 << row);
+}
+
+//
+// Count, drive and parameters of the last command of a kind, on its row
+//
+void FDCDashboard::command(const FDCStatus *status, int command)
+{
+	int row;
+	const tcmdstatus_t *cmd = &status->cmd[command];
+
+	switch (command) {
+		case FDC_CMD_READ:
+			row = DASHBOARD_READ;
+			break;
+
+		case FDC_CMD_WRIT:
+			row = DASHBOARD_WRIT;
+			break;
+
+		default:
+			row = DASHBOARD_STAT;
+			break;
+	}
+
+	put(QString("%1").arg(cmd->count.loadAcquire(),6,10,QChar('0')), row, 6, 6);
+	put(QString("0x%1").arg(cmd->driveNum.loadAcquire(),2,16,QChar('0')), row, 14, 4);
+	put(QString("0x%1").arg(cmd->param1.loadAcquire(),4,16,QChar('0')), row, 20, 6);
+	put(QString("0x%1").arg(cmd->param2.loadAcquire(),4,16,QChar('0')), row, 28, 6);
+}
+
+void FDCDashboard::cache(const FDCStatus *status)
+{
+	put(QString("HIT %1").arg(status->hits.loadAcquire(),6,10,QChar('0')), DASHBOARD_READ, 40, 10);
+	put(QString("MISS %1").arg(status->misses.loadAcquire(),6,10,QChar('0')), DASHBOARD_READ, 52, 11);
+}
+
+void FDCDashboard::dirtyTracks(const FDCStatus *status)
+{
+	put(QString("DIRTY %1").arg(status->dirty.loadAcquire(),4,10,QChar('0')), DASHBOARD_WRIT, 40, 10);
+}
+
+void FDCDashboard::error(quint64 count, const QString &message)
+{
+	put(QString("%1").arg(count,6,10,QChar('0')), DASHBOARD_ERR, 6, 6);
+	put(message.leftJustified(74), DASHBOARD_ERR, 14, 74);
+}
+
+void FDCDashboard::clearError()
+{
+	put(QString("").leftJustified(74), DASHBOARD_ERR, 14, 74);
+}
+
+//
+// Link state (baud rate probe, recovery) at the end of the STAT row,
+// cut to fit
+//
+void FDCDashboard::link(const QString &message)
+{
+	put(QString("LINK %1").arg(message).leftJustified(48, ' ', true), DASHBOARD_STAT, 40, 48);
+}
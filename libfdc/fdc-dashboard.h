@@ -0,0 +1,41 @@
+#ifndef FDCDASHBOARD_H
+#define FDCDASHBOARD_H
+
+#include <QString>
+
+#include "fdc-status.h"
+
+#define DASHBOARD_ROWS		4			// Number of dashboard rows
+#define DASHBOARD_STAT		0
+#define DASHBOARD_READ		1
+#define	DASHBOARD_WRIT		2
+#define DASHBOARD_ERR		3			// Error row
+#define DASHBOARD_WIDTH		80			// row text before any field runs past it
+
+//
+// Text of the dashboard rows, formatted from the worker's status block.
+// Edits only change the row text and mark the row dirty; the dialog
+// takes the dirty rows once per tick and sets them on its labels. Kept
+// out of the GUI so the microbenchmarks time the same formatting.
+//
+class FDCDashboard
+{
+public:
+	FDCDashboard();
+
+	void put(const QString &field, int row, int pos, int len);
+	void command(const FDCStatus *status, int command);
+	void cache(const FDCStatus *status);
+	void dirtyTracks(const FDCStatus *status);
+	void error(quint64 count, const QString &message);
+	void clearError(void);
+	void link(const QString &message);
+
+	const QString &row(int n) const { return text[n]; }
+	int takeDirty(void) { int rows = dirty; dirty = 0; return rows; }
+
+private:
+	QString text[DASHBOARD_ROWS];
+	int dirty;					// bit per row changed since takeDirty()
+};
+#endif
@@ -0,0 +1,96 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Deferred Diagnostics
+*      Formats protocol error events after the fact.
+*
+***********************************************************************************/
+
+#include "fdc-diag.h"
+#include "fdc-protocol.h"
+
+//
+// Text of the oldest event, or of the dropped count once the queue is
+// empty. Returns false when there is nothing left.
+//
+bool FDCDiagQueue::take(QString *text)
+{
+	if (head != tail) {
+		*text = format(event[tail++ & (DIAG_QUEUE_SIZE - 1)]);
+		return true;
+	}
+
+	if (dropped) {
+		*text = QString("%1 more errors not shown").arg(dropped);
+		dropped = 0;
+		return true;
+	}
+
+	return false;
+}
+
+QString FDCDiagQueue::format(const tdiagevent_t &ev)
+{
+	switch (ev.code) {
+		case DIAG_PARTIAL_CMD:
+			return QString("received partial command buffer %1/10 bytes").arg(ev.arg1);
+
+		case DIAG_CMD_CHECKSUM:
+			return QString("CRC ERROR calc=%1 recv=%2").arg(ev.arg1,4,16).arg(ev.arg2,4,16);
+
+		case DIAG_UNKNOWN_CMD:
+			return QString("Received unknown command 0x%1").arg(ev.arg1,8,16,QChar('0'));
+
+		case DIAG_READ_NOT_LOADED:
+			return QString("READ error - drive %1 not loaded").arg(ev.arg1);
+
+		case DIAG_READ_TRACKLEN:
+			return QString("READ requested track len %1 > %2 bytes").arg(ev.arg1).arg(TRKBUF_SIZE);
+
+		case DIAG_READ_GEOMETRY:
+			return QString("READ requested track len %1, image has %2 byte tracks").arg(ev.arg1).arg(ev.arg2);
+
+		case DIAG_READ_TRACK:
+			return QString("READ requested track %1 > %2").arg(ev.arg1).arg(ev.arg2);
+
+		case DIAG_READ_SEEK:
+			return QString("read() error seeking to %1").arg(ev.arg1);
+
+		case DIAG_READ_SHORT:
+			return QString("read() failed - read %1 of %2 bytes").arg(ev.arg1).arg(ev.arg2);
+
+		case DIAG_WRIT_NOT_LOADED:
+			return QString("WRIT error - drive %1 not loaded").arg(ev.arg1);
+
+		case DIAG_WRIT_READONLY:
+			return QString("WRIT error - drive %1 is read-only").arg(ev.arg1);
+
+		case DIAG_WRIT_TRACKLEN:
+			return QString("WRIT requested track len %1 > %2 bytes").arg(ev.arg1).arg(TRKBUF_SIZE);
+
+		case DIAG_WRIT_GEOMETRY:
+			return QString("WRIT requested track len %1, image has %2 byte tracks").arg(ev.arg1).arg(ev.arg2);
+
+		case DIAG_WRIT_TRACK:
+			return QString("WRIT requested track %1 > %2").arg(ev.arg1).arg(ev.arg2);
+
+		case DIAG_WRIT_DATALEN:
+			return QString("WRIT received wrong track length (%1/%2)").arg(ev.arg1).arg(ev.arg2);
+
+		case DIAG_WRIT_SEEK:
+			return QString("WRIT error seeking to %1").arg(ev.arg1);
+
+		case DIAG_WRIT_FAILED:
+			return QString("WRIT file write error");
+
+		case DIAG_WRIT_CHECKSUM:
+			return QString("WRIT track checksum error");
+
+		case DIAG_SERIAL_LEN:
+			return QString("write serial port len=%1").arg(ev.arg1);
+
+		case DIAG_SERIAL_WRITE:
+			return QString("write serial port error (%1)").arg(ev.arg1);
+	}
+
+	return QString("unknown error %1").arg(ev.code);
+}
@@ -0,0 +1,75 @@
+#ifndef FDCDIAG_H
+#define FDCDIAG_H
+
+#include <QString>
+
+#define DIAG_QUEUE_SIZE		64			// power of two
+
+enum {
+	DIAG_PARTIAL_CMD,				// arg1 bytes received
+	DIAG_CMD_CHECKSUM,				// arg1 calculated, arg2 received
+	DIAG_UNKNOWN_CMD,				// arg1 opcode
+	DIAG_READ_NOT_LOADED,				// arg1 drive
+	DIAG_READ_TRACKLEN,				// arg1 requested length
+	DIAG_READ_GEOMETRY,				// arg1 requested length, arg2 image track length
+	DIAG_READ_TRACK,				// arg1 track, arg2 maximum track
+	DIAG_READ_SEEK,					// arg1 offset
+	DIAG_READ_SHORT,				// arg1 bytes read, arg2 track length
+	DIAG_WRIT_NOT_LOADED,				// arg1 drive
+	DIAG_WRIT_READONLY,				// arg1 drive
+	DIAG_WRIT_TRACKLEN,				// arg1 requested length
+	DIAG_WRIT_GEOMETRY,				// arg1 requested length, arg2 image track length
+	DIAG_WRIT_TRACK,				// arg1 track, arg2 maximum track
+	DIAG_WRIT_DATALEN,				// arg1 bytes received, arg2 expected
+	DIAG_WRIT_SEEK,					// arg1 offset
+	DIAG_WRIT_FAILED,
+	DIAG_WRIT_CHECKSUM,
+	DIAG_SERIAL_LEN,				// arg1 length
+	DIAG_SERIAL_WRITE,				// arg1 transport error
+	DIAG_COUNT
+};
+
+typedef struct TDIAGEVENT {
+	int code;
+	qint64 arg1;
+	qint64 arg2;
+} tdiagevent_t;
+
+//
+// Deferred diagnostics. The protocol path posts fixed size events, which
+// costs a few stores and no allocation, and the text is only built when
+// the queue is drained outside of command handling. When the queue is
+// full, events are counted and reported as dropped. Producer and
+// consumer must be on the same thread.
+//
+class FDCDiagQueue
+{
+public:
+	FDCDiagQueue() : head(0), tail(0), dropped(0) { }
+
+	void post(int code, qint64 arg1 = 0, qint64 arg2 = 0)
+	{
+		if (head - tail == DIAG_QUEUE_SIZE) {
+			dropped++;
+			return;
+		}
+
+		tdiagevent_t *ev = &event[head++ & (DIAG_QUEUE_SIZE - 1)];
+
+		ev->code = code;
+		ev->arg1 = arg1;
+		ev->arg2 = arg2;
+	}
+
+	bool isEmpty(void) const { return head == tail && !dropped; }
+	bool take(QString *text);
+
+	static QString format(const tdiagevent_t &ev);
+
+private:
+	tdiagevent_t event[DIAG_QUEUE_SIZE];
+	quint32 head;
+	quint32 tail;
+	quint32 dropped;
+};
+#endif
@@ -0,0 +1,190 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Image Geometry
+*      Track count, track length and track offsets of a mounted image,
+*      from its size or a sidecar descriptor.
+*
+***********************************************************************************/
+
+#include <QFileInfo>
+#include <QSettings>
+
+#include "fdc-geometry.h"
+#include "fdc-protocol.h"
+
+FDCGeometry::FDCGeometry()
+{
+	clear();
+}
+
+void FDCGeometry::clear()
+{
+	fmt = GEOM_UNKNOWN;
+	last = 0;
+	len = 0;
+	start = 0;
+	table.clear();
+}
+
+//
+// Geometry of fname, which is size bytes long. A sidecar, if there is
+// one, takes precedence over the size. Returns false with error set if
+// the sidecar could not be used.
+//
+bool FDCGeometry::probe(const QString &fname, qint64 size, QString *error)
+{
+	fromSize(size);
+
+	if (!QFileInfo::exists(sidecar(fname))) {
+		return true;
+	}
+
+	return readSidecar(sidecar(fname), error);
+}
+
+//
+// Minidisk, 8" floppy or hard disk by size, as the FDC+ drive types
+// would expect them. Only exact floppy sizes are recognized, while hard
+// disk images may be short of their full size and grow as they are
+// written. Other sizes that are a whole number of tracks of at most
+// TRKBUF_SIZE get that length.
+//
+void FDCGeometry::fromSize(qint64 size)
+{
+	int tracks;
+
+	if (size < 200000) {
+		tracks = MINIDISK_TRACKS;
+
+		if (size == (qint64) MINIDISK_TRACKS * MINIDISK_TRACKLEN) {
+			set(GEOM_MINIDISK, tracks, MINIDISK_TRACKLEN);
+			return;
+		}
+	}
+	else if (size < 500000) {
+		tracks = FLOPPY_TRACKS;
+
+		if (size == (qint64) FLOPPY_TRACKS * FLOPPY_TRACKLEN) {
+			set(GEOM_FLOPPY, tracks, FLOPPY_TRACKLEN);
+			return;
+		}
+	}
+	else {
+		tracks = HARDDISK_TRACKS;
+
+		if (size % HARDDISK_TRACKLEN == 0 && size <= (qint64) HARDDISK_TRACKS * HARDDISK_TRACKLEN) {
+			set(GEOM_HARDDISK, tracks, HARDDISK_TRACKLEN);
+			return;
+		}
+	}
+
+	if (size && size % tracks == 0 && size / tracks <= TRKBUF_SIZE) {
+		set(GEOM_SIZE, tracks, size / tracks);
+	}
+	else {
+		set(GEOM_UNKNOWN, tracks, 0);
+	}
+}
+
+const char *FDCGeometry::formatName() const
+{
+	static const char *name[] = { "unknown", "minidisk", "8\" floppy", "hard disk", "by size", "sidecar" };
+
+	return name[fmt];
+}
+
+void FDCGeometry::set(int format, int tracks, quint16 trackLen, qint64 base)
+{
+	fmt = format;
+	last = tracks - 1;
+	len = trackLen;
+	start = base;
+
+	table.clear();
+
+	if (!len) {
+		return;
+	}
+
+	table.resize(tracks);
+
+	for (int track = 0; track < tracks; track++) {
+		table[track] = start + (qint64) track * len;
+	}
+}
+
+//
+// Read a sidecar descriptor over the geometry found from the size. A
+// format sets the defaults of that drive type, which the other keys
+// then override.
+//
+bool FDCGeometry::readSidecar(const QString &fname, QString *error)
+{
+	QSettings settings(fname, QSettings::IniFormat);
+	QString name;
+	int tracks = last + 1;
+	int trackLen = len;
+	qint64 base;
+	bool ok;
+
+	if (settings.status() != QSettings::NoError) {
+		if (error != nullptr) {
+			*error = QString("Could not read '%1'").arg(fname);
+		}
+		return false;
+	}
+
+	settings.beginGroup("geometry");
+
+	name = settings.value("format").toString();
+
+	if (name == "minidisk") {
+		tracks = MINIDISK_TRACKS;
+		trackLen = MINIDISK_TRACKLEN;
+	}
+	else if (name == "floppy") {
+		tracks = FLOPPY_TRACKS;
+		trackLen = FLOPPY_TRACKLEN;
+	}
+	else if (name == "harddisk") {
+		tracks = HARDDISK_TRACKS;
+		trackLen = HARDDISK_TRACKLEN;
+	}
+	else if (!name.isEmpty()) {
+		if (error != nullptr) {
+			*error = QString("%1: unknown format '%2'").arg(fname).arg(name);
+		}
+		return false;
+	}
+
+	tracks = settings.value("tracks", tracks).toInt(&ok);
+
+	if (!ok || tracks < 1 || tracks > GEOM_MAX_TRACKS) {
+		if (error != nullptr) {
+			*error = QString("%1: tracks must be 1 to %2").arg(fname).arg(GEOM_MAX_TRACKS);
+		}
+		return false;
+	}
+
+	trackLen = settings.value("tracklen", trackLen).toInt(&ok);
+
+	if (!ok || trackLen < 1 || trackLen > TRKBUF_SIZE) {
+		if (error != nullptr) {
+			*error = QString("%1: tracklen must be 1 to %2").arg(fname).arg(TRKBUF_SIZE);
+		}
+		return false;
+	}
+
+	base = settings.value("offset", 0).toLongLong(&ok);
+
+	if (!ok || base < 0) {
+		if (error != nullptr) {
+			*error = QString("%1: invalid offset").arg(fname);
+		}
+		return false;
+	}
+
+	set(GEOM_SIDECAR, tracks, trackLen, base);
+
+	return true;
+}
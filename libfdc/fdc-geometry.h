@@ -0,0 +1,79 @@
+#ifndef FDCGEOMETRY_H
+#define FDCGEOMETRY_H
+
+#include <QString>
+#include <QVector>
+
+#define GEOM_UNKNOWN		0			// track lengths are taken as sent
+#define GEOM_MINIDISK		1			// 5.25" minidisk
+#define GEOM_FLOPPY		2			// 8" floppy
+#define GEOM_HARDDISK		3			// hard disk, 8" tracks
+#define GEOM_SIZE		4			// track length implied by the size
+#define GEOM_SIDECAR		5			// described by a sidecar file
+
+#define GEOM_SUFFIX		".geom"			// sidecar, appended to the image name
+#define GEOM_MAX_TRACKS		4096			// 12 bit track number
+
+#define SECTOR_LEN		137			// Altair sector with its framing
+#define MINIDISK_TRACKS		35
+#define MINIDISK_TRACKLEN	(SECTOR_LEN*16)
+#define FLOPPY_TRACKS		77
+#define FLOPPY_TRACKLEN		(SECTOR_LEN*32)
+#define HARDDISK_TRACKS		2048
+#define HARDDISK_TRACKLEN	(SECTOR_LEN*32)
+
+//
+// Geometry of a mounted image, found once at mount time. The known
+// minidisk, 8" floppy and hard disk sizes are recognized exactly, other
+// sizes fall back to the track count implied by the size. A sidecar
+// next to the image, image.dsk.geom, overrides both:
+//
+//     [geometry]
+//     format=harddisk          minidisk, floppy or harddisk defaults
+//     tracks=2048
+//     tracklen=4384
+//     offset=0                 bytes before track 0
+//
+// If the track length is known, the offset of every track is computed
+// here, so the READ and WRIT paths look it up instead of working it
+// out. Otherwise trackLen() is 0 and tracks are placed at track *
+// length as requested. Only the exact formats and sidecars hold the
+// FDC+ to their length, see isEnforced(); a length implied by the size
+// is a guess, used for the offsets and cache sizing while the FDC+
+// asks for that length, and ignored when it asks for another.
+//
+class FDCGeometry
+{
+public:
+	FDCGeometry();
+
+	bool probe(const QString &fname, qint64 size, QString *error = nullptr);
+	void fromSize(qint64 size);
+	void clear(void);
+
+	int format(void) const { return fmt; }
+	const char *formatName(void) const;
+	quint16 maxTrack(void) const { return last; }
+	int tracks(void) const { return last + 1; }
+	quint16 trackLen(void) const { return len; }
+	bool isFixed(void) const { return len != 0; }
+	bool isEnforced(void) const { return len != 0 && fmt != GEOM_SIZE; }
+	qint64 base(void) const { return start; }
+	const qint64 *offsets(void) const { return table.constData(); }
+
+	// Offset of a track no higher than maxTrack(), fixed geometry only
+	qint64 offset(quint16 track) const { return table.at(track); }
+
+	static QString sidecar(const QString &fname) { return fname + GEOM_SUFFIX; }
+
+private:
+	int fmt;
+	quint16 last;
+	quint16 len;
+	qint64 start;
+	QVector<qint64> table;				// track offsets, empty unless fixed
+
+	void set(int format, int tracks, quint16 trackLen, qint64 base = 0);
+	bool readSidecar(const QString &fname, QString *error);
+};
+#endif
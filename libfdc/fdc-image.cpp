@@ -0,0 +1,348 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Disk Image Backends
+*      File and memory mapped access to mounted disk images, and copy-on-
+*      write overlays on top of them.
+*
+***********************************************************************************/
+
+#include <QtGlobal>
+#include <QMutexLocker>
+#include <string.h>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "fdc-image.h"
+#include "fdc-compressed.h"
+#include "fdc-protocol.h"
+
+FDCImage *FDCImage::create(int type, int flushPolicy)
+{
+	if (type == IMAGE_MAPPED) {
+		return new FDCMappedImage(flushPolicy);
+	}
+	if (type == IMAGE_COMPRESSED) {
+		return new FDCCompressedImage;
+	}
+
+	return new FDCFileImage;
+}
+
+//
+// Backend for an image file. Compressed containers are recognized by
+// their header and always use their own backend.
+//
+FDCImage *FDCImage::createFor(const QString &fname, int type, int flushPolicy)
+{
+	return create((FDCCompressedImage::probe(fname)) ? IMAGE_COMPRESSED : type, flushPolicy);
+}
+
+//
+// QFile backend
+//
+bool FDCFileImage::open(const QString &fname, QIODevice::OpenMode mode)
+{
+	file.setFileName(fname);
+
+	return file.open(mode);
+}
+
+void FDCFileImage::close()
+{
+	file.close();
+}
+
+qint64 FDCFileImage::read(qint64 offset, quint8 *data, qint64 len)
+{
+	if (!file.seek(offset)) {
+		return -1;
+	}
+
+	return file.read((char *) data, len);
+}
+
+qint64 FDCFileImage::write(qint64 offset, const quint8 *data, qint64 len)
+{
+	if (!file.seek(offset)) {
+		return -1;
+	}
+
+	return file.write((const char *) data, len);
+}
+
+bool FDCFileImage::flush()
+{
+	return file.flush();
+}
+
+//
+// Memory mapped backend
+//
+FDCMappedImage::FDCMappedImage(int flushPolicy)
+{
+	mapping = nullptr;
+	mapSize = 0;
+	writable = false;
+	policy = flushPolicy;
+}
+
+FDCMappedImage::~FDCMappedImage()
+{
+	close();
+}
+
+bool FDCMappedImage::open(const QString &fname, QIODevice::OpenMode mode)
+{
+	close();
+
+	file.setFileName(fname);
+
+	if (!file.open(mode)) {
+		return false;
+	}
+
+	mapSize = file.size();
+
+	if (mapSize == 0 || (mapping = file.map(0, mapSize)) == nullptr) {
+		file.close();
+		mapSize = 0;
+		return false;
+	}
+
+	writable = mode.testFlag(QIODevice::WriteOnly);
+
+	return true;
+}
+
+void FDCMappedImage::close()
+{
+	if (mapping != nullptr) {
+		if (writable) {
+			sync(0, mapSize, true);
+		}
+
+		file.unmap(mapping);
+		mapping = nullptr;
+	}
+
+	if (file.isOpen()) {
+		file.close();
+	}
+
+	mapSize = 0;
+	writable = false;
+}
+
+qint64 FDCMappedImage::read(qint64 offset, quint8 *data, qint64 len)
+{
+	if (mapping == nullptr || offset < 0 || offset > mapSize) {
+		return -1;
+	}
+
+	len = qMin(len, mapSize - offset);
+
+	memcpy(data, mapping + offset, len);
+
+	return len;
+}
+
+qint64 FDCMappedImage::write(qint64 offset, const quint8 *data, qint64 len)
+{
+	if (mapping == nullptr || !writable || offset < 0 || offset > mapSize) {
+		return -1;
+	}
+
+	len = qMin(len, mapSize - offset);
+
+	memcpy(mapping + offset, data, len);
+
+	if (policy != FLUSH_UNMOUNT) {
+		sync(offset, len, policy == FLUSH_SYNC);
+	}
+
+	return len;
+}
+
+bool FDCMappedImage::flush()
+{
+	return (mapping != nullptr && writable) ? sync(0, mapSize, true) : true;
+}
+
+//
+// Write back the pages covering offset..offset+len
+//
+bool FDCMappedImage::sync(qint64 offset, qint64 len, bool wait)
+{
+#ifdef Q_OS_WIN
+	if (!FlushViewOfFile(mapping + offset, len)) {
+		return false;
+	}
+
+	if (wait) {
+		return FlushFileBuffers((HANDLE) _get_osfhandle(file.handle()));
+	}
+
+	return true;
+#else
+	static const qint64 pageSize = sysconf(_SC_PAGESIZE);
+	qint64 start = offset & ~(pageSize - 1);
+
+	return msync(mapping + start, len + (offset - start), (wait) ? MS_SYNC : MS_ASYNC) == 0;
+#endif
+}
+
+//
+// Copy-on-write overlay
+//
+FDCOverlayImage::FDCOverlayImage(FDCImage *baseImage, quint16 trackLen, const quint8 *baseData)
+{
+	base = baseImage;
+	resident = baseData;
+	baseSize = base->size();
+	sumLen = trackLen;
+	blockLen = (trackLen) ? trackLen : TRKBUF_SIZE;
+	deltaSize = baseSize;
+	savedSize = baseSize;
+}
+
+//
+// The base is opened by the owner, only the mode is checked here
+//
+bool FDCOverlayImage::open(const QString &fname, QIODevice::OpenMode mode)
+{
+	Q_UNUSED(fname);
+
+	return isOpen() && (mode & QIODevice::ReadOnly);
+}
+
+void FDCOverlayImage::close()
+{
+	QMutexLocker locker(&lock);
+
+	delta.clear();
+	saved.clear();
+	deltaSize = baseSize;
+	savedSize = baseSize;
+	base = nullptr;
+	resident = nullptr;
+}
+
+qint64 FDCOverlayImage::size() const
+{
+	QMutexLocker locker(&lock);
+
+	return deltaSize;
+}
+
+qint64 FDCOverlayImage::read(qint64 offset, quint8 *data, qint64 len)
+{
+	QMutexLocker locker(&lock);
+
+	if (base == nullptr || offset < 0 || offset > deltaSize) {
+		return -1;
+	}
+
+	len = qMin(len, deltaSize - offset);
+
+	for (qint64 pos = 0; pos < len; ) {
+		qint64 block = (offset + pos) / blockLen;
+		qint64 within = (offset + pos) % blockLen;
+		qint64 n = qMin(blockLen - within, len - pos);
+		QHash<qint64, QByteArray>::const_iterator it = delta.constFind(block);
+
+		if (it != delta.constEnd()) {
+			memcpy(data + pos, it.value().constData() + within, n);
+		}
+		else {
+			readBase(offset + pos, data + pos, n);
+		}
+
+		pos += n;
+	}
+
+	return len;
+}
+
+//
+// Written blocks are copied from the base on first write, or from the
+// snapshot when they are still shared with it
+//
+qint64 FDCOverlayImage::write(qint64 offset, const quint8 *data, qint64 len)
+{
+	QMutexLocker locker(&lock);
+
+	if (base == nullptr || offset < 0) {
+		return -1;
+	}
+
+	for (qint64 pos = 0; pos < len; ) {
+		qint64 block = (offset + pos) / blockLen;
+		qint64 within = (offset + pos) % blockLen;
+		qint64 n = qMin(blockLen - within, len - pos);
+		QHash<qint64, QByteArray>::iterator it = delta.find(block);
+
+		if (it == delta.end()) {
+			it = delta.insert(block, QByteArray(blockLen, 0));
+
+			if (within || n < blockLen) {
+				readBase(block * blockLen, (quint8 *) it.value().data(), blockLen);
+			}
+		}
+
+		memcpy(it.value().data() + within, data + pos, n);
+
+		pos += n;
+	}
+
+	deltaSize = qMax(deltaSize, offset + len);
+
+	return len;
+}
+
+void FDCOverlayImage::snapshot()
+{
+	QMutexLocker locker(&lock);
+
+	saved = delta;
+	savedSize = deltaSize;
+}
+
+void FDCOverlayImage::rollback()
+{
+	QMutexLocker locker(&lock);
+
+	delta = saved;
+	deltaSize = savedSize;
+}
+
+int FDCOverlayImage::deltaBlocks() const
+{
+	QMutexLocker locker(&lock);
+
+	return delta.size();
+}
+
+//
+// Base image bytes, zero past its end. Called with lock held.
+//
+void FDCOverlayImage::readBase(qint64 offset, quint8 *data, qint64 len)
+{
+	qint64 n = qBound((qint64) 0, baseSize - offset, len);
+
+	if (n > 0) {
+		if (resident != nullptr) {
+			memcpy(data, resident + offset, n);
+		}
+		else if ((n = base->read(offset, data, n)) < 0) {
+			n = 0;
+		}
+	}
+
+	memset(data + n, 0, len - n);
+}
@@ -0,0 +1,132 @@
+#ifndef FDCIMAGE_H
+#define FDCIMAGE_H
+
+#include <QFile>
+#include <QString>
+#include <QHash>
+#include <QByteArray>
+#include <QMutex>
+
+#define IMAGE_FILE		0			// QFile seek/read/write
+#define IMAGE_MAPPED		1			// QFile::map()
+#define IMAGE_COMPRESSED	2			// track compressed container
+
+#define FLUSH_UNMOUNT		0			// write back on unmount only
+#define FLUSH_ASYNC		1			// schedule write back after each track write
+#define FLUSH_SYNC		2			// wait for write back after each track write
+
+//
+// Disk image backend. Offsets and lengths are in bytes. read() and
+// write() return the number of bytes transferred, or -1 if the image
+// could not be positioned. Backends that hold the whole image in memory
+// also return a pointer to it from data().
+//
+class FDCImage
+{
+public:
+	virtual ~FDCImage() { }
+
+	virtual bool open(const QString &fname, QIODevice::OpenMode mode) = 0;
+	virtual void close(void) = 0;
+	virtual bool isOpen(void) const = 0;
+	virtual qint64 size(void) const = 0;
+	virtual qint64 read(qint64 offset, quint8 *data, qint64 len) = 0;
+	virtual qint64 write(qint64 offset, const quint8 *data, qint64 len) = 0;
+	virtual bool flush(void) { return true; }
+	virtual const quint8 *data(void) const { return nullptr; }
+
+	static FDCImage *create(int type, int flushPolicy = FLUSH_UNMOUNT);
+	static FDCImage *createFor(const QString &fname, int type, int flushPolicy = FLUSH_UNMOUNT);
+};
+
+class FDCFileImage : public FDCImage
+{
+public:
+	bool open(const QString &fname, QIODevice::OpenMode mode);
+	void close(void);
+	bool isOpen(void) const { return file.isOpen(); }
+	qint64 size(void) const { return file.size(); }
+	qint64 read(qint64 offset, quint8 *data, qint64 len);
+	qint64 write(qint64 offset, const quint8 *data, qint64 len);
+	bool flush(void);
+
+private:
+	QFile file;
+};
+
+//
+// Memory mapped image. READ is served straight out of the mapping and
+// WRIT copies into it. The mapping is the size of the image at mount
+// time, so the image cannot grow while mounted.
+//
+class FDCMappedImage : public FDCImage
+{
+public:
+	FDCMappedImage(int flushPolicy = FLUSH_UNMOUNT);
+	~FDCMappedImage();
+
+	bool open(const QString &fname, QIODevice::OpenMode mode);
+	void close(void);
+	bool isOpen(void) const { return mapping != nullptr; }
+	qint64 size(void) const { return mapSize; }
+	qint64 read(qint64 offset, quint8 *data, qint64 len);
+	qint64 write(qint64 offset, const quint8 *data, qint64 len);
+	bool flush(void);
+	const quint8 *data(void) const { return mapping; }
+
+private:
+	QFile file;
+	uchar *mapping;
+	qint64 mapSize;
+	bool writable;
+	int policy;
+
+	bool sync(qint64 offset, qint64 len, bool wait);
+};
+
+//
+// Copy-on-write overlay on a read-only base image. Writes go to an in
+// memory delta of whole blocks, normally tracks, and reads take each
+// block from the delta if it has been written and from the base
+// otherwise. The base is opened by the owner and left untouched, so one
+// base can sit under the overlays of several sessions. If the base is
+// resident, its memory is given as baseData and read without calling
+// the base image, which may be shared with other threads.
+//
+// snapshot() and rollback() save and restore the delta. The blocks are
+// implicitly shared, so both are instant and only blocks written after
+// a snapshot are copied. Rolling back without a snapshot returns to the
+// base image.
+//
+class FDCOverlayImage : public FDCImage
+{
+public:
+	FDCOverlayImage(FDCImage *baseImage, quint16 trackLen, const quint8 *baseData = nullptr);
+
+	bool open(const QString &fname, QIODevice::OpenMode mode);
+	void close(void);
+	bool isOpen(void) const { return base != nullptr && base->isOpen(); }
+	qint64 size(void) const;
+	qint64 read(qint64 offset, quint8 *data, qint64 len);
+	qint64 write(qint64 offset, const quint8 *data, qint64 len);
+
+	quint16 trackLen(void) const { return sumLen; }
+	void snapshot(void);
+	void rollback(void);
+	int deltaBlocks(void) const;
+
+private:
+	mutable QMutex lock;				// delta, against the write-behind thread
+	FDCImage *base;
+	const quint8 *resident;
+	qint64 baseSize;
+	quint16 sumLen;
+	int blockLen;
+	QHash<qint64, QByteArray> delta;		// block number to block data
+	qint64 deltaSize;				// image size including the delta
+	QHash<qint64, QByteArray> saved;		// delta at the last snapshot
+	qint64 savedSize;
+
+	void readBase(qint64 offset, quint8 *data, qint64 len);
+};
+#endif
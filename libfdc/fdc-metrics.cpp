@@ -0,0 +1,374 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Metrics Export
+*      Command counts, serial totals, cache, drive and latency figures of
+*      each session over HTTP, as Prometheus text or JSON.
+*
+***********************************************************************************/
+
+#include <QHostAddress>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+
+#include "fdc-metrics.h"
+
+static const char *commandName[STATUS_COMMANDS] = { "stat", "read", "writ" };	// indexed by FDC_CMD_*
+
+static QByteArray escape(const QString &value)
+{
+	QByteArray text = value.toUtf8();
+
+	text.replace('\\', "\\\\");
+	text.replace('"', "\\\"");
+	text.replace('\n', "\\n");
+
+	return text;
+}
+
+static void family(QByteArray &out, const char *name, const char *type, const char *help)
+{
+	out += QByteArray("# HELP ") + name + ' ' + help + '\n';
+	out += QByteArray("# TYPE ") + name + ' ' + type + '\n';
+}
+
+static void sample(QByteArray &out, const QByteArray &name, const QByteArray &labels, const QByteArray &value)
+{
+	out += name + '{' + labels + "} " + value + '\n';
+}
+
+//
+// Cumulative buckets in seconds. The last bucket also holds everything
+// beyond the histogram's range, so it is only reported as +Inf.
+//
+static void histogram(QByteArray &out, const QByteArray &name, const QByteArray &labels, const FDCLatencyHistogram *hist)
+{
+	quint64 seen = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		seen += hist->bucketCount(i);
+		sample(out, name + "_bucket", labels + ",le=\"" + QByteArray::number((FDCLatencyHistogram::upperBound(i) + 1) / 1e6, 'g', 9) + '"',
+			QByteArray::number(seen));
+	}
+
+	seen += hist->bucketCount(i);
+
+	sample(out, name + "_bucket", labels + ",le=\"+Inf\"", QByteArray::number(seen));
+	sample(out, name + "_sum", labels, QByteArray::number(hist->sum() / 1e6, 'g', 9));
+	sample(out, name + "_count", labels, QByteArray::number(seen));
+}
+
+static QJsonObject histogramJson(const FDCLatencyHistogram *hist)
+{
+	QJsonObject obj;
+
+	obj["count"] = (double) hist->count();
+	obj["sum"] = (double) hist->sum();
+	obj["p50"] = (double) hist->percentile(0.50);
+	obj["p95"] = (double) hist->percentile(0.95);
+	obj["p99"] = (double) hist->percentile(0.99);
+	obj["max"] = (double) hist->peak();
+
+	return obj;
+}
+
+FDCMetrics::FDCMetrics(QObject *parent)
+	: QObject(parent)
+{
+	server = new QTcpServer(this);
+	connect(server, &QTcpServer::newConnection, this, &FDCMetrics::newConnectionSlot);
+}
+
+//
+// Export a session's status block, labelled with its number and port.
+// Returns the session number.
+//
+int FDCMetrics::addSession(const QString &port, const FDCStatus *status)
+{
+	tmetricssession_t session;
+
+	session.port = port;
+	session.status = status;
+
+	sessions.append(session);
+
+	return sessions.size() - 1;
+}
+
+void FDCMetrics::setPort(int session, const QString &port)
+{
+	if (session >= 0 && session < sessions.size()) {
+		sessions[session].port = port;
+	}
+}
+
+//
+// Listen on [host:]port. Without a host the endpoint is reachable on
+// every interface, so a central Prometheus can scrape it.
+//
+bool FDCMetrics::listen(const QString &address, QString *error)
+{
+	int sep = address.lastIndexOf(':');
+	QString host = (sep < 0) ? QString() : address.left(sep);
+	QHostAddress bind;
+	bool ok;
+	int port = address.mid(sep + 1).toInt(&ok);
+
+	if (host.startsWith('[') && host.endsWith(']')) {
+		host = host.mid(1, host.size() - 2);
+	}
+
+	if (host.isEmpty() || host == "*") {
+		bind = QHostAddress::Any;
+	}
+	else if (host.compare("localhost", Qt::CaseInsensitive) == 0) {
+		bind = QHostAddress::LocalHost;
+	}
+	else {
+		bind = QHostAddress(host);
+	}
+
+	if (!ok || port < 1 || port > 65535 || bind.isNull()) {
+		if (error != nullptr) {
+			*error = QString("Invalid metrics address '%1', expected [host:]port").arg(address);
+		}
+		return false;
+	}
+
+	if (!server->listen(bind, port)) {
+		if (error != nullptr) {
+			*error = QString("Metrics on %1: %2").arg(address).arg(server->errorString());
+		}
+		return false;
+	}
+
+	return true;
+}
+
+void FDCMetrics::newConnectionSlot()
+{
+	QTcpSocket *socket;
+
+	while ((socket = server->nextPendingConnection()) != nullptr) {
+		connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+		connect(socket, &QTcpSocket::readyRead, this, [this, socket]() { readRequest(socket); });
+
+		QTimer::singleShot(METRICS_TIMEOUT, socket, &QTcpSocket::abort);
+	}
+}
+
+//
+// Wait for the whole request header, then answer from its first line
+//
+void FDCMetrics::readRequest(QTcpSocket *socket)
+{
+	QByteArray header;
+	int end;
+
+	if (socket->state() != QAbstractSocket::ConnectedState) {
+		return;
+	}
+
+	header = socket->peek(METRICS_REQUEST_MAX);
+
+	if ((end = header.indexOf("\r\n\r\n")) < 0 && (end = header.indexOf("\n\n")) < 0) {
+		if (header.size() >= METRICS_REQUEST_MAX) {
+			socket->abort();
+		}
+		return;
+	}
+
+	socket->readAll();
+
+	respond(socket, header.left(header.indexOf('\n')).trimmed());
+}
+
+void FDCMetrics::respond(QTcpSocket *socket, const QByteArray &request)
+{
+	QList<QByteArray> words = request.split(' ');
+	QByteArray path = (words.size() > 1) ? words.at(1) : QByteArray();
+	QByteArray code = "200 OK";
+	QByteArray type = "text/plain; charset=utf-8";
+	QByteArray body;
+
+	if (path.contains('?')) {
+		path = path.left(path.indexOf('?'));
+	}
+
+	if (words.at(0) != "GET") {
+		code = "405 Method Not Allowed";
+		body = "Only GET is supported\n";
+	}
+	else if (path == "/" || path == "/metrics") {
+		type = "text/plain; version=0.0.4; charset=utf-8";
+		body = prometheus();
+	}
+	else if (path == "/metrics.json") {
+		type = "application/json";
+		body = json();
+	}
+	else {
+		code = "404 Not Found";
+		body = "Try /metrics or /metrics.json\n";
+	}
+
+	socket->write("HTTP/1.0 " + code + "\r\n"
+		"Content-Type: " + type + "\r\n"
+		"Content-Length: " + QByteArray::number(body.size()) + "\r\n"
+		"Connection: close\r\n\r\n");
+	socket->write(body);
+	socket->disconnectFromHost();
+}
+
+QByteArray FDCMetrics::prometheus() const
+{
+	QByteArray out;
+	QList<QByteArray> labels;
+	int s;
+	int c;
+
+	for (s = 0; s < sessions.size(); s++) {
+		labels.append("session=\"" + QByteArray::number(s) + "\",port=\"" + escape(sessions.at(s).port) + '"');
+	}
+
+	family(out, "fdc_commands_total", "counter", "FDC+ commands answered.");
+	for (s = 0; s < sessions.size(); s++) {
+		for (c = 0; c < STATUS_COMMANDS; c++) {
+			sample(out, "fdc_commands_total", labels.at(s) + ",command=\"" + commandName[c] + '"',
+				QByteArray::number(sessions.at(s).status->cmd[c].count.loadAcquire()));
+		}
+	}
+
+	family(out, "fdc_errors_total", "counter", "Errors reported by the server.");
+	for (s = 0; s < sessions.size(); s++) {
+		sample(out, "fdc_errors_total", labels.at(s), QByteArray::number(sessions.at(s).status->errors.loadAcquire()));
+	}
+
+	family(out, "fdc_link_errors_total", "counter", "Bad checksums, partial and unknown commands.");
+	for (s = 0; s < sessions.size(); s++) {
+		sample(out, "fdc_link_errors_total", labels.at(s), QByteArray::number(sessions.at(s).status->linkErrors.loadAcquire()));
+	}
+
+	family(out, "fdc_link_score_percent", "gauge", "Track data not resent over the last scoring window.");
+	for (s = 0; s < sessions.size(); s++) {
+		sample(out, "fdc_link_score_percent", labels.at(s), QByteArray::number(sessions.at(s).status->linkScore.loadAcquire()));
+	}
+
+	family(out, "fdc_serial_bytes_total", "counter", "Bytes received from and sent to the FDC+.");
+	for (s = 0; s < sessions.size(); s++) {
+		sample(out, "fdc_serial_bytes_total", labels.at(s) + ",direction=\"rx\"", QByteArray::number(sessions.at(s).status->rxBytes.loadAcquire()));
+		sample(out, "fdc_serial_bytes_total", labels.at(s) + ",direction=\"tx\"", QByteArray::number(sessions.at(s).status->txBytes.loadAcquire()));
+	}
+
+	family(out, "fdc_cache_hits_total", "counter", "READs answered from the track cache.");
+	for (s = 0; s < sessions.size(); s++) {
+		sample(out, "fdc_cache_hits_total", labels.at(s), QByteArray::number(sessions.at(s).status->hits.loadAcquire()));
+	}
+
+	family(out, "fdc_cache_misses_total", "counter", "READs that went to the image.");
+	for (s = 0; s < sessions.size(); s++) {
+		sample(out, "fdc_cache_misses_total", labels.at(s), QByteArray::number(sessions.at(s).status->misses.loadAcquire()));
+	}
+
+	family(out, "fdc_cache_hit_ratio", "gauge", "Cache hits over all READs since start, NaN before the first.");
+	for (s = 0; s < sessions.size(); s++) {
+		quint64 hits = sessions.at(s).status->hits.loadAcquire();
+		quint64 lookups = hits + sessions.at(s).status->misses.loadAcquire();
+
+		sample(out, "fdc_cache_hit_ratio", labels.at(s), (lookups) ? QByteArray::number((double) hits / lookups, 'g', 6) : QByteArray("NaN"));
+	}
+
+	family(out, "fdc_dirty_tracks", "gauge", "Write-behind tracks not yet written to their images.");
+	for (s = 0; s < sessions.size(); s++) {
+		sample(out, "fdc_dirty_tracks", labels.at(s), QByteArray::number(sessions.at(s).status->dirty.loadAcquire()));
+	}
+
+	family(out, "fdc_drive_track", "gauge", "Current track of each mounted drive.");
+	for (s = 0; s < sessions.size(); s++) {
+		int mounted = sessions.at(s).status->mounted.loadAcquire();
+
+		for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+			if (mounted & (1 << driveNum)) {
+				sample(out, "fdc_drive_track", labels.at(s) + ",drive=\"" + QByteArray::number(driveNum) + '"',
+					QByteArray::number(sessions.at(s).status->curTrack[driveNum].loadAcquire()));
+			}
+		}
+	}
+
+	family(out, "fdc_latency_seconds", "histogram", "Last command byte in to response out.");
+	for (s = 0; s < sessions.size(); s++) {
+		for (c = 0; c < STATUS_COMMANDS; c++) {
+			histogram(out, "fdc_latency_seconds", labels.at(s) + ",command=\"" + commandName[c] + '"', &sessions.at(s).status->latency[c]);
+		}
+	}
+
+	family(out, "fdc_writ_turnaround_seconds", "histogram", "WRIT response out to first track data byte in.");
+	for (s = 0; s < sessions.size(); s++) {
+		histogram(out, "fdc_writ_turnaround_seconds", labels.at(s), &sessions.at(s).status->turnaround);
+	}
+
+	return out;
+}
+
+//
+// Same values as the Prometheus text, latencies in microseconds
+//
+QByteArray FDCMetrics::json() const
+{
+	QJsonArray list;
+
+	for (int s = 0; s < sessions.size(); s++) {
+		const FDCStatus *status = sessions.at(s).status;
+		QJsonObject session;
+		QJsonObject commands;
+		QJsonObject latency;
+		QJsonObject cache;
+		QJsonArray drives;
+		quint64 hits = status->hits.loadAcquire();
+		quint64 misses = status->misses.loadAcquire();
+		int mounted = status->mounted.loadAcquire();
+
+		for (int c = 0; c < STATUS_COMMANDS; c++) {
+			commands[commandName[c]] = (double) status->cmd[c].count.loadAcquire();
+			latency[commandName[c]] = histogramJson(&status->latency[c]);
+		}
+
+		cache["hits"] = (double) hits;
+		cache["misses"] = (double) misses;
+		cache["hitRate"] = (hits + misses) ? QJsonValue((double) hits / (hits + misses)) : QJsonValue();
+		cache["dirtyTracks"] = status->dirty.loadAcquire();
+
+		for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+			if (mounted & (1 << driveNum)) {
+				QJsonObject drive;
+
+				drive["drive"] = driveNum;
+				drive["track"] = status->curTrack[driveNum].loadAcquire();
+				drives.append(drive);
+			}
+		}
+
+		session["session"] = s;
+		session["port"] = sessions.at(s).port;
+		session["commands"] = commands;
+		session["errors"] = (double) status->errors.loadAcquire();
+		session["linkErrors"] = (double) status->linkErrors.loadAcquire();
+		session["linkScore"] = status->linkScore.loadAcquire();
+		session["rxBytes"] = (double) status->rxBytes.loadAcquire();
+		session["txBytes"] = (double) status->txBytes.loadAcquire();
+		session["cache"] = cache;
+		session["drives"] = drives;
+		session["latency"] = latency;
+		session["turnaround"] = histogramJson(&status->turnaround);
+
+		list.append(session);
+	}
+
+	QJsonObject root;
+
+	root["sessions"] = list;
+
+	return QJsonDocument(root).toJson(QJsonDocument::Compact);
+}
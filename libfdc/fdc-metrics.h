@@ -0,0 +1,49 @@
+#ifndef FDCMETRICS_H
+#define FDCMETRICS_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QList>
+
+#include "fdc-status.h"
+
+#define METRICS_REQUEST_MAX	4096			// longest request header accepted
+#define METRICS_TIMEOUT		5000			// drop clients that stall (ms)
+
+typedef struct TMETRICSSESSION {
+	QString port;
+	const FDCStatus *status;
+} tmetricssession_t;
+
+//
+// Read only HTTP endpoint for monitoring. GET /metrics answers in the
+// Prometheus text format, GET /metrics.json with the same values as
+// JSON. Requests are served on the thread that owns this object from
+// the status blocks of the sessions added, never touching the protocol
+// threads. One request per connection.
+//
+class FDCMetrics : public QObject
+{
+	Q_OBJECT
+
+public:
+	FDCMetrics(QObject *parent = nullptr);
+
+	int addSession(const QString &port, const FDCStatus *status);
+	void setPort(int session, const QString &port);
+	bool listen(const QString &address, QString *error = nullptr);
+
+private slots:
+	void newConnectionSlot();
+
+private:
+	QTcpServer *server;
+	QList<tmetricssession_t> sessions;
+
+	void readRequest(QTcpSocket *socket);
+	void respond(QTcpSocket *socket, const QByteArray &request);
+	QByteArray prometheus(void) const;
+	QByteArray json(void) const;
+};
+#endif
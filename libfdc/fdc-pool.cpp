@@ -0,0 +1,163 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Image Pool
+*      Shares read-only disk images between sessions and keeps read-write
+*      mounts exclusive.
+*
+***********************************************************************************/
+
+#include <QFileInfo>
+#include <QMutexLocker>
+
+#include "fdc-pool.h"
+#include "fdc-compressed.h"
+
+FDCImagePool::FDCImagePool()
+{
+}
+
+FDCImagePool::~FDCImagePool()
+{
+	for (tpoolimage_t *entry : shared) {
+		entry->cache->detach();
+		entry->image->close();
+		delete entry->cache;
+		delete entry->image;
+		delete entry;
+	}
+}
+
+//
+// Pool key of an image file, the same for every path naming it
+//
+QString FDCImagePool::key(const QString &fname)
+{
+	QString path = QFileInfo(fname).canonicalFilePath();
+
+	return (path.isEmpty()) ? QFileInfo(fname).absoluteFilePath() : path;
+}
+
+//
+// Register a mount of path. A write claim needs the image to be unused,
+// a read claim that nobody has it mounted read-write.
+//
+bool FDCImagePool::claim(const QString &path, bool write)
+{
+	QMutexLocker locker(&lock);
+	tpoolclaim_t &c = claims[path];
+
+	if (c.writer || (write && c.readers)) {
+		if (!c.writer && !c.readers) {
+			claims.remove(path);
+		}
+		return false;
+	}
+
+	if (write) {
+		c.writer = true;
+	}
+	else {
+		c.readers++;
+	}
+
+	return true;
+}
+
+void FDCImagePool::unclaim(const QString &path, bool write)
+{
+	QMutexLocker locker(&lock);
+	QHash<QString, tpoolclaim_t>::iterator it = claims.find(path);
+
+	if (it == claims.end()) {
+		return;
+	}
+
+	if (write) {
+		it->writer = false;
+	}
+	else if (it->readers) {
+		it->readers--;
+	}
+
+	if (!it->writer && !it->readers) {
+		claims.erase(it);
+	}
+}
+
+//
+// Shared read-only image for path, opened on first use. The image is
+// mapped, or preloaded if it cannot be mapped. Returns nullptr if
+// neither works, in which case the caller opens a private copy.
+//
+tpoolimage_t *FDCImagePool::acquire(const QString &path)
+{
+	QMutexLocker locker(&lock);
+	tpoolimage_t *entry = shared.value(path);
+
+	if (entry != nullptr) {
+		entry->refs++;
+		return entry;
+	}
+
+	static const int types[] = { IMAGE_MAPPED, IMAGE_FILE };
+	bool compressed = FDCCompressedImage::probe(path);
+
+	for (int type : types) {
+		FDCImage *image = FDCImage::create((compressed) ? IMAGE_COMPRESSED : type);
+
+		if (image->open(path, QIODevice::ReadOnly)) {
+			FDCTrackCache *cache = new FDCTrackCache;
+			FDCGeometry geometry;
+
+			if (!geometry.probe(path, image->size())) {
+				delete cache;
+				delete image;
+				return nullptr;
+			}
+
+			cache->attach(image, true, geometry);
+
+			if (cache->isResident()) {
+				entry = new tpoolimage_t;
+				entry->path = path;
+				entry->image = image;
+				entry->cache = cache;
+				entry->geometry = geometry;
+				entry->refs = 1;
+
+				shared.insert(path, entry);
+
+				return entry;
+			}
+
+			cache->detach();
+			delete cache;
+		}
+
+		delete image;
+
+		// A container has only the one backend
+		if (compressed) {
+			break;
+		}
+	}
+
+	return nullptr;
+}
+
+void FDCImagePool::release(tpoolimage_t *entry)
+{
+	QMutexLocker locker(&lock);
+
+	if (--entry->refs) {
+		return;
+	}
+
+	shared.remove(entry->path);
+
+	entry->cache->detach();
+	entry->image->close();
+	delete entry->cache;
+	delete entry->image;
+	delete entry;
+}
@@ -0,0 +1,51 @@
+#ifndef FDCPOOL_H
+#define FDCPOOL_H
+
+#include <QHash>
+#include <QMutex>
+#include <QString>
+
+#include "fdc-image.h"
+#include "fdc-cache.h"
+#include "fdc-geometry.h"
+
+typedef struct TPOOLIMAGE {
+	QString path;					// canonical path, the pool key
+	FDCImage *image;
+	FDCTrackCache *cache;
+	FDCGeometry geometry;
+	int refs;
+} tpoolimage_t;
+
+typedef struct TPOOLCLAIM {
+	int readers;
+	bool writer;
+} tpoolclaim_t;
+
+//
+// Disk images shared by the sessions of one server. An image mounted
+// read-only by several sessions is opened and cached once; it is served
+// from a mapping or a preloaded copy, so track data handed out by the
+// shared cache stays valid while other sessions read it. A read-write
+// mount is private to its session and excludes every other mount of
+// the same image. All methods may be called from any session thread.
+//
+class FDCImagePool
+{
+public:
+	FDCImagePool();
+	~FDCImagePool();
+
+	static QString key(const QString &fname);
+
+	bool claim(const QString &path, bool write);
+	void unclaim(const QString &path, bool write);
+	tpoolimage_t *acquire(const QString &path);
+	void release(tpoolimage_t *entry);
+
+private:
+	QMutex lock;
+	QHash<QString, tpoolclaim_t> claims;
+	QHash<QString, tpoolimage_t *> shared;
+};
+#endif
@@ -0,0 +1,105 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Track Read Ahead
+*      Loads the tracks the FDC+ is likely to read next into the track
+*      cache, so large images leave file reads off the READ path.
+*
+***********************************************************************************/
+
+#include <QMutexLocker>
+
+#include "fdc-prefetch.h"
+
+FDCPrefetcher::FDCPrefetcher(FDCTrackCache **caches, int count, QObject *parent)
+	: QObject(parent)
+{
+	cache = caches;
+	cacheCount = qMin(count, MAX_DRIVE);
+	scheduled = false;
+
+	for (int drive = 0; drive < MAX_DRIVE; drive++) {
+		pending[drive].track = 0;
+		pending[drive].trackLen = 0;
+		pending[drive].count = 0;
+	}
+}
+
+//
+// Replace the drive's pending request. Called from the worker thread.
+//
+void FDCPrefetcher::request(int drive, quint16 track, quint16 trackLen, int count)
+{
+	QMutexLocker locker(&lock);
+
+	if (drive < 0 || drive >= cacheCount) {
+		return;
+	}
+
+	pending[drive].track = track;
+	pending[drive].trackLen = trackLen;
+	pending[drive].count = count;
+
+	if (!scheduled) {
+		scheduled = true;
+		QMetaObject::invokeMethod(this, "run", Qt::QueuedConnection);
+	}
+}
+
+void FDCPrefetcher::cancel()
+{
+	QMutexLocker locker(&lock);
+
+	for (int drive = 0; drive < cacheCount; drive++) {
+		pending[drive].count = 0;
+	}
+}
+
+//
+// Load pending tracks one at a time, dropping a drive's request as soon
+// as a newer one replaces it
+//
+void FDCPrefetcher::run()
+{
+	tprefetch_t next;
+	bool busy = true;
+
+	while (busy) {
+		busy = false;
+
+		for (int drive = 0; drive < cacheCount; drive++) {
+			lock.lock();
+
+			next = pending[drive];
+
+			if (next.count > 0) {
+				pending[drive].track++;
+				pending[drive].count--;
+			}
+
+			lock.unlock();
+
+			if (next.count <= 0) {
+				continue;
+			}
+
+			if (cache[drive]->prefetchTrack(next.track, next.trackLen)) {
+				loads.fetchAndAddRelaxed(1);
+			}
+
+			busy = true;
+		}
+	}
+
+	QMutexLocker locker(&lock);
+
+	scheduled = false;
+
+	// A request may have come in after the last pass
+	for (int drive = 0; drive < cacheCount; drive++) {
+		if (pending[drive].count > 0) {
+			scheduled = true;
+			QMetaObject::invokeMethod(this, "run", Qt::QueuedConnection);
+			break;
+		}
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef FDCPREFETCH_H
+#define FDCPREFETCH_H
+
+#include <QObject>
+#include <QMutex>
+#include <QAtomicInteger>
+
+#include "fdc-cache.h"
+
+#define PREFETCH_TRACKS		4			// tracks read ahead of a sequential READ
+
+typedef struct TPREFETCH {
+	quint16 track;					// first track to load
+	quint16 trackLen;
+	int count;					// tracks from track on, 0 if idle
+} tprefetch_t;
+
+//
+// Background track read ahead. The worker calls request() after a READ
+// miss, or a READ served from a prefetched track, with the tracks that
+// should follow, and after a STAT with the track the head is on. Only
+// the latest request per drive is kept, so a sweep that moves on
+// abandons tracks it no longer needs.
+//
+class FDCPrefetcher : public QObject
+{
+	Q_OBJECT
+
+public:
+	FDCPrefetcher(FDCTrackCache **caches, int count, QObject *parent = nullptr);
+
+	void request(int drive, quint16 track, quint16 trackLen, int count);
+	void cancel(void);
+	quint32 loadCount(void) const { return loads.loadAcquire(); }
+
+public slots:
+	void run(void);
+
+private:
+	FDCTrackCache **cache;
+	int cacheCount;
+	QMutex lock;					// pending and scheduled
+	tprefetch_t pending[MAX_DRIVE];
+	bool scheduled;
+	QAtomicInteger<quint32> loads;			// tracks loaded ahead of READ
+};
+#endif
@@ -0,0 +1,101 @@
+#ifndef FDCPROTOCOL_H
+#define FDCPROTOCOL_H
+
+#include <QtGlobal>
+#include <QtEndian>
+
+#include "fdc-checksum.h"
+
+#define MAX_DRIVE		16			// STAT bitmap and READ/WRIT drive nibble allow 16
+#define CMD_LEN			8                       // does not include checksum bytes
+#define CRC_LEN			2			// length of CRC
+#define CMDBUF_SIZE		CMD_LEN+CRC_LEN
+#define TRKBUF_SIZE		137*32                  // maximum valid track length
+
+#define STAT_OK			0x0000			// OK
+#define STAT_NOT_READY		0x0001			// Not Ready
+#define STAT_CHECKSUM_ERR	0x0002			// Checksum Error
+#define STAT_WRITE_ERR		0x0003			// Write Error
+
+//
+// Command names as 32 bit opcodes, first character in the low byte
+//
+#define FDC_OPCODE(a, b, c, d)	((quint32) (a) | ((quint32) (b) << 8) | ((quint32) (c) << 16) | ((quint32) (d) << 24))
+
+#define OP_READ			FDC_OPCODE('R', 'E', 'A', 'D')
+#define OP_WRIT			FDC_OPCODE('W', 'R', 'I', 'T')
+#define OP_STAT			FDC_OPCODE('S', 'T', 'A', 'T')
+#define OP_WSTA			FDC_OPCODE('W', 'S', 'T', 'A')
+
+typedef struct TCOMMAND {
+	union {
+		quint8 asBytes[CMDBUF_SIZE];
+		struct {
+			char command[4];
+			union {
+				quint16 param1;
+				quint16 rcode;
+			};
+			union {
+				quint16 param2;
+				quint16 rdata;
+			};
+			quint16 checksum;
+		};
+	};
+} tcommand_t;
+
+static inline quint32 cmdOpcode(const tcommand_t *cmd)
+{
+	return qFromLittleEndian<quint32>(cmd->asBytes);
+}
+
+static inline void setOpcode(tcommand_t *cmd, quint32 opcode)
+{
+	qToLittleEndian<quint32>(opcode, cmd->asBytes);
+}
+
+//
+// 16 bit sum of all bytes, used for commands, responses and track data.
+// Tracks go to the SIMD kernel, commands are summed inline.
+//
+static inline quint16 calcChecksum(const quint8 *data, int length)
+{
+	int i;
+	quint16 checksum;
+
+	if (length >= CHECKSUM_SIMD_MIN) {
+		return trackChecksum(data, length);
+	}
+
+	checksum = 0;
+
+	for (i = 0; i < length; i++) {
+		checksum += data[i];
+	}
+
+	return checksum;
+}
+
+//
+// Copy length bytes from src to dst and return their calcChecksum()
+//
+static inline quint16 copyChecksum(quint8 *dst, const quint8 *src, int length)
+{
+	int i;
+	quint16 checksum;
+
+	if (length >= CHECKSUM_SIMD_MIN) {
+		return trackCopyChecksum(dst, src, length);
+	}
+
+	checksum = 0;
+
+	for (i = 0; i < length; i++) {
+		checksum += dst[i] = src[i];
+	}
+
+	return checksum;
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef FDCRINGBUFFER_H
+#define FDCRINGBUFFER_H
+
+#include <QIODevice>
+#include <string.h>
+
+#include "fdc-protocol.h"
+
+#define RINGBUF_SIZE		16384			// must be a power of 2
+
+//
+// Fixed size receive ring buffer. Bytes are appended straight from the
+// device on each readyRead and consumed by the framing state machine
+// as whole frames become available. Single threaded.
+//
+class FDCRingBuffer
+{
+public:
+	FDCRingBuffer() : head(0), tail(0) { }
+
+	int size(void) const { return head - tail; }
+	int space(void) const { return RINGBUF_SIZE - size(); }
+	void clear(void) { head = tail = 0; }
+
+	//
+	// Append as many bytes as are available from the device and fit
+	// in the buffer. Returns the number of bytes read, or -1 on error.
+	//
+	qint64 fill(QIODevice *device)
+	{
+		qint64 total = 0;
+
+		while (space()) {
+			int pos = head & (RINGBUF_SIZE - 1);
+			int len = qMin(space(), RINGBUF_SIZE - pos);
+			qint64 n = device->read((char *) buf + pos, len);
+
+			if (n < 0) {
+				return (total) ? total : -1;
+			}
+			if (n == 0) {
+				break;
+			}
+
+			head += n;
+			total += n;
+		}
+
+		return total;
+	}
+
+	//
+	// Append up to len bytes from data, as many as fit. Returns the
+	// number of bytes copied.
+	//
+	int write(const quint8 *data, int len)
+	{
+		int count = qMin(len, space());
+		int pos = head & (RINGBUF_SIZE - 1);
+		int first = qMin(count, RINGBUF_SIZE - pos);
+
+		memcpy(buf + pos, data, first);
+		memcpy(buf, data + first, count - first);
+
+		head += count;
+
+		return count;
+	}
+
+	//
+	// Remove up to len bytes into data. Returns the number of bytes copied.
+	//
+	int read(quint8 *data, int len)
+	{
+		int count = qMin(len, size());
+		int pos = tail & (RINGBUF_SIZE - 1);
+		int first = qMin(count, RINGBUF_SIZE - pos);
+
+		memcpy(data, buf + pos, first);
+		memcpy(data + first, buf, count - first);
+
+		tail += count;
+
+		return count;
+	}
+
+	//
+	// read() that also adds the checksum of the bytes copied to *sum
+	//
+	int readChecksum(quint8 *data, int len, quint16 *sum)
+	{
+		int count = qMin(len, size());
+		int pos = tail & (RINGBUF_SIZE - 1);
+		int first = qMin(count, RINGBUF_SIZE - pos);
+
+		*sum += copyChecksum(data, buf + pos, first);
+		*sum += copyChecksum(data + first, buf, count - first);
+
+		tail += count;
+
+		return count;
+	}
+
+private:
+	quint8 buf[RINGBUF_SIZE];
+	quint32 head;
+	quint32 tail;
+};
+#endif
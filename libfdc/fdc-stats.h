@@ -0,0 +1,111 @@
+#ifndef FDCSTATS_H
+#define FDCSTATS_H
+
+#include <QAtomicInteger>
+#include <QtAlgorithms>
+
+#define LATENCY_SUBBUCKETS	4			// buckets per power of two
+#define LATENCY_BUCKETS		96			// 0us to about 16s
+
+//
+// Response latency histogram in microseconds. Below 4us every value
+// has its own bucket, above that each power of two is split into four,
+// so percentiles are good to about 25%. The worker records and the
+// dialog reads concurrently; each bucket is atomic on its own.
+//
+class FDCLatencyHistogram
+{
+public:
+	void record(qint64 nsecs)
+	{
+		quint32 usecs = (nsecs > 0) ? qMin<qint64>(nsecs / 1000, 0xffffffff) : 0;
+		quint32 highest = maximum.loadAcquire();
+
+		bucket[bucketOf(usecs)].fetchAndAddRelaxed(1);
+		samples.fetchAndAddRelaxed(1);
+		total.fetchAndAddRelaxed(usecs);
+
+		while (usecs > highest && !maximum.testAndSetRelease(highest, usecs)) {
+			highest = maximum.loadAcquire();
+		}
+	}
+
+	void reset(void)
+	{
+		for (int i = 0; i < LATENCY_BUCKETS; i++) {
+			bucket[i].storeRelease(0);
+		}
+
+		samples.storeRelease(0);
+		total.storeRelease(0);
+		maximum.storeRelease(0);
+	}
+
+	quint64 count(void) const { return samples.loadAcquire(); }
+	quint64 sum(void) const { return total.loadAcquire(); }
+	quint32 peak(void) const { return maximum.loadAcquire(); }
+
+	// Samples in one bucket, for exporting the whole distribution
+	quint64 bucketCount(int index) const { return bucket[index].loadAcquire(); }
+
+	// Upper bound in microseconds of the bucket holding the given fraction of samples
+	quint32 percentile(double fraction) const
+	{
+		quint64 inBuckets = 0;
+		quint64 seen = 0;
+		quint64 target;
+		int i;
+
+		for (i = 0; i < LATENCY_BUCKETS; i++) {
+			inBuckets += bucket[i].loadAcquire();
+		}
+
+		if (!inBuckets) {
+			return 0;
+		}
+
+		target = qMax<quint64>(1, inBuckets * fraction + 0.5);
+
+		for (i = 0; i < LATENCY_BUCKETS; i++) {
+			seen += bucket[i].loadAcquire();
+
+			if (seen >= target) {
+				return qMin(upperBound(i), peak());
+			}
+		}
+
+		return peak();
+	}
+
+	// Largest value in microseconds that falls in a bucket
+	static quint32 upperBound(int index)
+	{
+		if (index < LATENCY_SUBBUCKETS) {
+			return index;
+		}
+
+		int msb = index / LATENCY_SUBBUCKETS + 1;
+		int sub = index % LATENCY_SUBBUCKETS;
+
+		return ((quint64) (LATENCY_SUBBUCKETS + sub + 1) << (msb - 2)) - 1;
+	}
+
+private:
+	QAtomicInteger<quint64> bucket[LATENCY_BUCKETS];
+	QAtomicInteger<quint64> samples;
+	QAtomicInteger<quint64> total;			// microseconds
+	QAtomicInteger<quint32> maximum;
+
+	static int bucketOf(quint32 usecs)
+	{
+		if (usecs < LATENCY_SUBBUCKETS) {
+			return usecs;
+		}
+
+		int msb = 31 - qCountLeadingZeroBits(usecs);
+		int sub = (usecs >> (msb - 2)) & (LATENCY_SUBBUCKETS - 1);
+
+		return qMin((msb - 1) * LATENCY_SUBBUCKETS + sub, LATENCY_BUCKETS - 1);
+	}
+};
+#endif
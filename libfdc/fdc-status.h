@@ -0,0 +1,106 @@
+#ifndef FDCSTATUS_H
+#define FDCSTATUS_H
+
+#include <QAtomicInteger>
+
+#include "fdc-protocol.h"
+#include "fdc-stats.h"
+
+#define STATUS_COMMANDS		3			// STAT, READ, WRIT
+
+#define STATUS_STAT		0x0001			// changed flags
+#define STATUS_READ		0x0002
+#define STATUS_WRIT		0x0004
+#define STATUS_DRIVE		0x0008
+#define STATUS_CACHE		0x0010
+#define STATUS_DIRTY		0x0020
+
+typedef struct TCMDSTATUS {
+	QAtomicInteger<quint64> count;
+	QAtomicInt driveNum;
+	QAtomicInt param1;
+	QAtomicInt param2;
+} tcmdstatus_t;
+
+//
+// Display state shared between the protocol worker and the dialog. The
+// worker only stores values and sets changed flags; the dialog picks up
+// whatever changed on its display tick. Fields are independent, so a
+// refresh may mix values from two consecutive commands, which is fine
+// for display.
+//
+class FDCStatus
+{
+public:
+	FDCStatus()
+	{
+		selected.storeRelease(0xff);
+		headLoaded.storeRelease(0);
+		mounted.storeRelease(0);
+		linkScore.storeRelease(100);
+
+		for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+			curTrack[driveNum].storeRelease(0);
+		}
+	}
+
+	void command(int command, quint64 count, quint16 driveNum, quint16 param1, quint16 param2)
+	{
+		cmd[command].count.storeRelease(count);
+		cmd[command].driveNum.storeRelease(driveNum);
+		cmd[command].param1.storeRelease(param1);
+		cmd[command].param2.storeRelease(param2);
+
+		changed.fetchAndOrRelease(STATUS_STAT << command);
+	}
+
+	void drive(quint16 driveNum, bool head, quint16 track)
+	{
+		selected.storeRelease(driveNum);
+		headLoaded.storeRelease(head);
+
+		if (driveNum < MAX_DRIVE) {
+			curTrack[driveNum].storeRelease(track);
+		}
+
+		changed.fetchAndOrRelease(STATUS_DRIVE);
+	}
+
+	void cache(quint64 hitCount, quint64 missCount)
+	{
+		hits.storeRelease(hitCount);
+		misses.storeRelease(missCount);
+
+		changed.fetchAndOrRelease(STATUS_CACHE);
+	}
+
+	void dirtyTracks(int count)
+	{
+		dirty.storeRelease(count);
+
+		changed.fetchAndOrRelease(STATUS_DIRTY);
+	}
+
+	// Changed flags since the last call
+	int takeChanged(void) { return changed.fetchAndStoreAcquire(0); }
+
+	tcmdstatus_t cmd[STATUS_COMMANDS];		// indexed by FDC_CMD_*
+	QAtomicInt selected;				// selected drive, 0xff if none
+	QAtomicInt headLoaded;
+	QAtomicInt mounted;				// drive bitmap, as in STAT
+	QAtomicInt curTrack[MAX_DRIVE];
+	QAtomicInteger<quint64> hits;			// session READ totals, never reset
+	QAtomicInteger<quint64> misses;
+	QAtomicInt dirty;
+	QAtomicInteger<quint64> rxBytes;		// serial byte totals
+	QAtomicInteger<quint64> txBytes;
+	FDCLatencyHistogram latency[STATUS_COMMANDS];	// indexed by FDC_CMD_*
+	FDCLatencyHistogram turnaround;			// WRIT response to first track data byte
+	QAtomicInteger<quint64> linkErrors;		// bad checksum, partial and unknown commands
+	QAtomicInt linkScore;				// percent of track data not resent, last window
+	QAtomicInteger<quint64> errors;			// error messages reported
+
+private:
+	QAtomicInt changed;
+};
+#endif
@@ -0,0 +1,154 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Transaction Trace
+*      Binary capture of every READ, WRIT and STAT transaction, written off
+*      the protocol thread, and a reader to replay captures.
+*
+***********************************************************************************/
+
+#include <QtEndian>
+#include <string.h>
+
+#include "fdc-trace.h"
+
+static void swapRecord(ttracerecord_t *rec)
+{
+	rec->time = qToLittleEndian(rec->time);
+	rec->opcode = qToLittleEndian(rec->opcode);
+	rec->latency = qToLittleEndian(rec->latency);
+	rec->seq = qToLittleEndian(rec->seq);
+	rec->param1 = qToLittleEndian(rec->param1);
+	rec->param2 = qToLittleEndian(rec->param2);
+	rec->rcode = qToLittleEndian(rec->rcode);
+	rec->rdata = qToLittleEndian(rec->rdata);
+	rec->length = qToLittleEndian(rec->length);
+	rec->flags = qToLittleEndian(rec->flags);
+}
+
+static void swapHeader(ttraceheader_t *hdr)
+{
+	hdr->version = qToLittleEndian(hdr->version);
+	hdr->recordSize = qToLittleEndian(hdr->recordSize);
+	hdr->records = qToLittleEndian(hdr->records);
+	hdr->dropped = qToLittleEndian(hdr->dropped);
+}
+
+FDCTraceWriter::FDCTraceWriter(FDCTraceRing *traceRing, QObject *parent)
+	: QObject(parent)
+{
+	ring = traceRing;
+
+	timer = new QTimer(this);
+	connect(timer, &QTimer::timeout, this, &FDCTraceWriter::drain);
+}
+
+bool FDCTraceWriter::open(const QString &fname)
+{
+	close();
+
+	file.setFileName(fname);
+
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		emit traceError(QString("Could not create trace file '%1'").arg(fname));
+		return false;
+	}
+
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.recordSize = sizeof(ttracerecord_t);
+	header.records = 0;
+	header.dropped = 0;
+
+	ttraceheader_t hdr = header;
+
+	swapHeader(&hdr);
+	file.write((const char *) &hdr, sizeof(hdr));
+
+	ring->takeDropped();
+	timer->start(TRACE_DRAIN);
+
+	return true;
+}
+
+void FDCTraceWriter::close()
+{
+	if (!file.isOpen()) {
+		return;
+	}
+
+	timer->stop();
+	drain();
+
+	ttraceheader_t hdr = header;
+
+	swapHeader(&hdr);
+	file.seek(0);
+	file.write((const char *) &hdr, sizeof(hdr));
+	file.close();
+}
+
+void FDCTraceWriter::drain()
+{
+	int count;
+
+	if (!file.isOpen()) {
+		return;
+	}
+
+	header.dropped += ring->takeDropped();
+
+	while ((count = ring->pop(buf, TRACE_RING)) > 0) {
+		for (int i = 0; i < count; i++) {
+			swapRecord(&buf[i]);
+		}
+
+		qint64 len = (qint64) count * sizeof(ttracerecord_t);
+
+		if (file.write((const char *) buf, len) != len) {
+			emit traceError(QString("Trace file '%1' write failed").arg(file.fileName()));
+			timer->stop();
+			file.close();
+			return;
+		}
+
+		header.records += count;
+	}
+}
+
+bool FDCTraceReader::open(const QString &fname)
+{
+	file.setFileName(fname);
+
+	if (!file.open(QIODevice::ReadOnly)) {
+		error = QString("Could not open trace file '%1'").arg(fname);
+		return false;
+	}
+
+	if (file.read((char *) &header, sizeof(header)) != sizeof(header) || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))) {
+		error = QString("'%1' is not a trace file").arg(fname);
+		file.close();
+		return false;
+	}
+
+	swapHeader(&header);
+
+	if (header.version != TRACE_VERSION || header.recordSize != sizeof(ttracerecord_t)) {
+		error = QString("'%1' is trace version %2, expected %3").arg(fname).arg(header.version).arg(TRACE_VERSION);
+		file.close();
+		return false;
+	}
+
+	return true;
+}
+
+bool FDCTraceReader::next(ttracerecord_t *rec)
+{
+	if (file.read((char *) rec, sizeof(*rec)) != sizeof(*rec)) {
+		return false;
+	}
+
+	// Converting from little endian is the same swap
+	swapRecord(rec);
+
+	return true;
+}
@@ -0,0 +1,133 @@
+#ifndef FDCTRACE_H
+#define FDCTRACE_H
+
+#include <QObject>
+#include <QFile>
+#include <QTimer>
+#include <QAtomicInteger>
+
+#define TRACE_MAGIC		"FDCTRACE"		// file header, then records
+#define TRACE_VERSION		1
+#define TRACE_RING		4096			// records, must be a power of 2
+#define TRACE_DRAIN		50			// ring drain interval (ms)
+
+#define TRACE_MISS		0x0001			// READ went to the image
+#define TRACE_NO_RESPONSE	0x0002			// command was ignored
+#define TRACE_TIMEOUT		0x0004			// WRIT data did not all arrive
+
+//
+// One transaction. Stored little endian, 32 bytes.
+//
+typedef struct TTRACERECORD {
+	quint64 time;					// ns from start of capture to command arrival
+	quint32 opcode;					// OP_READ, OP_WRIT, OP_STAT
+	quint32 latency;				// ns from last input byte to response
+	quint32 seq;					// transaction number, gaps are dropped records
+	quint16 param1;
+	quint16 param2;
+	quint16 rcode;					// STAT_* of the final response
+	quint16 rdata;					// STAT drive bitmap
+	quint16 length;					// track bytes sent or received
+	quint16 flags;					// TRACE_*
+} ttracerecord_t;
+
+typedef struct TTRACEHEADER {
+	char magic[8];
+	quint32 version;
+	quint32 recordSize;
+	quint32 records;
+	quint32 dropped;				// records lost to a full ring
+} ttraceheader_t;
+
+//
+// Lock free ring between the protocol worker, which pushes a record per
+// transaction, and the trace writer, which drains it. One producer and
+// one consumer. A full ring drops and counts the record rather than
+// stall the protocol.
+//
+class FDCTraceRing
+{
+public:
+	FDCTraceRing() : head(0), tail(0), dropped(0) { }
+
+	void push(const ttracerecord_t &rec)
+	{
+		quint32 h = head.loadAcquire();
+
+		if (h - tail.loadAcquire() == TRACE_RING) {
+			dropped.fetchAndAddRelaxed(1);
+			return;
+		}
+
+		record[h & (TRACE_RING - 1)] = rec;
+		head.storeRelease(h + 1);
+	}
+
+	int pop(ttracerecord_t *rec, int max)
+	{
+		quint32 t = tail.loadAcquire();
+		int count = qMin((quint32) max, head.loadAcquire() - t);
+
+		for (int i = 0; i < count; i++) {
+			rec[i] = record[(t + i) & (TRACE_RING - 1)];
+		}
+
+		tail.storeRelease(t + count);
+
+		return count;
+	}
+
+	quint32 takeDropped(void) { return dropped.fetchAndStoreRelaxed(0); }
+
+private:
+	ttracerecord_t record[TRACE_RING];
+	QAtomicInteger<quint32> head;
+	QAtomicInteger<quint32> tail;
+	QAtomicInteger<quint32> dropped;
+};
+
+//
+// Writes the ring to a trace file from its own thread. The header is
+// rewritten with the record and drop counts when the file is closed.
+//
+class FDCTraceWriter : public QObject
+{
+	Q_OBJECT
+
+public:
+	FDCTraceWriter(FDCTraceRing *traceRing, QObject *parent = nullptr);
+
+public slots:
+	bool open(const QString &fname);
+	void close(void);
+	void drain(void);
+
+signals:
+	void traceError(const QString &text);
+
+private:
+	FDCTraceRing *ring;
+	QFile file;
+	QTimer *timer;
+	ttraceheader_t header;
+	ttracerecord_t buf[TRACE_RING];
+};
+
+//
+// Sequential reader for replay and offline analysis
+//
+class FDCTraceReader
+{
+public:
+	bool open(const QString &fname);
+	bool next(ttracerecord_t *rec);
+	quint32 records(void) const { return header.records; }
+	quint32 dropped(void) const { return header.dropped; }
+	QString errorString(void) const { return error; }
+
+private:
+	QFile file;
+	ttraceheader_t header;
+	QString error;
+};
+#endif
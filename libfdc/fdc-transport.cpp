@@ -0,0 +1,334 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Transports
+*      Serial port and TCP links to the FDC+.
+*
+***********************************************************************************/
+
+#include <QUrl>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+#include <string.h>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#endif
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+#include "fdc-transport.h"
+
+FDCTransport *FDCTransport::create(const QString &name)
+{
+	if (name.startsWith(TCP_SCHEME, Qt::CaseInsensitive)) {
+		return new FDCTcpTransport;
+	}
+
+	if (name == NULL_PORT) {
+		return new FDCNullTransport;
+	}
+
+	return new FDCSerialTransport;
+}
+
+//
+// Send one frame. Segments go to the driver directly when the device has
+// nothing queued, so track data is sent straight from the cache or
+// mapping. Whatever the driver does not take is queued on the device
+// behind it. Returns the frame length or -1 on error.
+//
+qint64 FDCTransport::write(const tioseg_t *seg, int count)
+{
+	QIODevice *dev = device();
+	qint64 sent = 0;
+	qint64 total = 0;
+	qint64 skip;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		total += seg[i].len;
+	}
+
+	if (!dev->bytesToWrite()) {
+		sent = writeDirect(seg, count);
+	}
+
+	if (sent == total) {
+		return total;
+	}
+
+	// Queue the unsent remainder of each segment, gathered if asked to
+	if (batchFrames()) {
+		QByteArray frame;
+
+		frame.reserve(total - sent);
+
+		for (i = 0, skip = sent; i < count; i++) {
+			if (skip >= seg[i].len) {
+				skip -= seg[i].len;
+				continue;
+			}
+
+			frame.append((const char *) seg[i].data + skip, seg[i].len - skip);
+			skip = 0;
+		}
+
+		return (dev->write(frame) < 0) ? -1 : total;
+	}
+
+	for (i = 0, skip = sent; i < count; i++) {
+		if (skip >= seg[i].len) {
+			skip -= seg[i].len;
+			continue;
+		}
+
+		if (dev->write((const char *) seg[i].data + skip, seg[i].len - skip) < 0) {
+			return -1;
+		}
+
+		skip = 0;
+	}
+
+	return total;
+}
+
+#ifdef Q_OS_UNIX
+static int fillIov(struct iovec *iov, const tioseg_t *seg, int count)
+{
+	int iovcnt = 0;
+
+	for (int i = 0; i < count && iovcnt < MAX_IOSEG; i++) {
+		if (seg[i].len) {
+			iov[iovcnt].iov_base = (void *) seg[i].data;
+			iov[iovcnt].iov_len = seg[i].len;
+			iovcnt++;
+		}
+	}
+
+	return iovcnt;
+}
+#endif
+
+//
+// QSerialPort transport
+//
+bool FDCSerialTransport::open(const QString &name)
+{
+	port.setPortName(name);
+
+	if (!port.open(QIODevice::ReadWrite)) {
+		return false;
+	}
+
+	port.setDataBits(QSerialPort::Data8);
+	port.setParity(QSerialPort::NoParity);
+	port.setStopBits(QSerialPort::OneStop);
+	port.setFlowControl(QSerialPort::NoFlowControl);
+	port.setDataTerminalReady(true);
+	port.setRequestToSend(true);
+	port.clear();
+
+	return true;
+}
+
+void FDCSerialTransport::close()
+{
+	if (port.isOpen()) {
+		port.clear();
+		port.close();
+	}
+}
+
+bool FDCSerialTransport::setBaudRate(int baudRate)
+{
+	return port.setBaudRate(baudRate);
+}
+
+//
+// Apply the low latency profile to the open port. Settings the driver
+// or the permissions do not allow are reported and otherwise ignored.
+//
+QString FDCSerialTransport::setLowLatency()
+{
+	QStringList applied;
+
+	port.setReadBufferSize(LOWLAT_READ_BUFFER);
+	applied << QString("%1 byte read buffer").arg(LOWLAT_READ_BUFFER);
+
+#if defined(Q_OS_LINUX)
+	struct serial_struct serial;
+
+	if (ioctl(port.handle(), TIOCGSERIAL, &serial) == 0) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+
+		applied << ((ioctl(port.handle(), TIOCSSERIAL, &serial) == 0) ? "ASYNC_LOW_LATENCY" : "ASYNC_LOW_LATENCY refused");
+	}
+
+	// Only FTDI adapters have the attribute, writing it normally needs root
+	QFile timer(QString("/sys/class/tty/%1/device/latency_timer").arg(QFileInfo(port.portName()).fileName()));
+
+	if (timer.exists()) {
+		if (timer.open(QIODevice::WriteOnly) && timer.write(QByteArray::number(LOWLAT_FTDI_TIMER)) > 0 && timer.flush()) {
+			applied << QString("FTDI latency timer %1 ms").arg(LOWLAT_FTDI_TIMER);
+		}
+		else {
+			applied << QString("FTDI latency timer not writable (%1)").arg(timer.fileName());
+		}
+	}
+#elif defined(Q_OS_WIN)
+	HANDLE handle = port.handle();
+	COMMTIMEOUTS timeouts;
+
+	if (SetupComm(handle, LOWLAT_READ_BUFFER, LOWLAT_READ_BUFFER)) {
+		applied << QString("%1 byte driver queues").arg(LOWLAT_READ_BUFFER);
+	}
+
+	if (GetCommTimeouts(handle, &timeouts)) {
+		timeouts.ReadIntervalTimeout = MAXDWORD;
+		timeouts.ReadTotalTimeoutMultiplier = 0;
+		timeouts.ReadTotalTimeoutConstant = 0;
+
+		if (SetCommTimeouts(handle, &timeouts)) {
+			applied << "immediate read timeouts";
+		}
+	}
+#endif
+
+	return applied.join(", ");
+}
+
+qint64 FDCSerialTransport::writeDirect(const tioseg_t *seg, int count)
+{
+#ifdef Q_OS_UNIX
+	struct iovec iov[MAX_IOSEG];
+	int iovcnt = fillIov(iov, seg, count);
+	qint64 sent;
+
+	if (port.handle() < 0) {
+		return 0;
+	}
+
+	do {
+		sent = writev(port.handle(), iov, iovcnt);
+	} while (sent < 0 && errno == EINTR);
+
+	return (sent < 0) ? 0 : sent;	// EAGAIN, queue it all
+#else
+	Q_UNUSED(seg);
+	Q_UNUSED(count);
+	return 0;
+#endif
+}
+
+QString FDCSerialTransport::errorString() const
+{
+	return QString("Could not open serial port '%1' (%2)").arg(port.portName()).arg(port.error());
+}
+
+//
+// QTcpSocket transport
+//
+bool FDCTcpTransport::open(const QString &name)
+{
+	QUrl address(name);
+
+	url = name;
+
+	if (!address.isValid() || address.host().isEmpty() || address.port() < 0) {
+		return false;
+	}
+
+	socket.connectToHost(address.host(), address.port());
+
+	if (!socket.waitForConnected(TCP_CONNECT_TIMEOUT)) {
+		socket.abort();
+		return false;
+	}
+
+	socket.setSocketOption(QAbstractSocket::LowDelayOption, 1);
+	socket.setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+
+#if defined(Q_OS_UNIX) && defined(SO_NOSIGPIPE)
+	int on = 1;
+
+	setsockopt(socket.socketDescriptor(), SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+	return true;
+}
+
+void FDCTcpTransport::close()
+{
+	if (socket.state() != QAbstractSocket::UnconnectedState) {
+		socket.abort();
+	}
+}
+
+//
+// sendmsg() rather than writev() so a peer that has gone away is an
+// error return instead of SIGPIPE
+//
+qint64 FDCTcpTransport::writeDirect(const tioseg_t *seg, int count)
+{
+#ifdef Q_OS_UNIX
+	struct iovec iov[MAX_IOSEG];
+	struct msghdr msg;
+	qint64 sent;
+	int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+	flags = MSG_NOSIGNAL;
+#endif
+
+	if (socket.socketDescriptor() < 0) {
+		return 0;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = fillIov(iov, seg, count);
+
+	do {
+		sent = sendmsg(socket.socketDescriptor(), &msg, flags);
+	} while (sent < 0 && errno == EINTR);
+
+	return (sent < 0) ? 0 : sent;
+#else
+	Q_UNUSED(seg);
+	Q_UNUSED(count);
+	return 0;
+#endif
+}
+
+QString FDCTcpTransport::errorString() const
+{
+	if (socket.error() == QAbstractSocket::UnknownSocketError) {
+		return QString("Invalid network port '%1', expected tcp://host:port").arg(url);
+	}
+
+	return QString("Could not connect to '%1' (%2)").arg(url).arg(socket.errorString());
+}
+
+//
+// Every frame is taken whole, as a driver with room for it would
+//
+qint64 FDCNullTransport::writeDirect(const tioseg_t *seg, int count)
+{
+	qint64 total = 0;
+
+	for (int i = 0; i < count; i++) {
+		total += seg[i].len;
+	}
+
+	return total;
+}
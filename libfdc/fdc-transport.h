@@ -0,0 +1,135 @@
+#ifndef FDCTRANSPORT_H
+#define FDCTRANSPORT_H
+
+#include <QIODevice>
+#include <QSerialPort>
+#include <QTcpSocket>
+#include <QString>
+
+#include "fdc-protocol.h"
+
+#define MAX_IOSEG		4			// segments per scatter write
+
+#define TCP_SCHEME		"tcp://"		// network port name prefix
+#define TCP_CONNECT_TIMEOUT	3000			// connect timeout (ms)
+#define NULL_PORT		"null"			// port name of FDCNullTransport
+
+#define LOWLAT_READ_BUFFER	(TRKBUF_SIZE+CRC_LEN+CMDBUF_SIZE)	// a WRIT track and the next command
+#define LOWLAT_FTDI_TIMER	1			// FTDI latency timer (ms), 16 by default
+
+typedef struct TIOSEG {
+	const quint8 *data;
+	int len;
+} tioseg_t;
+
+//
+// Link to the FDC+. The worker reads from device() and sends whole
+// response frames with write(), so the protocol runs the same over a
+// local serial port or a TCP connection to a serial device server.
+// writeDirect() hands segments straight to the driver when nothing is
+// queued on the device and returns how many bytes it took. Transports
+// that set batchFrames() get the rest of a frame queued as one write.
+//
+// setLowLatency() tunes the link for short round trips where that means
+// something, and returns what it changed for the log.
+//
+class FDCTransport
+{
+public:
+	virtual ~FDCTransport() { }
+
+	virtual bool open(const QString &name) = 0;
+	virtual void close(void) = 0;
+	virtual bool setBaudRate(int baudRate) { Q_UNUSED(baudRate); return true; }
+	virtual QString setLowLatency(void) { return QString("nothing to tune"); }
+	virtual QIODevice *device(void) = 0;
+	virtual int error(void) const = 0;
+	virtual QString errorString(void) const = 0;
+
+	qint64 write(const tioseg_t *seg, int count);
+
+	static FDCTransport *create(const QString &name);
+
+protected:
+	virtual qint64 writeDirect(const tioseg_t *seg, int count) { Q_UNUSED(seg); Q_UNUSED(count); return 0; }
+	virtual bool batchFrames(void) const { return false; }
+};
+
+//
+// Local serial port. The low latency profile lets the driver hand over
+// input as soon as it arrives: ASYNC_LOW_LATENCY and a 1 ms FTDI latency
+// timer on Linux, reads that return at once and driver queues of one
+// track on Windows. Everywhere the QSerialPort read buffer is sized to
+// one WRIT track and the command after it.
+//
+class FDCSerialTransport : public FDCTransport
+{
+public:
+	bool open(const QString &name);
+	void close(void);
+	bool setBaudRate(int baudRate);
+	QString setLowLatency(void);
+	QIODevice *device(void) { return &port; }
+	int error(void) const { return port.error(); }
+	QString errorString(void) const;
+
+protected:
+	qint64 writeDirect(const tioseg_t *seg, int count);
+
+private:
+	QSerialPort port;
+};
+
+//
+// tcp://host:port to a serial device server in raw TCP mode. The line
+// speed is set on the server, so setBaudRate() does nothing. Nagle is
+// off so every response leaves as soon as it is written, and each frame
+// goes out in one send so it is not split across segments.
+//
+class FDCTcpTransport : public FDCTransport
+{
+public:
+	bool open(const QString &name);
+	void close(void);
+	QIODevice *device(void) { return &socket; }
+	int error(void) const { return socket.error(); }
+	QString errorString(void) const;
+
+protected:
+	qint64 writeDirect(const tioseg_t *seg, int count);
+	bool batchFrames(void) const { return true; }
+
+private:
+	QTcpSocket socket;
+	QString url;
+};
+
+//
+// Sends nowhere and never receives. Opened for the port name NULL_PORT,
+// so the worker can run without an FDC+ and be fed commands through
+// FDCWorker::receive(), as the microbenchmarks do.
+//
+class FDCNullDevice : public QIODevice
+{
+protected:
+	qint64 readData(char *data, qint64 maxSize) { Q_UNUSED(data); Q_UNUSED(maxSize); return 0; }
+	qint64 writeData(const char *data, qint64 maxSize) { Q_UNUSED(data); return maxSize; }
+};
+
+class FDCNullTransport : public FDCTransport
+{
+public:
+	bool open(const QString &name) { Q_UNUSED(name); return dev.open(QIODevice::ReadWrite | QIODevice::Unbuffered); }
+	void close(void) { dev.close(); }
+	QIODevice *device(void) { return &dev; }
+	int error(void) const { return 0; }
+	QString errorString(void) const { return QString(); }
+
+protected:
+	qint64 writeDirect(const tioseg_t *seg, int count);
+
+private:
+	FDCNullDevice dev;
+};
+
+#endif
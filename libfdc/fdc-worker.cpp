@@ -0,0 +1,1380 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Protocol Worker
+*      Serves READ, WRIT and STAT transactions from the FDC+ over a serial
+*      port or TCP link. See ../fdc-sds-gui.cpp for a description of the
+*      protocol.
+*
+***********************************************************************************/
+
+#include <QtGlobal>
+
+#include "fdc-worker.h"
+
+// Probe order for BAUD_AUTO, the usual FDC+ rate first
+static const int probeRates[PROBE_RATES] = { 403200, 460800, 230400 };
+
+FDCWorker::FDCWorker(FDCImagePool *imagePool, QObject *parent)
+	: QObject(parent)
+{
+	int driveNum;
+
+	// Link to the FDC+, created when a port is opened
+	link = nullptr;
+
+	// Receive framing state machine
+	rxState = AwaitCommand;
+	trkBufIdx = 0;
+	writeDrive = 0;
+	writeLen = 0;
+	writeSum = 0;
+
+	// WRIT data lands here, allocated once for the life of the worker
+	writeBuf = (quint8 *) qMallocAligned(TRKBUF_SIZE + CRC_LEN, WRITEBUF_ALIGN);
+
+	// Single timer for per-state timeouts
+	frameTimer = new QTimer(this);
+	frameTimer->setSingleShot(true);
+	frameTimer->setTimerType(Qt::PreciseTimer);
+	connect(frameTimer, &QTimer::timeout, this, &FDCWorker::frameTimeoutSlot);
+
+	// Errors are queued as events and formatted here, off the command path
+	diagTimer = new QTimer(this);
+	connect(diagTimer, &QTimer::timeout, this, &FDCWorker::diagTimeoutSlot);
+	diagTimer->start(DIAG_INTERVAL);
+
+	// Baud rate probe, then link scoring, one window at a time
+	linkTimer = new QTimer(this);
+	linkTimer->setSingleShot(true);
+	connect(linkTimer, &QTimer::timeout, this, &FDCWorker::linkTimeoutSlot);
+
+	// Every error reported to the dialog or log is counted for metrics
+	connect(this, &FDCWorker::errorMessage, this, [this]() { fdcStatus.errors.fetchAndAddRelaxed(1); });
+	connect(this, &FDCWorker::serialPortError, this, [this]() { fdcStatus.errors.fetchAndAddRelaxed(1); });
+
+	linkWindow = tlinkwindow_t();
+	probeIndex = -1;
+	probeBest = -1;
+	probeIdleReported = false;
+	retryWarned = false;
+	lastRead = 0xffff;
+	lastReadTime = 0;
+
+	// Image pool, shared with other sessions if given one
+	ownPool = (imagePool == nullptr) ? new FDCImagePool : nullptr;
+	pool = (imagePool == nullptr) ? ownPool : imagePool;
+
+	drives.mounted = 0;
+	drives.readOnly = 0;
+	drives.fixedLen = 0;
+
+	for (driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+		drives.maxTrack[driveNum] = 0;
+		drives.curTrack[driveNum] = 0;
+		drives.trackLen[driveNum] = 0;
+
+		privateImage[driveNum] = FDCImage::create(IMAGE_FILE);
+		privateCache[driveNum] = new FDCTrackCache;
+		overlay[driveNum] = nullptr;
+
+		drives.image[driveNum] = privateImage[driveNum];
+		drives.cache[driveNum] = privateCache[driveNum];
+		drives.shared[driveNum] = nullptr;
+	}
+
+	buildStatFrame();
+
+	cacheEnabled = true;
+	writeBehind = false;
+	imageType = IMAGE_FILE;
+	imageFlush = FLUSH_UNMOUNT;
+
+	// Write-behind thread
+	writerThread = new QThread(this);
+	writer = new FDCWriter(privateCache, MAX_DRIVE);
+	writer->moveToThread(writerThread);
+	connect(writerThread, &QThread::finished, writer, &QObject::deleteLater);
+	connect(writer, &FDCWriter::flushed, this, [this](int dirty) { fdcStatus.dirtyTracks(dirty); });
+	connect(writer, &FDCWriter::writeError, this, &FDCWorker::errorMessage);
+	writerThread->start();
+
+	// Read ahead thread
+	readAhead = true;
+	prefetchThread = new QThread(this);
+	prefetcher = new FDCPrefetcher(privateCache, MAX_DRIVE);
+	prefetcher->moveToThread(prefetchThread);
+	connect(prefetchThread, &QThread::finished, prefetcher, &QObject::deleteLater);
+	prefetchThread->start(QThread::LowPriority);
+
+	// Counters
+	statCount = 0;
+	readCount = 0;
+	writCount = 0;
+	cacheHits = 0;
+	cacheMisses = 0;
+
+	// Response latency clock
+	clock.start();
+	rxTime = 0;
+	writSent = 0;
+
+	// Serial tuning, applied when a port is opened
+	lowLatency = false;
+	turnaroundReported = false;
+
+	// Transaction trace, drained to a file on its own thread
+	tracing = false;
+	tracePending = false;
+	traceStart = 0;
+	traceSeq = 0;
+	traceThread = new QThread(this);
+	traceWriter = new FDCTraceWriter(&traceRing);
+	traceWriter->moveToThread(traceThread);
+	connect(traceThread, &QThread::finished, traceWriter, &QObject::deleteLater);
+	connect(traceWriter, &FDCTraceWriter::traceError, this, &FDCWorker::errorMessage);
+	traceThread->start(QThread::LowPriority);
+}
+
+FDCWorker::~FDCWorker()
+{
+	traceThread->quit();
+	traceThread->wait();
+
+	prefetchThread->quit();
+	prefetchThread->wait();
+
+	writerThread->quit();
+	writerThread->wait();
+
+	delete link;
+
+	for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+		unmountDrive(driveNum);
+
+		delete privateCache[driveNum];
+		delete privateImage[driveNum];
+	}
+
+	delete ownPool;
+
+	qFreeAligned(writeBuf);
+}
+
+bool FDCWorker::openSerialPort(const QString &portName, int baudRate)
+{
+	closeSerialPort();
+
+	link = FDCTransport::create(portName);
+
+	if (!link->open(portName)) {
+		emit serialPortError(link->errorString());
+		delete link;
+		link = nullptr;
+		return false;
+	}
+
+	if (baudRate != BAUD_AUTO && link->setBaudRate(baudRate) == false) {
+		emit serialPortError(QString("Could not set baudrate to %1").arg(baudRate));
+	}
+
+	if (lowLatency) {
+		emit lowLatencyProfile(QString("Low latency profile on '%1': %2").arg(portName).arg(link->setLowLatency()));
+	}
+
+	// Time the first WRIT handshakes on this link
+	fdcStatus.turnaround.reset();
+	turnaroundReported = false;
+
+	rxBuf.clear();
+	rxState = AwaitCommand;
+
+	connect(link->device(), &QIODevice::readyRead, this, &FDCWorker::readyReadSlot);
+	connect(link->device(), &QIODevice::readChannelFinished, this, [this, portName]() {
+		emit serialPortError(QString("Connection to '%1' closed").arg(portName));
+	});
+
+	// Find the rate, or start scoring the link at the one given
+	retryWarned = false;
+	lastRead = 0xffff;
+	linkWindow = tlinkwindow_t();
+
+	if (baudRate == BAUD_AUTO) {
+		probeBest = -1;
+		probeIdleReported = false;
+		probeRate(0);
+	}
+	else {
+		linkTimer->start(LINK_INTERVAL);
+	}
+
+	return true;
+}
+
+void FDCWorker::closeSerialPort()
+{
+	if (link != nullptr) {
+		disconnect(link->device(), nullptr, this, nullptr);
+		link->close();
+		delete link;
+		link = nullptr;
+	}
+
+	frameTimer->stop();
+	linkTimer->stop();
+	probeIndex = -1;
+	rxBuf.clear();
+	rxState = AwaitCommand;
+}
+
+//
+// Open a disk image on the specified drive. Returns the maximum
+// track number of the image, or -1 if the image could not be opened.
+// Read-only images are shared through the pool when possible; a
+// read-write image fails to mount while any session has it mounted.
+//
+int FDCWorker::mountDrive(int drive, const QString &fname, bool readOnly)
+{
+	QString error;
+	QString path;
+
+	if (drive < 0 || drive >= MAX_DRIVE) {
+		return -1;
+	}
+
+	unmountDrive(drive);
+
+	path = FDCImagePool::key(fname);
+
+	if (!pool->claim(path, !readOnly)) {
+		emit errorMessage(claimError(fname, path));
+		return -1;
+	}
+
+	if (readOnly && (drives.shared[drive] = pool->acquire(path)) != nullptr) {
+		drives.image[drive] = drives.shared[drive]->image;
+		drives.cache[drive] = drives.shared[drive]->cache;
+		geometry[drive] = drives.shared[drive]->geometry;
+	}
+	else {
+		delete privateImage[drive];
+		privateImage[drive] = FDCImage::createFor(fname, imageType, imageFlush);
+
+		if (!privateImage[drive]->open(fname, (readOnly) ? QIODevice::ReadOnly : QIODevice::ReadWrite)) {
+			pool->unclaim(path, !readOnly);
+			drives.image[drive] = privateImage[drive];
+			return -1;
+		}
+
+		// Track offsets for the cache, and checksums of resident images
+		if (!geometry[drive].probe(path, privateImage[drive]->size(), &error)) {
+			emit errorMessage(error);
+			privateImage[drive]->close();
+			pool->unclaim(path, !readOnly);
+			drives.image[drive] = privateImage[drive];
+			return -1;
+		}
+
+		privateCache[drive]->attach(privateImage[drive], cacheEnabled, geometry[drive], writeBehind && !readOnly);
+
+		drives.image[drive] = privateImage[drive];
+		drives.cache[drive] = privateCache[drive];
+	}
+
+	setGeometry(drive, geometry[drive]);
+
+	mountPath[drive] = path;
+	drives.curTrack[drive] = 0;
+
+	if (readOnly) {
+		drives.readOnly |= (1 << drive);
+	}
+	drives.mounted |= (1 << drive);
+	buildStatFrame();
+
+	return drives.maxTrack[drive];
+}
+
+//
+// Why the pool refused a mount of path. The pool only counts mounts of
+// a file, so a clash with another drive of this session is told apart
+// here. It is refused all the same: two read-write drives on one file
+// would each cache it and overwrite each other's tracks.
+//
+QString FDCWorker::claimError(const QString &fname, const QString &path) const
+{
+	for (int drive = 0; drive < MAX_DRIVE; drive++) {
+		if (!isMounted(drive) || mountPath[drive] != path) {
+			continue;
+		}
+
+		if (overlay[drive] != nullptr) {
+			return QString("'%1' is already mounted with an overlay on drive %2").arg(fname).arg(drive);
+		}
+
+		return QString("'%1' is already mounted %2 on drive %3").arg(fname)
+			.arg((drives.readOnly & (1 << drive)) ? "read-only" : "read-write").arg(drive);
+	}
+
+	return QString("'%1' is in use by another session").arg(fname);
+}
+
+//
+// Mount an image with a copy-on-write overlay. The image itself is only
+// read, and shared through the pool like a read-only mount, while WRIT
+// goes to a delta private to this drive. The delta is lost on unmount.
+//
+int FDCWorker::mountOverlay(int drive, const QString &fname)
+{
+	const quint8 *baseData = nullptr;
+	FDCImage *base;
+	QString error;
+	QString path;
+
+	if (drive < 0 || drive >= MAX_DRIVE) {
+		return -1;
+	}
+
+	unmountDrive(drive);
+
+	path = FDCImagePool::key(fname);
+
+	if (!pool->claim(path, false)) {
+		emit errorMessage(claimError(fname, path));
+		return -1;
+	}
+
+	if ((drives.shared[drive] = pool->acquire(path)) != nullptr) {
+		base = drives.shared[drive]->image;
+		baseData = drives.shared[drive]->cache->residentData();
+		geometry[drive] = drives.shared[drive]->geometry;
+	}
+	else {
+		delete privateImage[drive];
+		privateImage[drive] = FDCImage::createFor(fname, imageType, imageFlush);
+
+		if (!privateImage[drive]->open(fname, QIODevice::ReadOnly)) {
+			pool->unclaim(path, false);
+			drives.image[drive] = privateImage[drive];
+			return -1;
+		}
+
+		if (!geometry[drive].probe(path, privateImage[drive]->size(), &error)) {
+			emit errorMessage(error);
+			privateImage[drive]->close();
+			pool->unclaim(path, false);
+			drives.image[drive] = privateImage[drive];
+			return -1;
+		}
+
+		base = privateImage[drive];
+	}
+
+	overlay[drive] = new FDCOverlayImage(base, geometry[drive].trackLen(), baseData);
+
+	privateCache[drive]->attach(overlay[drive], cacheEnabled, geometry[drive], writeBehind);
+	setGeometry(drive, geometry[drive]);
+
+	drives.image[drive] = overlay[drive];
+	drives.cache[drive] = privateCache[drive];
+
+	mountPath[drive] = path;
+	drives.curTrack[drive] = 0;
+	drives.mounted |= (1 << drive);
+	buildStatFrame();
+
+	return drives.maxTrack[drive];
+}
+
+bool FDCWorker::unmountDrive(int drive)
+{
+	bool claimWrite;
+
+	if (drive < 0 || drive >= MAX_DRIVE || !isMounted(drive)) {
+		return false;
+	}
+
+	claimWrite = !(drives.readOnly & (1 << drive)) && overlay[drive] == nullptr;
+
+	drives.mounted &= ~(1 << drive);
+	drives.readOnly &= ~(1 << drive);
+	drives.fixedLen &= ~(1 << drive);
+	buildStatFrame();
+
+	if (overlay[drive] != nullptr) {
+		privateCache[drive]->detach();
+		delete overlay[drive];
+		overlay[drive] = nullptr;
+	}
+
+	if (drives.shared[drive] != nullptr) {
+		pool->release(drives.shared[drive]);
+		drives.shared[drive] = nullptr;
+	}
+	else {
+		// Write back dirty tracks before closing the image
+		privateCache[drive]->detach();
+		privateImage[drive]->close();
+	}
+
+	pool->unclaim(mountPath[drive], claimWrite);
+	mountPath[drive].clear();
+
+	drives.image[drive] = privateImage[drive];
+	drives.cache[drive] = privateCache[drive];
+	drives.maxTrack[drive] = 0;
+	drives.curTrack[drive] = 0;
+	drives.trackLen[drive] = 0;
+	geometry[drive].clear();
+
+	fdcStatus.dirtyTracks(dirtyCount());
+
+	return true;
+}
+
+//
+// Save the overlay delta of a drive. Tracks still waiting for the
+// write-behind thread are written to the delta first.
+//
+bool FDCWorker::snapshotDrive(int drive)
+{
+	if (drive < 0 || drive >= MAX_DRIVE || overlay[drive] == nullptr) {
+		return false;
+	}
+
+	privateCache[drive]->flushDirty();
+	overlay[drive]->snapshot();
+
+	return true;
+}
+
+//
+// Return an overlay drive to its last snapshot, or to the base image if
+// there is none. The cached tracks are dropped with the newer writes.
+//
+bool FDCWorker::rollbackDrive(int drive)
+{
+	FDCTrackCache *cache;
+	bool enabled;
+	bool delayWrites;
+
+	if (drive < 0 || drive >= MAX_DRIVE || overlay[drive] == nullptr) {
+		return false;
+	}
+
+	cache = privateCache[drive];
+	enabled = cache->isEnabled();
+	delayWrites = cache->isWriteBehind();
+
+	cache->detach();
+	overlay[drive]->rollback();
+	cache->attach(overlay[drive], enabled, geometry[drive], delayWrites);
+
+	fdcStatus.dirtyTracks(dirtyCount());
+
+	return true;
+}
+
+//
+// Enable or disable the track cache for drives mounted from now on
+//
+void FDCWorker::setTrackCache(bool enable)
+{
+	cacheEnabled = enable;
+}
+
+//
+// Enable or disable write-behind for drives mounted from now on. WRIT
+// data is committed to the track cache, WSTA is returned at once and the
+// background writer writes the dirty tracks to the image.
+//
+void FDCWorker::setWriteBehind(bool enable)
+{
+	writeBehind = enable;
+}
+
+//
+// Read ahead on LRU cached drives. After a READ miss, or a READ served
+// by read ahead, the tracks that follow are loaded in the background,
+// as is the track a STAT reports the head on.
+//
+void FDCWorker::setReadAhead(bool enable)
+{
+	readAhead = enable;
+
+	if (!readAhead) {
+		prefetcher->cancel();
+	}
+}
+
+//
+// Load the first tracks of an LRU cached drive in the background, so a
+// boot right after mount finds them in the cache. The first STAT or
+// READ read ahead replaces the request with the tracks around the head.
+// Preloaded, mapped and uncached drives have nothing to warm.
+//
+void FDCWorker::warmDrive(int drive)
+{
+	if (drive < 0 || drive >= MAX_DRIVE || !isMounted(drive) || !drives.trackLen[drive] || !isPrefetchable(drive)) {
+		return;
+	}
+
+	prefetcher->request(drive, 0, drives.trackLen[drive], qMin(CACHE_TRACKS, drives.maxTrack[drive] + 1));
+}
+
+//
+// Tune serial ports opened from now on for short round trips, see
+// FDCSerialTransport. The effect shows in the WRIT turnaround, which is
+// reported once enough handshakes have been timed. Driver settings that
+// outlive the port, like the FTDI latency timer, are not undone when
+// the profile is turned off.
+//
+void FDCWorker::setLowLatency(bool enable)
+{
+	lowLatency = enable;
+}
+
+//
+// Select the image backend (IMAGE_FILE, IMAGE_MAPPED) and the write back
+// policy of mapped images for drives mounted from now on
+//
+void FDCWorker::setImageBackend(int type, int flushPolicy)
+{
+	imageType = type;
+	imageFlush = flushPolicy;
+}
+
+//
+// Capture every transaction to a binary trace file. Records go through
+// a lock free ring to the trace thread, so the command path only fills
+// in a fixed size record.
+//
+bool FDCWorker::startTrace(const QString &fname)
+{
+	bool opened = false;
+
+	stopTrace();
+
+	QMetaObject::invokeMethod(traceWriter, "open", Qt::BlockingQueuedConnection,
+		Q_RETURN_ARG(bool, opened), Q_ARG(QString, fname));
+
+	if (opened) {
+		traceStart = clock.nsecsElapsed();
+		traceSeq = 0;
+		tracing = true;
+	}
+
+	return opened;
+}
+
+void FDCWorker::stopTrace()
+{
+	if (!tracing) {
+		return;
+	}
+
+	tracing = false;
+	tracePending = false;
+
+	QMetaObject::invokeMethod(traceWriter, "close", Qt::BlockingQueuedConnection);
+}
+
+void FDCWorker::shutdown()
+{
+	closeSerialPort();
+
+	stopTrace();
+	traceThread->quit();
+	traceThread->wait();
+
+	prefetcher->cancel();
+	prefetchThread->quit();
+	prefetchThread->wait();
+
+	for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+		unmountDrive(driveNum);
+	}
+
+	writerThread->quit();
+	writerThread->wait();
+}
+
+//
+// Append everything the port has to the receive buffer and run the
+// framing state machine over it. Serial data is never polled, so a
+// command is dispatched as soon as its last byte arrives.
+//
+void FDCWorker::readyReadSlot()
+{
+	qint64 bytesRead;
+	bool direct;
+
+	do {
+		// Track data goes straight from the port to the WRIT buffer
+		direct = rxState == AwaitWriteData && !rxBuf.size();
+
+		if (direct) {
+			bytesRead = link->device()->read((char *) writeBuf + trkBufIdx, writeLen + CRC_LEN - trkBufIdx);
+		}
+		else {
+			bytesRead = rxBuf.fill(link->device());
+		}
+
+		if (bytesRead > 0) {
+			fdcStatus.rxBytes.fetchAndAddRelaxed(bytesRead);
+			rxTime = clock.nsecsElapsed();
+
+			if (direct) {
+				writeDataReceived(bytesRead);
+			}
+		}
+
+		processInput();
+	} while (bytesRead > 0 && link != nullptr && link->device()->bytesAvailable());
+}
+
+//
+// Take bytes as if they had come in on the link, through the same
+// framing and command dispatch as readyReadSlot(). Responses go to the
+// open link, usually NULL_PORT. Lets the per-command path be timed
+// without an FDC+, see bench/micro.
+//
+void FDCWorker::receive(const quint8 *data, int len)
+{
+	while (len > 0) {
+		int n = rxBuf.write(data, len);
+
+		fdcStatus.rxBytes.fetchAndAddRelaxed(n);
+		rxTime = clock.nsecsElapsed();
+
+		processInput();
+
+		data += n;
+		len -= n;
+	}
+}
+
+void FDCWorker::processInput()
+{
+	int len;
+
+	for (;;) {
+		switch (rxState) {
+			case AwaitCommand:
+				if (rxBuf.size() < CMDBUF_SIZE) {
+					// Time the partial frame from its first byte
+					if (rxBuf.size() && !frameTimer->isActive()) {
+						frameTimer->start(CMD_TIMEOUT);
+					}
+					return;
+				}
+
+				frameTimer->stop();
+				rxBuf.read(cmdBuf.asBytes, CMDBUF_SIZE);
+				processCommand();
+				break;
+
+			case AwaitWriteData:
+				len = writeLen + CRC_LEN;
+
+				// Data that came in with or after the WRIT command is
+				// summed on its way out of the ring buffer
+				if (rxBuf.size() && trkBufIdx < writeLen) {
+					writeDataReceived(rxBuf.readChecksum(writeBuf + trkBufIdx, writeLen - trkBufIdx, &writeSum), true);
+				}
+
+				if (rxBuf.size()) {
+					writeDataReceived(rxBuf.read(writeBuf + trkBufIdx, len - trkBufIdx), true);
+				}
+
+				if (trkBufIdx < len) {
+					return;
+				}
+
+				frameTimer->stop();
+				completeWrite();
+				break;
+		}
+	}
+}
+
+//
+// len more bytes of WRIT data are in writeBuf at trkBufIdx. The
+// checksum is kept up as the track arrives, so it is ready to compare
+// with the CRC the moment the last byte lands. summed is set if the
+// caller already added the track bytes to writeSum.
+//
+void FDCWorker::writeDataReceived(int len, bool summed)
+{
+	int end;
+
+	if (len <= 0) {
+		return;
+	}
+
+	if (!trkBufIdx) {
+		recordTurnaround();
+	}
+
+	end = qMin(trkBufIdx + len, (int) writeLen);
+
+	if (!summed && end > trkBufIdx) {
+		writeSum += calcChecksum(writeBuf + trkBufIdx, end - trkBufIdx);
+	}
+
+	trkBufIdx += len;
+}
+
+void FDCWorker::frameTimeoutSlot()
+{
+	switch (rxState) {
+		case AwaitCommand:
+			diag.post(DIAG_PARTIAL_CMD, rxBuf.size());
+			linkError();
+#ifdef DEBUG
+			emit debugDump(QByteArray((const char *) cmdBuf.asBytes, rxBuf.read(cmdBuf.asBytes, CMDBUF_SIZE)));
+#endif
+			rxBuf.clear();
+			break;
+
+		case AwaitWriteData:
+			diag.post(DIAG_WRIT_DATALEN, trkBufIdx, writeLen + CRC_LEN);
+			linkError();
+			linkWindow.trackBytes += writeLen;
+			linkWindow.retryBytes += writeLen;
+			sendWriteStatus(STAT_CHECKSUM_ERR);
+			traceEnd(STAT_CHECKSUM_ERR, 0, trkBufIdx, TRACE_TIMEOUT);
+			break;
+	}
+}
+
+void FDCWorker::processCommand()
+{
+	quint16 checksum;
+
+	// Calculate and validate checksum
+	checksum = calcChecksum(cmdBuf.asBytes, CMD_LEN);
+
+	if (tracing) {
+		traceBegin();
+	}
+
+	// A corrupt command is never acted on, the FDC+ times out and retries
+	if (checksum != cmdBuf.checksum) {
+		diag.post(DIAG_CMD_CHECKSUM, checksum, cmdBuf.checksum);
+		linkError();
+		traceEnd(0, 0, 0, TRACE_NO_RESPONSE);
+		return;
+	}
+
+	linkWindow.frames++;
+
+	switch (cmdOpcode(&cmdBuf)) {
+		case OP_READ:
+			processRead();
+			break;
+
+		case OP_WRIT:
+			processWrite();
+			break;
+
+		case OP_STAT:
+			processStat();
+			break;
+
+		default:
+			diag.post(DIAG_UNKNOWN_CMD, cmdOpcode(&cmdBuf));
+			linkError();
+			break;
+	}
+
+	// Commands that were ignored, unless WRIT data is still to come
+	if (tracePending && rxState == AwaitCommand) {
+		traceEnd(0, 0, 0, TRACE_NO_RESPONSE);
+	}
+}
+
+//
+// READ command
+//
+void FDCWorker::processRead()
+{
+	quint16 driveNum;
+	quint16 trackLen;
+	qint64 bytesRead;
+	const quint8 *trackData;
+	quint16 checksum;
+	int outcome;
+
+	readCount++;
+
+	driveNum = cmdBuf.param1 >> 12;
+
+	fdcStatus.command(FDC_CMD_READ, readCount, driveNum, cmdBuf.param1 & 0x0fff, cmdBuf.param2);
+
+	// Ignore invalid drive numbers
+	if (driveNum >= MAX_DRIVE) {
+		return;
+	}
+
+	// If drive not mounted, ignore
+	if (!isMounted(driveNum)) {
+		diag.post(DIAG_READ_NOT_LOADED, driveNum);
+		return;
+	}
+
+	// Track in lower 12 bits
+	drives.curTrack[driveNum] = cmdBuf.param1 & 0x0fff;
+	trackLen = cmdBuf.param2;
+
+	// If the requested track length is too long, ignore
+	if (trackLen > TRKBUF_SIZE) {
+		diag.post(DIAG_READ_TRACKLEN, trackLen);
+		return;
+	}
+
+	// Nor is a length other than the image's, before the image is touched
+	if ((drives.fixedLen & (1 << driveNum)) && trackLen != drives.trackLen[driveNum]) {
+		diag.post(DIAG_READ_GEOMETRY, trackLen, drives.trackLen[driveNum]);
+		return;
+	}
+
+	if (drives.curTrack[driveNum] > drives.maxTrack[driveNum]) {
+		diag.post(DIAG_READ_TRACK, drives.curTrack[driveNum], drives.maxTrack[driveNum]);
+		return;
+	}
+
+	fdcStatus.drive(driveNum, true, drives.curTrack[driveNum]);
+
+	bytesRead = drives.cache[driveNum]->readTrack(drives.curTrack[driveNum], trackLen, &trackData, &checksum, &outcome);
+
+	// Session totals, whoever else shares the cache and however often it is reattached
+	if (outcome == CACHE_MISS) {
+		cacheMisses++;
+	}
+	else if (outcome != CACHE_UNCACHED) {
+		cacheHits++;
+	}
+
+	fdcStatus.cache(cacheHits, cacheMisses);
+
+	if (bytesRead < 0) {
+		diag.post(DIAG_READ_SEEK, drives.curTrack[driveNum] * trackLen);
+	}
+
+	if (bytesRead != trackLen) {
+		diag.post(DIAG_READ_SHORT, bytesRead, trackLen);
+		return;	// Ignore reads past end of file
+	}
+
+	// Send the track straight from the cache or mapping, then its checksum
+	tioseg_t seg[2];
+
+	crcBuf[0] = checksum & 0x00ff;			// LSB of checksum
+	crcBuf[1] = (checksum >> 8) & 0x00ff;		// MSB of checksum
+
+	seg[0].data = trackData;
+	seg[0].len = trackLen;
+	seg[1].data = crcBuf;
+	seg[1].len = CRC_LEN;
+
+	writeSerialPort(seg, 2);
+
+	recordLatency(FDC_CMD_READ);
+	traceEnd(STAT_OK, 0, trackLen, (outcome == CACHE_MISS) ? TRACE_MISS : 0);
+
+	// The same track again straight away means the FDC+ got a bad copy
+	linkWindow.trackBytes += trackLen;
+
+	if (cmdBuf.param1 == lastRead && rxTime - lastReadTime < (qint64) RETRY_WINDOW * 1000000) {
+		linkWindow.retryBytes += trackLen;
+	}
+
+	lastRead = cmdBuf.param1;
+	lastReadTime = rxTime;
+
+	// Keep a sequential sweep ahead of the FDC+
+	drives.trackLen[driveNum] = trackLen;
+
+	if (outcome == CACHE_MISS || outcome == CACHE_PREFETCH_HIT) {
+		prefetchFrom(driveNum, drives.curTrack[driveNum] + 1);
+	}
+}
+
+//
+// WRIT command. If the drive can accept the track, respond and switch
+// the receiver over to collecting the track data. completeWrite() runs
+// when the data and CRC have all arrived.
+//
+void FDCWorker::processWrite()
+{
+	quint16 driveNum;
+	quint16 trackLen;
+
+	writCount++;
+
+	// Reading back a track just written is not a retry
+	lastRead = 0xffff;
+
+	driveNum = cmdBuf.param1 >> 12;
+
+	fdcStatus.command(FDC_CMD_WRIT, writCount, driveNum, cmdBuf.param1 & 0x0fff, cmdBuf.param2);
+
+	// Ignore invalid drive numbers
+	if (driveNum >= MAX_DRIVE) {
+		return;
+	}
+
+	drives.curTrack[driveNum] = cmdBuf.param1 & 0x0fff;
+	trackLen = cmdBuf.param2;
+
+	// If drive not mounted, ignore
+	if (!isMounted(driveNum)) {
+		diag.post(DIAG_WRIT_NOT_LOADED, driveNum);
+		cmdBuf.rcode = STAT_NOT_READY;
+	}
+	else if (drives.readOnly & (1 << driveNum)) {
+		diag.post(DIAG_WRIT_READONLY, driveNum);
+		cmdBuf.rcode = STAT_NOT_READY;
+	}
+	else if ((drives.fixedLen & (1 << driveNum)) && trackLen != drives.trackLen[driveNum]) {
+		diag.post(DIAG_WRIT_GEOMETRY, trackLen, drives.trackLen[driveNum]);
+		cmdBuf.rcode = STAT_NOT_READY;
+	}
+	else {
+		cmdBuf.rcode = STAT_OK;
+	}
+
+	// If the requested track length is too long, ignore
+	if (trackLen > TRKBUF_SIZE) {
+		diag.post(DIAG_WRIT_TRACKLEN, trackLen);
+		cmdBuf.rcode = STAT_NOT_READY;
+	}
+
+	if (drives.curTrack[driveNum] > drives.maxTrack[driveNum]) {
+		diag.post(DIAG_WRIT_TRACK, drives.curTrack[driveNum], drives.maxTrack[driveNum]);
+		return;
+	}
+
+	// Send WRIT response
+	cmdBuf.checksum = calcChecksum(cmdBuf.asBytes, CMD_LEN);
+
+	writeSerialPort(cmdBuf.asBytes, CMDBUF_SIZE);
+
+	if (cmdBuf.rcode != STAT_OK) {
+		traceEnd(cmdBuf.rcode, 0, 0);
+	}
+	else {
+		writeDrive = driveNum;
+		writeLen = trackLen;
+		trkBufIdx = 0;
+		writeSum = 0;
+		writSent = clock.nsecsElapsed();
+
+		rxState = AwaitWriteData;
+		frameTimer->start(WRIT_TIMEOUT);
+	}
+}
+
+void FDCWorker::completeWrite()
+{
+	quint16 checksum;
+	quint16 rcode;
+	qint64 bytesWritten;
+
+	checksum = writeSum;
+
+	if (((checksum & 0xff) == writeBuf[writeLen])
+		&& (((checksum >> 8) & 0xff)) == writeBuf[writeLen + 1]) {
+
+		rcode = STAT_OK;
+
+		bytesWritten = drives.cache[writeDrive]->writeTrack(drives.curTrack[writeDrive], writeLen, writeBuf, checksum);
+
+		if (bytesWritten < 0) {
+			diag.post(DIAG_WRIT_SEEK, drives.curTrack[writeDrive] * writeLen);
+			rcode = STAT_WRITE_ERR;
+		}
+		else if (bytesWritten != writeLen) {
+			diag.post(DIAG_WRIT_FAILED);
+			rcode = STAT_WRITE_ERR;
+		}
+		else if (drives.cache[writeDrive]->isWriteBehind()) {
+			writer->request();
+			fdcStatus.dirtyTracks(dirtyCount());
+		}
+	}
+	else {
+		diag.post(DIAG_WRIT_CHECKSUM);
+		linkError();
+		linkWindow.retryBytes += writeLen;
+		rcode = STAT_CHECKSUM_ERR;
+	}
+
+	linkWindow.trackBytes += writeLen;
+
+	sendWriteStatus(rcode);
+
+	recordLatency(FDC_CMD_WRIT);
+	traceEnd(rcode, 0, writeLen);
+}
+
+//
+// Send the final WSTA response and return to waiting for commands
+//
+void FDCWorker::sendWriteStatus(quint16 rcode)
+{
+	setOpcode(&cmdBuf, OP_WSTA);
+	cmdBuf.rcode = rcode;
+	cmdBuf.checksum = calcChecksum(cmdBuf.asBytes, CMD_LEN);
+
+	writeSerialPort(cmdBuf.asBytes, CMDBUF_SIZE);
+
+	rxState = AwaitCommand;
+}
+
+//
+// STAT command. The response only depends on which drives are mounted,
+// so the prebuilt frame goes out first and the status updates follow.
+//
+void FDCWorker::processStat()
+{
+	quint16 driveNum;
+
+	writeSerialPort(statFrame.asBytes, CMDBUF_SIZE);
+
+	recordLatency(FDC_CMD_STAT);
+	traceEnd(STAT_OK, drives.mounted, 0);
+
+	statCount++;
+
+	driveNum = cmdBuf.param1 & 0x00ff;
+
+	fdcStatus.drive(driveNum, (cmdBuf.param1 & 0xff00) >> 8, cmdBuf.param2);
+	fdcStatus.command(FDC_CMD_STAT, statCount, driveNum, cmdBuf.param1, cmdBuf.param2);
+
+	if (driveNum >= MAX_DRIVE || drives.curTrack[driveNum] == cmdBuf.param2) {
+		return;
+	}
+
+	drives.curTrack[driveNum] = cmdBuf.param2;
+
+	// The head has moved, the next READ is most likely for this track
+	prefetchFrom(driveNum, drives.curTrack[driveNum]);
+}
+
+//
+// STAT response with the mounted drive bitmap and its checksum, rebuilt
+// whenever the bitmap changes, which also publishes it to the status
+//
+void FDCWorker::buildStatFrame()
+{
+	setOpcode(&statFrame, OP_STAT);
+	statFrame.rcode = STAT_OK;
+	statFrame.rdata = drives.mounted;
+	statFrame.checksum = calcChecksum(statFrame.asBytes, CMD_LEN);
+
+	fdcStatus.mounted.storeRelease(drives.mounted);
+}
+
+//
+// Queue read ahead from track on, up to the last track of the drive
+//
+void FDCWorker::prefetchFrom(quint16 driveNum, quint16 track)
+{
+	if (!readAhead || !isMounted(driveNum) || !drives.trackLen[driveNum] || !isPrefetchable(driveNum)) {
+		return;
+	}
+
+	if (track > drives.maxTrack[driveNum]) {
+		return;
+	}
+
+	prefetcher->request(driveNum, track, drives.trackLen[driveNum], qMin(PREFETCH_TRACKS, drives.maxTrack[driveNum] - track + 1));
+}
+
+//
+// Take the track count and, if known, the track length of a drive from
+// its geometry. READ and WRIT are held to the length only if the
+// geometry enforces it. A known length, even a guessed one, also lets
+// read ahead start from a STAT before the first READ.
+//
+void FDCWorker::setGeometry(int drive, const FDCGeometry &geom)
+{
+	geometry[drive] = geom;
+	drives.maxTrack[drive] = geom.maxTrack();
+	drives.trackLen[drive] = geom.trackLen();
+
+	if (geom.isEnforced()) {
+		drives.fixedLen |= (1 << drive);
+	}
+	else {
+		drives.fixedLen &= ~(1 << drive);
+	}
+}
+
+//
+// Time from the arrival of the last input byte of a command (for WRIT,
+// of the track data) to its response being handed to the port
+//
+void FDCWorker::recordLatency(int command)
+{
+	fdcStatus.latency[command].record(clock.nsecsElapsed() - rxTime);
+}
+
+//
+// Time from the WRIT response being handed to the port to the first
+// byte of track data arriving. The FDC+ sends the track as soon as it
+// sees the response, so this is the overhead one transfer pays in both
+// directions of the link: driver and adapter buffering, USB polling and
+// the FTDI latency timer.
+//
+void FDCWorker::recordTurnaround()
+{
+	const FDCLatencyHistogram *hist = &fdcStatus.turnaround;
+
+	fdcStatus.turnaround.record(rxTime - writSent);
+
+	if (!turnaroundReported && hist->count() >= TURNAROUND_REPORT) {
+		turnaroundReported = true;
+
+		emit linkStatus(QString("Link turnaround %1 ms median, %2 ms max over %3 WRIT handshakes")
+			.arg(hist->percentile(0.50) / 1000.0, 0, 'f', 3).arg(hist->peak() / 1000.0, 0, 'f', 3).arg(hist->count()));
+	}
+}
+
+//
+// Start a trace record from the command just received. It is finished
+// by traceEnd() when the transaction completes.
+//
+void FDCWorker::traceBegin()
+{
+	traceRec.time = rxTime - traceStart;
+	traceRec.opcode = cmdOpcode(&cmdBuf);
+	traceRec.param1 = cmdBuf.param1;
+	traceRec.param2 = cmdBuf.param2;
+	tracePending = true;
+}
+
+void FDCWorker::traceEnd(quint16 rcode, quint16 rdata, quint16 length, quint16 flags)
+{
+	if (!tracePending) {
+		return;
+	}
+
+	traceRec.latency = clock.nsecsElapsed() - rxTime;
+	traceRec.seq = traceSeq++;
+	traceRec.rcode = rcode;
+	traceRec.rdata = rdata;
+	traceRec.length = length;
+	traceRec.flags = flags;
+
+	traceRing.push(traceRec);
+
+	tracePending = false;
+}
+
+//
+// Tracks waiting for the background writer across all drives
+//
+int FDCWorker::dirtyCount()
+{
+	int dirty = 0;
+
+	for (int driveNum = 0; driveNum < MAX_DRIVE; driveNum++) {
+		dirty += privateCache[driveNum]->dirtyCount();
+	}
+
+	return dirty;
+}
+
+//
+// Queue a response for transmission. The port is flushed from the
+// worker's event loop, so nothing here waits on the serial line.
+// Returns the number of bytes queued or -1 on error.
+//
+int FDCWorker::writeSerialPort(const quint8 *buffer, int len)
+{
+	tioseg_t seg;
+
+	seg.data = buffer;
+	seg.len = len;
+
+	return writeSerialPort(&seg, 1);
+}
+
+//
+// Scatter write. The transport sends the segments straight from the
+// cache or mapping where it can, and queues the rest.
+//
+int FDCWorker::writeSerialPort(const tioseg_t *seg, int count)
+{
+	qint64 total = 0;
+
+	for (int i = 0; i < count; i++) {
+		total += seg[i].len;
+	}
+
+	if (!total) {
+		diag.post(DIAG_SERIAL_LEN, total);
+		return -1;
+	}
+
+	if (link == nullptr || link->write(seg, count) < 0) {
+		diag.post(DIAG_SERIAL_WRITE, (link == nullptr) ? -1 : link->error());
+		return -1;
+	}
+
+	fdcStatus.txBytes.fetchAndAddRelaxed(total);
+
+	return total;
+}
+
+//
+// End of a probe or scoring window. Rates are never switched in the
+// middle of a WRIT.
+//
+void FDCWorker::linkTimeoutSlot()
+{
+	if (link == nullptr) {
+		return;
+	}
+
+	if (probeIndex < 0) {
+		scoreLink();
+	}
+	else if (rxState != AwaitCommand) {
+		linkTimer->start(WRIT_TIMEOUT);
+	}
+	else {
+		probeNext();
+	}
+}
+
+//
+// Listen at one of the probe rates for a window. Anything received at
+// the previous rate is dropped. Commands are served as usual meanwhile,
+// so at the right rate the FDC+ is already up and running.
+//
+void FDCWorker::probeRate(int index)
+{
+	probeIndex = index;
+
+	link->setBaudRate(probeRates[index]);
+	link->device()->readAll();
+	rxBuf.clear();
+	frameTimer->stop();
+
+	linkWindow = tlinkwindow_t();
+	linkTimer->start(PROBE_WINDOW);
+}
+
+//
+// Score the rate just probed and move on. A rate is clean if enough
+// commands came through without a single error in its window. Once a
+// rate is clean only faster ones are still tried, and the fastest clean
+// rate is kept. If none was clean, the one that got the most commands
+// through is kept with a warning, and if nothing was heard at all the
+// FDC+ is probably not running yet and probing starts over.
+//
+void FDCWorker::probeNext()
+{
+	int next;
+	int best = -1;
+
+	probeScore[probeIndex] = linkWindow;
+
+	if (linkWindow.frames >= PROBE_FRAMES && !linkWindow.errors
+		&& (probeBest < 0 || probeRates[probeIndex] > probeRates[probeBest])) {
+		probeBest = probeIndex;
+	}
+
+	for (next = probeIndex + 1; next < PROBE_RATES; next++) {
+		if (probeBest < 0 || probeRates[next] > probeRates[probeBest]) {
+			probeRate(next);
+			return;
+		}
+	}
+
+	if (probeBest >= 0) {
+		lockRate(probeBest);
+		return;
+	}
+
+	for (int i = 0; i < PROBE_RATES; i++) {
+		qint64 good = (qint64) probeScore[i].frames - probeScore[i].errors;
+
+		if (good > 0 && (best < 0 || good > (qint64) probeScore[best].frames - probeScore[best].errors)) {
+			best = i;
+		}
+	}
+
+	if (best < 0) {
+		if (!probeIdleReported) {
+			probeIdleReported = true;
+			emit linkStatus("No FDC+ traffic yet, still probing the baud rate");
+		}
+
+		probeRate(0);
+		return;
+	}
+
+	emit errorMessage(QString("No clean baud rate, using %1 (%2 errors in %3 commands)")
+		.arg(probeRates[best]).arg(probeScore[best].errors).arg(probeScore[best].frames));
+
+	lockRate(best);
+}
+
+void FDCWorker::lockRate(int index)
+{
+	if (index != probeIndex) {
+		if (!link->setBaudRate(probeRates[index])) {
+			emit serialPortError(QString("Could not set baudrate to %1").arg(probeRates[index]));
+		}
+
+		link->device()->readAll();
+		rxBuf.clear();
+		frameTimer->stop();
+	}
+
+	probeIndex = -1;
+
+	emit linkStatus(QString("Baud rate locked at %1").arg(probeRates[index]));
+	emit baudRateLocked(probeRates[index]);
+
+	linkWindow = tlinkwindow_t();
+	linkTimer->start(LINK_INTERVAL);
+}
+
+//
+// Share of the track data the FDC+ had to resend or read again over the
+// last window. Going over LINK_RETRY_PCT is a warning, and so is coming
+// back under it.
+//
+void FDCWorker::scoreLink()
+{
+	int lost = (linkWindow.trackBytes) ? (qint64) linkWindow.retryBytes * 100 / linkWindow.trackBytes : 0;
+
+	fdcStatus.linkScore.storeRelease(100 - lost);
+
+	if (lost >= LINK_RETRY_PCT && !retryWarned) {
+		retryWarned = true;
+		emit errorMessage(QString("Retries took %1% of track data over the last %2 s, %3 link errors")
+			.arg(lost).arg(LINK_INTERVAL / 1000).arg(linkWindow.errors));
+	}
+	else if (lost < LINK_RETRY_PCT && retryWarned && linkWindow.trackBytes) {
+		retryWarned = false;
+		emit linkStatus(QString("Retries down to %1% of track data").arg(lost));
+	}
+
+	linkWindow = tlinkwindow_t();
+	linkTimer->start(LINK_INTERVAL);
+}
+
+void FDCWorker::diagTimeoutSlot()
+{
+	QString text;
+
+	while (diag.take(&text)) {
+		emit errorMessage(text);
+	}
+}
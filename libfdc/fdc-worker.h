@@ -0,0 +1,221 @@
+#ifndef FDCWORKER_H
+#define FDCWORKER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QThread>
+#include <QElapsedTimer>
+
+#include "fdc-protocol.h"
+#include "fdc-image.h"
+#include "fdc-cache.h"
+#include "fdc-geometry.h"
+#include "fdc-writer.h"
+#include "fdc-prefetch.h"
+#include "fdc-ringbuffer.h"
+#include "fdc-status.h"
+#include "fdc-diag.h"
+#include "fdc-pool.h"
+#include "fdc-transport.h"
+#include "fdc-trace.h"
+
+#define FDC_CMD_STAT		0			// FDCStatus command codes
+#define FDC_CMD_READ		1
+#define FDC_CMD_WRIT		2
+
+#define CMD_TIMEOUT		50			// partial command timeout (ms)
+#define WRIT_TIMEOUT		250			// write data timeout (ms)
+#define DIAG_INTERVAL		100			// diagnostic queue drain (ms)
+#define WRITEBUF_ALIGN		64			// cache line alignment of the WRIT buffer
+#define TURNAROUND_REPORT	16			// WRIT handshakes timed before reporting
+
+#define BAUD_AUTO		0			// openSerialPort() probes for the rate
+#define PROBE_RATES		3			// 403.2K, 460.8K, 230.4K, in that order
+#define PROBE_WINDOW		2500			// time spent listening at each rate (ms)
+#define PROBE_FRAMES		10			// good commands a clean rate needs in a window
+#define LINK_INTERVAL		5000			// link scoring window (ms)
+#define LINK_RETRY_PCT		5			// warn when retries take this share of track data
+#define RETRY_WINDOW		500			// same track READ again within this is a retry (ms)
+
+//
+// Per-drive state, one array per field and indexed by drive number so
+// the protocol path never touches anything but the fields it needs.
+// mounted is the STAT response bitmap and is updated on mount and
+// unmount rather than rebuilt for every STAT. image and cache are the
+// session's own, or those of a shared read-only pool image. Drives
+// whose geometry fixes the track length only accept READ and WRIT of
+// that length.
+//
+typedef struct TDRIVESTATE {
+	quint16 mounted;				// bit per drive with an image mounted
+	quint16 readOnly;				// bit per drive mounted read-only
+	quint16 fixedLen;				// bit per drive held to its track length
+	quint16 maxTrack[MAX_DRIVE];
+	quint16 curTrack[MAX_DRIVE];
+	quint16 trackLen[MAX_DRIVE];			// image track length, else that of the last READ
+	FDCImage *image[MAX_DRIVE];
+	FDCTrackCache *cache[MAX_DRIVE];
+	tpoolimage_t *shared[MAX_DRIVE];		// pool image, nullptr if private
+} tdrivestate_t;
+
+//
+// Link quality over one probe or scoring window
+//
+typedef struct TLINKWINDOW {
+	quint32 frames;					// commands with a good checksum
+	quint32 errors;					// bad checksums, partial or unknown commands
+	quint32 trackBytes;				// READ and WRIT track data
+	quint32 retryBytes;				// of which the FDC+ had to send or ask for again
+} tlinkwindow_t;
+
+//
+// The protocol worker owns the link to the FDC+ and the drive images and
+// runs the READ/WRIT/STAT state machine. The link is a serial port, or a
+// serial device server for port names of the form tcp://host:port. It is moved to its own thread
+// so the FDC+ is never kept waiting on the GUI. The dialog talks to it
+// through queued slots and only receives signals for display.
+//
+// Several workers, one per serial port, can share an image pool. Without
+// one the worker keeps a pool of its own.
+//
+class FDCWorker : public QObject
+{
+	Q_OBJECT
+
+public:
+	FDCWorker(FDCImagePool *imagePool = nullptr, QObject *parent = nullptr);
+	~FDCWorker();
+
+	FDCStatus *status(void) { return &fdcStatus; }
+	void receive(const quint8 *data, int len);
+
+public slots:
+	bool openSerialPort(const QString &portName, int baudRate);
+	void closeSerialPort(void);
+	int mountDrive(int drive, const QString &fname, bool readOnly = false);
+	int mountOverlay(int drive, const QString &fname);
+	bool unmountDrive(int drive);
+	bool snapshotDrive(int drive);
+	bool rollbackDrive(int drive);
+	void warmDrive(int drive);
+	void setTrackCache(bool enable);
+	void setImageBackend(int type, int flushPolicy);
+	void setWriteBehind(bool enable);
+	void setReadAhead(bool enable);
+	void setLowLatency(bool enable);
+	bool startTrace(const QString &fname);
+	void stopTrace(void);
+	void shutdown(void);
+
+signals:
+	void serialPortError(const QString &text);
+	void errorMessage(const QString &text);
+	void linkStatus(const QString &text);
+	void lowLatencyProfile(const QString &text);
+	void baudRateLocked(int baudRate);
+#ifdef DEBUG
+	void debugMessage(const QString &text);
+	void debugDump(const QByteArray &data);
+#endif
+
+private slots:
+	void readyReadSlot();
+	void frameTimeoutSlot();
+	void diagTimeoutSlot();
+	void linkTimeoutSlot();
+
+private:
+	enum RxState {
+		AwaitCommand,					// waiting for a 10 byte command
+		AwaitWriteData					// waiting for WRIT track data and CRC
+	};
+
+	FDCTransport *link;
+	QTimer *frameTimer;
+	QTimer *diagTimer;
+	QTimer *linkTimer;				// probe and link scoring windows
+	FDCDiagQueue diag;
+	FDCStatus fdcStatus;
+	FDCRingBuffer rxBuf;
+	RxState rxState;
+	tcommand_t cmdBuf;
+	tcommand_t statFrame;				// STAT response, rebuilt on mount and unmount
+	quint16 trkBufIdx;
+	quint8 *writeBuf;				// WRIT track data and CRC, aligned
+	quint16 writeSum;				// checksum of the track data so far
+	quint8 crcBuf[CRC_LEN];				// READ checksum
+	quint16 writeDrive;
+	quint16 writeLen;
+	tdrivestate_t drives;
+	FDCImagePool *pool;
+	FDCImagePool *ownPool;
+	FDCImage *privateImage[MAX_DRIVE];
+	FDCTrackCache *privateCache[MAX_DRIVE];
+	FDCOverlayImage *overlay[MAX_DRIVE];		// overlay mount, nullptr if none
+	FDCGeometry geometry[MAX_DRIVE];
+	QString mountPath[MAX_DRIVE];			// pool key of the mounted image
+	bool cacheEnabled;
+	bool writeBehind;
+	QThread *writerThread;
+	FDCWriter *writer;
+	bool readAhead;
+	QThread *prefetchThread;
+	FDCPrefetcher *prefetcher;
+	int imageType;
+	int imageFlush;
+	quint64 statCount;
+	quint64 readCount;
+	quint64 writCount;
+	quint64 cacheHits;				// READs of this session served from cache
+	quint64 cacheMisses;
+	QElapsedTimer clock;
+	qint64 rxTime;					// when the current input arrived
+	qint64 writSent;				// when the last WRIT response was sent
+	bool lowLatency;
+	bool turnaroundReported;
+	tlinkwindow_t linkWindow;
+	int probeIndex;					// rate being probed, -1 once locked
+	int probeBest;					// fastest clean rate so far, -1 if none
+	tlinkwindow_t probeScore[PROBE_RATES];
+	bool probeIdleReported;
+	bool retryWarned;
+	quint16 lastRead;				// param1 of the last READ, 0xffff if none
+	qint64 lastReadTime;
+	bool tracing;
+	bool tracePending;				// traceRec holds an unfinished transaction
+	qint64 traceStart;
+	quint32 traceSeq;
+	ttracerecord_t traceRec;
+	FDCTraceRing traceRing;
+	QThread *traceThread;
+	FDCTraceWriter *traceWriter;
+
+	void processInput(void);
+	void processCommand(void);
+	void processRead(void);
+	void processWrite(void);
+	void processStat(void);
+	void buildStatFrame(void);
+	void writeDataReceived(int len, bool summed = false);
+	void completeWrite(void);
+	void sendWriteStatus(quint16 rcode);
+	void setGeometry(int drive, const FDCGeometry &geom);
+	void recordLatency(int command);
+	void recordTurnaround(void);
+	void probeRate(int index);
+	void probeNext(void);
+	void lockRate(int index);
+	void scoreLink(void);
+	void traceBegin(void);
+	void traceEnd(quint16 rcode, quint16 rdata, quint16 length, quint16 flags = 0);
+	void prefetchFrom(quint16 driveNum, quint16 track);
+	int dirtyCount(void);
+	QString claimError(const QString &fname, const QString &path) const;
+	bool isMounted(quint16 driveNum) const { return drives.mounted & (1 << driveNum); }
+	// The prefetcher only fills the private caches, never a pool entry
+	bool isPrefetchable(quint16 driveNum) const { return drives.shared[driveNum] == nullptr && privateCache[driveNum]->isPrefetchable(); }
+	void linkError(void) { linkWindow.errors++; fdcStatus.linkErrors.fetchAndAddRelaxed(1); }
+	int writeSerialPort(const quint8 *buffer, int len);
+	int writeSerialPort(const tioseg_t *seg, int count);
+};
+#endif
@@ -0,0 +1,81 @@
+/**********************************************************************************
+*
+*  Altair FDC+ Serial Disk Server - Write-Behind Writer
+*      Writes dirty cached tracks to their disk images off the protocol
+*      worker's critical path.
+*
+***********************************************************************************/
+
+#include "fdc-writer.h"
+
+FDCWriter::FDCWriter(FDCTrackCache **caches, int count, QObject *parent)
+	: QObject(parent)
+{
+	cache = caches;
+	cacheCount = count;
+	retryDelay = 0;
+	failing = 0;
+
+	timer = new QTimer(this);
+	timer->setSingleShot(true);
+	connect(timer, &QTimer::timeout, this, &FDCWriter::flush);
+}
+
+//
+// Called from the worker thread
+//
+void FDCWriter::request()
+{
+	if (queued.testAndSetAcquire(0, 1)) {
+		QMetaObject::invokeMethod(this, "schedule", Qt::QueuedConnection);
+	}
+}
+
+void FDCWriter::schedule()
+{
+	if (!timer->isActive()) {
+		timer->start(WRITEBEHIND_DELAY);
+	}
+}
+
+void FDCWriter::flush()
+{
+	int drive;
+	int dirty = 0;
+	bool failed = false;
+
+	// Tracks committed from here on need another flush
+	queued.storeRelease(0);
+
+	for (drive = 0; drive < cacheCount; drive++) {
+		if (cache[drive]->flushDirty() < 0) {
+			if (!(failing & (1 << drive))) {
+				emit writeError(QString("WRIT drive %1 write-behind failed, will retry").arg(drive));
+			}
+
+			failing |= 1 << drive;
+			failed = true;
+		}
+		else {
+			failing &= ~(1 << drive);
+		}
+
+		dirty += cache[drive]->dirtyCount();
+	}
+
+	// Back off while the images keep failing, new WRITs do not cut it short
+	if (failed) {
+		retryDelay = (retryDelay) ? qMin(retryDelay * 2, WRITEBEHIND_RETRY_MAX) : WRITEBEHIND_RETRY;
+		timer->start(retryDelay);
+	}
+	else {
+		retryDelay = 0;
+
+		// Tracks committed during the pass
+		if (dirty) {
+			schedule();
+		}
+	}
+
+	emit flushed(dirty);
+}
@@ -0,0 +1,51 @@
+#ifndef FDCWRITER_H
+#define FDCWRITER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QAtomicInt>
+
+#include "fdc-cache.h"
+
+#define WRITEBEHIND_DELAY	20			// coalesce dirty tracks for this long (ms)
+#define WRITEBEHIND_RETRY	100			// first retry after a failed flush (ms)
+#define WRITEBEHIND_RETRY_MAX	10000			// retry interval doubles up to this (ms)
+
+//
+// Background writer for write-behind mode. The worker calls request()
+// after committing a WRIT to the cache; dirty tracks collected over
+// WRITEBEHIND_DELAY are then written to their images in one pass. Only
+// one schedule() is queued until the flush starts, so a burst of WRITs
+// posts a single event.
+//
+// A failed flush is reported once per drive until that drive flushes
+// again, and retried after an interval that doubles with every failed
+// pass, so a full disk or a removed stick is not retried and logged
+// fifty times a second.
+//
+class FDCWriter : public QObject
+{
+	Q_OBJECT
+
+public:
+	FDCWriter(FDCTrackCache **caches, int count, QObject *parent = nullptr);
+
+	void request(void);
+
+public slots:
+	void schedule(void);
+	void flush(void);
+
+signals:
+	void flushed(int dirty);
+	void writeError(const QString &text);
+
+private:
+	FDCTrackCache **cache;
+	int cacheCount;
+	QTimer *timer;
+	QAtomicInt queued;				// schedule() posted, flush not started
+	int retryDelay;					// current backoff, 0 after a clean pass
+	quint32 failing;				// drives whose failure was reported
+};
+#endif
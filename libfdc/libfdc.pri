@@ -0,0 +1,15 @@
+# Link against libfdc from any project in the tree
+
+LIBFDC_OUT = $$shadowed($$PWD)
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+QT += serialport network
+
+LIBS += -L$$LIBFDC_OUT -lfdc
+
+win32-msvc* {
+	PRE_TARGETDEPS += $$LIBFDC_OUT/fdc.lib
+} else {
+	PRE_TARGETDEPS += $$LIBFDC_OUT/libfdc.a
+}
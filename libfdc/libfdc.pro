@@ -0,0 +1,46 @@
+######################################################################
+# FDC+ protocol engine, linked by the GUI and the headless server
+######################################################################
+
+TEMPLATE = lib
+TARGET = fdc
+CONFIG += staticlib
+DESTDIR = $$OUT_PWD
+INCLUDEPATH += .
+QT = core
+QT += serialport network
+
+# Input
+SOURCES += fdc-worker.cpp
+SOURCES += fdc-cache.cpp
+SOURCES += fdc-image.cpp
+SOURCES += fdc-compressed.cpp
+SOURCES += fdc-geometry.cpp
+SOURCES += fdc-writer.cpp
+SOURCES += fdc-prefetch.cpp
+SOURCES += fdc-diag.cpp
+SOURCES += fdc-trace.cpp
+SOURCES += fdc-checksum.cpp
+SOURCES += fdc-pool.cpp
+SOURCES += fdc-transport.cpp
+SOURCES += fdc-metrics.cpp
+SOURCES += fdc-dashboard.cpp
+
+HEADERS += fdc-protocol.h
+HEADERS += fdc-checksum.h
+HEADERS += fdc-cache.h
+HEADERS += fdc-pool.h
+HEADERS += fdc-image.h
+HEADERS += fdc-compressed.h
+HEADERS += fdc-geometry.h
+HEADERS += fdc-writer.h
+HEADERS += fdc-prefetch.h
+HEADERS += fdc-ringbuffer.h
+HEADERS += fdc-status.h
+HEADERS += fdc-stats.h
+HEADERS += fdc-diag.h
+HEADERS += fdc-trace.h
+HEADERS += fdc-transport.h
+HEADERS += fdc-metrics.h
+HEADERS += fdc-dashboard.h
+HEADERS += fdc-worker.h